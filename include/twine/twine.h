@@ -15,13 +15,24 @@
 #ifndef TWINE_TWINE_H_
 #define TWINE_TWINE_H_
 
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <chrono>
 #include <optional>
+#include <utility>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <type_traits>
+#include <atomic>
+#include <stdexcept>
 
 namespace twine {
 
 constexpr int DEFAULT_SCHED_PRIORITY = 75;
+constexpr size_t DEFAULT_STACK_PREFAULT_SIZE = 256 * 1024;
+constexpr size_t CACHE_LINE_SIZE = 64;
 
 struct VersionInfo
 {
@@ -55,17 +66,69 @@ bool is_current_thread_realtime();
  */
 void set_flush_denormals_to_zero();
 
+/**
+ * @brief printf() that is safe to call from an rt thread. With xenomai, uses the
+ *        xenomai rt_printf(). Otherwise the calling thread only copies the format
+ *        string and the arguments to a lock-free ring of its own, and a background
+ *        thread formats and prints the messages to stdout. The format string must
+ *        therefore stay valid, i.e. be a string literal. Strings passed with %s are
+ *        copied, but may be truncated, and %n is not supported. Messages from rt
+ *        threads are dropped when their thread's ring is full. The first message in
+ *        the process starts the background thread, and a thread claims its ring on
+ *        its first message, which registers a thread_local destructor. Neither is rt
+ *        safe, so rt threads should make one call before they start running in rt
+ *        context.
+ * @return Without xenomai, 0 if the message was queued and -1 if it was dropped.
+ *         Note that unlike printf() and earlier versions of this function, this is
+ *         not the number of characters printed, as the message is only formatted
+ *         later by the background thread. With xenomai the number of characters printed.
+ */
 int rt_printf(const char *format, ...);
 
+/**
+ * @brief Block until all messages from rt_printf() have been printed. Must not be
+ *        called from an rt thread.
+ */
+void flush_rt_printf();
+
+/**
+ * @return The total number of rt_printf() messages dropped in the process, by all
+ *         threads, because their ring was full or too many threads were logging.
+ *         Always 0 with xenomai
+ */
+uint64_t rt_printf_dropped_messages();
+
 typedef void (*WorkerCallback)(void* data);
 
+typedef void (*RangeCallback)(void* data, int chunk_begin, int chunk_end);
+
+typedef void (*ChannelCallback)(void* data, int channel, int notifications);
+
+/**
+ * @brief Selects a subset of the workers in a WorkerPool. Bit n selects the
+ *        worker with id n.
+ */
+typedef uint64_t WorkerMask;
+
+constexpr WorkerMask ALL_WORKERS = ~WorkerMask(0);
+
+/**
+ * @brief How chunks of a parallel_for() range are distributed over the workers
+ */
+enum class ChunkScheduling
+{
+    STATIC,  // Chunks are assigned round robin to the workers up front
+    DYNAMIC  // Chunks are handed out to the first worker asking for one
+};
+
 enum class WorkerPoolStatus
 {
     OK,
     ERROR,
     PERMISSION_DENIED,
     LIMIT_EXCEEDED,
-    INVALID_ARGUMENTS
+    INVALID_ARGUMENTS,
+    BUSY
 };
 
 /**
@@ -77,6 +140,124 @@ enum class WorkerPoolStatus
  */
 std::chrono::nanoseconds current_rt_time();
 
+/**
+ * @brief Lock all current and future memory of the process in ram, and prefault the
+ *        stack of the calling thread and optionally part of the heap, so that rt threads
+ *        don't take page faults. Also keeps freed memory in the heap instead of returning
+ *        it to the system, where supported. Should be called once at startup, before
+ *        any rt threads are started, in both xenomai and posix mode.
+ * @param heap_size The number of bytes of heap to prefault, 0 to not prefault the heap
+ * @param stack_size The number of bytes of the calling thread's stack to prefault
+ * @return WorkerPoolStatus::OK if the operation succeed, WorkerPoolStatus::PERMISSION_DENIED
+ *         or WorkerPoolStatus::LIMIT_EXCEEDED if the memory could not be locked
+ */
+WorkerPoolStatus lock_and_prefault_memory(size_t heap_size = 0, size_t stack_size = DEFAULT_STACK_PREFAULT_SIZE);
+
+/**
+ * @brief Allocate temporary memory from the scratch arena of the calling worker, see
+ *        WorkerPool::set_scratch_arena(). Use instead of new or malloc for buffers that
+ *        are only needed during a cycle. The memory is freed automatically when the
+ *        worker finishes its cycle. Safe to call from an rt thread.
+ * @param size The number of bytes to allocate
+ * @param alignment The alignment of the memory, must be a power of 2
+ * @return A pointer to the memory, or nullptr if the calling thread is not a worker with
+ *         a scratch arena, or if its arena doesn't have enough memory left this cycle
+ */
+void* scratch_allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+
+constexpr int DEFAULT_TRACE_EVENTS_PER_THREAD = 4096;
+
+/**
+ * @brief Start recording a trace of what all worker pools in the process do: when
+ *        workers are released from the barrier, wake up, start and finish their
+ *        callbacks and arrive at the barrier again, together with the zones of
+ *        TraceZone objects. Each thread records to a ring of its own, that keeps its
+ *        last events_per_thread events. Recording is cheap enough to leave on, and
+ *        costs next to nothing when tracing is stopped. Not rt safe.
+ * @param events_per_thread The size of the ring of each thread, rounded up to a power
+ *                          of 2. Only used the first time tracing is started.
+ * @return WorkerPoolStatus::OK if the operation succeed, error status otherwise
+ */
+WorkerPoolStatus start_tracing(int events_per_thread = DEFAULT_TRACE_EVENTS_PER_THREAD);
+
+/**
+ * @brief Stop recording trace events, the events recorded are kept
+ */
+void stop_tracing();
+
+/**
+ * @brief Write the trace events recorded since tracing was last started to a file, in
+ *        Chrome trace event json format, which can be opened in Perfetto or in
+ *        chrome://tracing. Can be called while tracing. Not rt safe.
+ * @param file_name The path of the file to write
+ * @return WorkerPoolStatus::OK if the operation succeed, error status otherwise
+ */
+WorkerPoolStatus write_trace(const char* file_name);
+
+/**
+ * @brief Record the start and the end of a user zone in the trace of the calling
+ *        thread, prefer using TraceZone. Zones in a thread must be nested. Safe to call
+ *        from an rt thread.
+ * @param name The name of the zone, must be a string literal or stay valid until the
+ *             trace has been written
+ */
+void trace_zone_begin(const char* name);
+
+void trace_zone_end(const char* name);
+
+/**
+ * @brief Records a zone in the trace from construction to destruction, i.e. for a
+ *        scope inside a worker callback
+ */
+class TraceZone
+{
+public:
+    explicit TraceZone(const char* name) : _name(name)
+    {
+        trace_zone_begin(_name);
+    }
+
+    ~TraceZone()
+    {
+        trace_zone_end(_name);
+    }
+
+    TraceZone(const TraceZone&) = delete;
+    TraceZone& operator=(const TraceZone&) = delete;
+
+private:
+    const char* _name;
+};
+
+constexpr int TIMING_HISTOGRAM_BINS = 16;
+
+/**
+ * @brief Summary of a set of time measurements
+ */
+struct TimingStats
+{
+    std::chrono::nanoseconds min{0};
+    std::chrono::nanoseconds max{0};
+    std::chrono::nanoseconds mean{0};
+    std::chrono::nanoseconds p50{0};
+    std::chrono::nanoseconds p99{0};
+};
+
+/**
+ * @brief Timing statistics of a worker. The timings are computed over the worker's
+ *        last 256 regular cycles, the counts since the statistics were enabled.
+ */
+struct WorkerTimingStats
+{
+    uint64_t    cycles{0};      // Number of cycles recorded
+    uint64_t    overruns{0};    // Number of callbacks that took longer than the budget
+    TimingStats wake_offset;    // Time from waking up the workers to the start of the callback
+    TimingStats duration;       // Duration of the callback
+    // Bin 0 counts durations below 1 us, bin n durations in [2^(n-1), 2^n) us, and
+    // the last bin all longer durations
+    std::array<int, TIMING_HISTOGRAM_BINS> duration_histogram{};
+};
+
 class WorkerPool
 {
 public:
@@ -84,7 +265,8 @@ public:
      * @brief Construct a WorkerPool object. Throws a `std::runtime_error`
      * if construction fails.
      * @param cores The maximum number of cores to use, must not be higher
-     *              than the number of cores on the machine.
+     *              than the number of cores on the machine. Workers are placed on
+     *              online cpus numbered [0, cores).
      * @param disable_denormals If set, all worker thread sets the FTZ (flush denormals to zero)
      *                          and DAC (denormals are zero) flags.
      * @param break_on_mode_sw If set, enables the break_on_mode_swich flag for every worker
@@ -100,18 +282,57 @@ public:
     virtual ~WorkerPool() = default;
 
     /**
-     * @brief Add a worker to the pool
+     * @brief Add a worker to the pool. Workers get ids in the order they are added,
+     *        starting from 0, except that the lowest id of a removed worker is reused.
+     *        Must not be called while the pool is running cycles.
      * @param worker_cb The worker callback function that will called by he worker
      * @param worker_data A data pointer that will be passed to the worker callback
      * @param sched_priority Worker priority in [0, 100] (higher numbers mean higher priorities)
-     * @param cpu_id Optional CPU core affinity preference. If left unspecified,
-     *               the first core with least usage is picked
+     * @param cpu_id Optional CPU core affinity preference. If left unspecified, the
+     *               core is picked from the cpu topology: the least used online core,
+     *               preferring cores whose smt siblings are not used, isolated cores,
+     *               cores sharing cache with workers of the same cache_group and cores
+     *               sharing cache with fewer other workers, in that order
+     * @param cache_group Optional id of a group of workers that share data, i.e. that
+     *               process the same buffers. Workers with the same id are placed on
+     *               cores sharing the last level cache when possible. Ignored if cpu_id
+     *               is given.
      *
-     * @return WorkerPoolStatus::OK if the operation succeed, error status otherwise
+     * @return WorkerPoolStatus::OK if the operation succeed, WorkerPoolStatus::LIMIT_EXCEEDED
+     *         if the pool already has 64 workers, error status otherwise
      */
     virtual WorkerPoolStatus add_worker(WorkerCallback worker_cb, void* worker_data,
                                         int sched_priority=DEFAULT_SCHED_PRIORITY,
-                                        std::optional<int> cpu_id=std::nullopt) = 0;
+                                        std::optional<int> cpu_id=std::nullopt,
+                                        std::optional<int> cache_group=std::nullopt) = 0;
+
+    /**
+     * @brief Remove a worker from the pool between two cycles, without stopping the
+     *        other workers. The thread controlling the pool removes it at the start of
+     *        the next cycle, without locking, and the call blocks until then, for at
+     *        most one second. The pool must therefore be cycled while the call blocks.
+     *        Must be called from a non-rt thread, i.e. not from the thread controlling
+     *        the pool.
+     * @param worker_id The id of the worker to remove
+     * @return WorkerPoolStatus::OK if the operation succeed, BUSY if no cycle was started
+     *         within one second, in which case the worker is not removed, error status
+     *         otherwise
+     */
+    virtual WorkerPoolStatus remove_worker(int worker_id) = 0;
+
+    /**
+     * @brief Replace the callback of a worker. Like remove_worker(), the change is
+     *        applied between two cycles and the call blocks until it has been, for at
+     *        most one second. When the call returns the old callback will not be called
+     *        again, and its data can be safely released.
+     * @param worker_id The id of the worker
+     * @param worker_cb The new worker callback function
+     * @param worker_data A data pointer that will be passed to the new worker callback
+     * @return WorkerPoolStatus::OK if the operation succeed, BUSY if the change could
+     *         not be applied in time, in which case the old callback is kept, error
+     *         status otherwise
+     */
+    virtual WorkerPoolStatus replace_callback(int worker_id, WorkerCallback worker_cb, void* worker_data) = 0;
 
     /**
      * @brief Wait for all workers to finish and become idle. Will block until all
@@ -119,12 +340,37 @@ public:
      */
     virtual void wait_for_workers_idle() = 0;
 
+    /**
+     * @brief Same as wait_for_workers_idle(), but gives up waiting when deadline passes.
+     * @param deadline The latest time to return, in the time of current_rt_time()
+     * @return 0 if all workers are idle, otherwise a bitmask of the workers still running
+     */
+    virtual WorkerMask wait_for_workers_idle_until(std::chrono::nanoseconds deadline) = 0;
+
     /**
      * @brief Signal all workers to run call their respective callback functions in
      *        an unspecified order. The call will not block until all workers have finished.
      */
     virtual void wakeup_workers() = 0;
 
+    /**
+     * @brief Signal only the workers selected by workers to run their callbacks.
+     *        The other workers stay parked and are not woken up at all. The call will
+     *        not block until the workers have finished.
+     * @param workers Bitmask of the workers to wake up, bits for workers that do not
+     *                exist are ignored
+     */
+    virtual void wakeup_workers(WorkerMask workers) = 0;
+
+    /**
+     * @brief Same as wakeup_workers(), but safe to call while workers from an earlier
+     *        cycle are still running, in which case no worker is woken up.
+     * @param workers Bitmask of the workers to wake up, all workers by default
+     * @return WorkerPoolStatus::OK if the workers were woken up, WorkerPoolStatus::BUSY
+     *         if workers are still running
+     */
+    virtual WorkerPoolStatus try_wakeup(WorkerMask workers = ALL_WORKERS) = 0;
+
     /**
      * @brief Signal all workers to run call their respective callback functions in
      *        an unspecified order and block until all workers have finished in a
@@ -132,6 +378,259 @@ public:
      */
     virtual void wakeup_and_wait() = 0;
 
+    /**
+     * @brief Same as wakeup_and_wait(), but only the workers selected by workers
+     *        are woken up and waited for. The other workers stay parked.
+     * @param workers Bitmask of the workers to wake up, bits for workers that do not
+     *                exist are ignored
+     */
+    virtual void wakeup_and_wait(WorkerMask workers) = 0;
+
+    /**
+     * @brief Same as wakeup_and_wait(), but gives up waiting for the workers when deadline
+     *        passes, so that a stalled worker doesn't make the calling thread miss its own
+     *        deadline. Workers still running keep running, and no workers are woken up
+     *        until they have finished. Use wait_for_workers_idle_until(), try_wakeup() or
+     *        this function again to find out when they have.
+     * @param deadline The latest time to return, in the time of current_rt_time()
+     * @param workers Bitmask of the workers to wake up, all workers by default
+     * @return WorkerPoolStatus::OK and 0 if all workers finished in time, WorkerPoolStatus::OK
+     *         and a bitmask of the workers still running if the deadline passed, or
+     *         WorkerPoolStatus::BUSY and a bitmask of the workers still running from an
+     *         earlier cycle, in which case no workers were woken up
+     */
+    virtual std::pair<WorkerPoolStatus, WorkerMask> wakeup_and_wait_until(std::chrono::nanoseconds deadline,
+                                                                         WorkerMask workers = ALL_WORKERS) = 0;
+
+    /**
+     * @brief Let workers busy wait for the next cycle for up to spin_time after finishing
+     *        their callbacks, before blocking. This reduces the wakeup latency of workers
+     *        at the expense of cpu usage. Workers stop spinning and block directly when the
+     *        time between cycles is longer than spin_time, i.e. when the pool is no longer
+     *        woken up periodically, and resume spinning when cycles are frequent again.
+     * @param spin_time The maximum time to busy wait. 0, the default, disables spinning.
+     * @return WorkerPoolStatus::OK if the operation succeed, error status otherwise
+     */
+    virtual WorkerPoolStatus set_spin_time(std::chrono::nanoseconds spin_time) = 0;
+
+    /**
+     * @brief Let the thread calling wakeup_and_wait(), run_graph(), run_tasks() or
+     *        parallel_for() do a share of the cycle's work, instead of idling until the
+     *        workers are done. In regular cycles the calling thread runs caller_cb, if
+     *        set, after waking up the workers. In the other cycle types it runs jobs,
+     *        tasks and chunks alongside the workers, as if it was an extra worker.
+     *        wakeup_workers() is not affected. Must not be called during a cycle.
+     * @param enabled Whether the calling thread should participate
+     * @param caller_cb The callback to call from wakeup_and_wait(), can be nullptr
+     * @param caller_data A data pointer that will be passed to caller_cb
+     * @return WorkerPoolStatus::OK if the operation succeed, error status otherwise
+     */
+    virtual WorkerPoolStatus set_caller_participation(bool enabled, WorkerCallback caller_cb = nullptr,
+                                                      void* caller_data = nullptr) = 0;
+
+    /**
+     * @brief Measure how long the callback of each worker takes, over a sliding window
+     *        of the last 64 cycles, and move workers between cores to even out the load.
+     *        Every 64 cycles, at the start of a cycle, the workers are redistributed to
+     *        minimise the total load of the most loaded core. Workers are only moved if
+     *        this lowers that load by at least 10%, so they don't move back and forth on
+     *        small variations. Workers added with an explicit cpu_id are never moved.
+     *        Not supported for xenomai threads or on macOS. Must not be called during a cycle.
+     * @param enabled Whether to measure worker loads and rebalance the workers
+     * @return WorkerPoolStatus::OK if the operation succeed, WorkerPoolStatus::ERROR if
+     *         not supported
+     */
+    virtual WorkerPoolStatus set_load_balancing(bool enabled) = 0;
+
+    /**
+     * @brief Run workers added after this call under SCHED_DEADLINE instead of SCHED_FIFO.
+     *        Each worker is then guaranteed runtime of cpu time every period, finished
+     *        at the latest deadline after the start of the period. Typically period and
+     *        deadline are the audio period and runtime the worst case time of a worker's
+     *        callback, including any spin time. The kernel does admission control, and
+     *        add_worker() returns WorkerPoolStatus::LIMIT_EXCEEDED if the worker does not
+     *        fit in the available bandwidth. As the kernel requires deadline threads to be
+     *        allowed on all cpus, workers can not be added with a cpu_id and are not moved
+     *        by load balancing, and their sched_priority is not used. During run_graph(),
+     *        deadline workers waiting for jobs to become ready spin without yielding, as a
+     *        yield would give up their remaining runtime for the period. That spin time counts
+     *        against the runtime, so it should cover the longest wait in the graph.
+     *        Not supported for xenomai threads or on macOS. Must not be called during a cycle.
+     * @param runtime The cpu time per period, 0 to go back to SCHED_FIFO for new workers
+     * @param deadline The time from the start of the period the runtime must be finished within
+     * @param period The period, deadline and period can not be shorter than runtime
+     * @return WorkerPoolStatus::OK if the operation succeed. If the kernel or the permissions
+     *         of the process don't allow the parameters, an error status is returned and
+     *         new workers keep using SCHED_FIFO.
+     */
+    virtual WorkerPoolStatus set_deadline_scheduling(std::chrono::nanoseconds runtime,
+                                                     std::chrono::nanoseconds deadline,
+                                                     std::chrono::nanoseconds period) = 0;
+
+    /**
+     * @brief Set the stack of workers added after this call. By default workers get
+     *        the system's default stack, which is faulted in lazily, so a worker can take
+     *        page faults the first time a callback goes deep into its stack.
+     *        Must not be called during a cycle.
+     * @param stack_size The stack size in bytes, 0 for the system default
+     * @param guard_size The size in bytes of the guard area below the stack, which turns
+     *                   a stack overflow into a segfault instead of silently overwriting
+     *                   other memory. Rounded up to whole pages, 0 disables the guard.
+     * @param lock_and_prefault If set, each worker touches every page of its stack and
+     *                          locks it in memory before it is first woken up. add_worker()
+     *                          fails if the stack can not be locked, i.e. if it exceeds
+     *                          RLIMIT_MEMLOCK.
+     * @return WorkerPoolStatus::OK if the operation succeed, error status otherwise
+     */
+    virtual WorkerPoolStatus set_worker_stack(size_t stack_size, size_t guard_size, bool lock_and_prefault) = 0;
+
+    /**
+     * @brief Give workers added after this call a scratch arena, from which their
+     *        callbacks can allocate temporary memory with scratch_allocate(). Each worker
+     *        allocates its arena and touches every page of it before it is first woken
+     *        up, so the memory is local to the worker's cpu. All allocations are freed
+     *        at the end of every cycle. add_worker() fails if the arena can not be
+     *        allocated. Must not be called during a cycle.
+     * @param size The size in bytes of each worker's arena, 0, the default, for none
+     * @param huge_pages If set, back the arenas with huge pages where possible, rounding
+     *                   the size up to a multiple of 2 MB
+     * @return WorkerPoolStatus::OK if the operation succeed, error status otherwise
+     */
+    virtual WorkerPoolStatus set_scratch_arena(size_t size, bool huge_pages = false) = 0;
+
+    /**
+     * @brief Record the wake offset and callback duration of every worker in each
+     *        regular cycle, see get_timing_stats(). Enabling resets all recorded timings.
+     *        Must not be called during a cycle.
+     * @param enabled Whether to record timings
+     * @param budget Callbacks that take longer than budget are counted as overruns,
+     *               0, the default, disables counting overruns
+     * @return WorkerPoolStatus::OK if the operation succeed, error status otherwise
+     */
+    virtual WorkerPoolStatus set_timing_stats(bool enabled,
+                                              std::chrono::nanoseconds budget = std::chrono::nanoseconds(0)) = 0;
+
+    /**
+     * @brief Get the timing statistics of a worker. Safe to call from an rt thread,
+     *        also while the worker runs, in which case the timings of the ongoing
+     *        cycle may or may not be included. Must not be called concurrently with
+     *        add_worker() or remove_worker().
+     * @param worker_id The id of the worker
+     * @param stats Filled with the statistics of the worker
+     * @return WorkerPoolStatus::OK if the operation succeed, error status otherwise
+     */
+    virtual WorkerPoolStatus get_timing_stats(int worker_id, WorkerTimingStats& stats) const = 0;
+
+    /**
+     * @brief Add a job to the pool's job graph. All jobs in the graph are run by the
+     *        workers in a single call to run_graph(), every job only after all the jobs
+     *        it depends on have finished. Must not be called while run_graph() is running.
+     * @param job_cb The job function to call
+     * @param job_data A data pointer that will be passed to the job function
+     * @param dependencies Ids of jobs that must finish before this job can start. As these
+     *                     must already be in the graph, the graph can not contain cycles.
+     * @return WorkerPoolStatus::OK and the id of the new job if the operation succeed,
+     *         error status otherwise
+     */
+    virtual std::pair<WorkerPoolStatus, int> add_graph_job(WorkerCallback job_cb, void* job_data,
+                                                          const std::vector<int>& dependencies = {}) = 0;
+
+    /**
+     * @brief Remove all jobs from the pool's job graph. Must not be called while
+     *        run_graph() is running.
+     */
+    virtual void clear_graph() = 0;
+
+    /**
+     * @brief Run all jobs in the job graph on the workers and block until all are done.
+     *        Jobs are handed to idle workers as soon as their dependencies have finished,
+     *        jobs on the longest remaining path through the graph first, based on the
+     *        durations measured in previous runs. Worker callbacks are not called.
+     * @return WorkerPoolStatus::OK if the operation succeed, error status otherwise
+     */
+    virtual WorkerPoolStatus run_graph() = 0;
+
+    /**
+     * @brief Submit a task to be run by the workers in the next call to run_tasks(),
+     *        which spreads the tasks over per-worker queues of the workers present at
+     *        that time. Idle workers steal tasks from the queues of busy workers. Tasks
+     *        are matched between cycles by the order they are submitted in and are
+     *        queued to the worker that ran the same task in the previous cycle when
+     *        possible, to make use of its warm cache.
+     *        Does not lock or allocate and is safe to call from a realtime thread, but
+     *        must not be called while run_tasks() is running.
+     * @param task_cb The task function to call
+     * @param task_data A data pointer that will be passed to the task function
+     * @return WorkerPoolStatus::OK if the operation succeed, LIMIT_EXCEEDED if too many
+     *         tasks were submitted, error status otherwise
+     */
+    virtual WorkerPoolStatus submit_task(WorkerCallback task_cb, void* task_data) = 0;
+
+    /**
+     * @brief Run all tasks submitted since the last call on the workers, and block until
+     *        all have finished. Worker callbacks are not called.
+     * @return WorkerPoolStatus::OK if the operation succeed, ERROR if all workers were
+     *         removed since the tasks were submitted, in which case they are dropped,
+     *         error status otherwise
+     */
+    virtual WorkerPoolStatus run_tasks() = 0;
+
+    /**
+     * @brief Split the range [begin, end) into chunks of grain elements and call
+     *        function(chunk_begin, chunk_end) for every chunk on the pool's workers.
+     *        Blocks until the whole range has been processed. Worker callbacks are not
+     *        called. Does not lock or allocate, function is called by reference.
+     * @param begin The first index of the range
+     * @param end One past the last index of the range
+     * @param grain The number of indices per chunk, the last chunk may be smaller
+     * @param function Callable with signature void(int chunk_begin, int chunk_end)
+     * @param scheduling Whether chunks are assigned to workers statically or dynamically
+     * @return WorkerPoolStatus::OK if the operation succeed, error status otherwise
+     */
+    template <typename Function>
+    WorkerPoolStatus parallel_for(int begin, int end, int grain, Function&& function,
+                                  ChunkScheduling scheduling = ChunkScheduling::DYNAMIC)
+    {
+        using FunctionType = std::remove_reference_t<Function>;
+        auto range_callback = [](void* data, int chunk_begin, int chunk_end)
+        {
+            (*static_cast<FunctionType*>(data))(chunk_begin, chunk_end);
+        };
+        return run_parallel_for(begin, end, grain, range_callback,
+                                const_cast<void*>(static_cast<const void*>(std::addressof(function))), scheduling);
+    }
+
+    /**
+     * @brief Call all functions in parallel on the pool's workers and block until all
+     *        have returned. Does not lock or allocate, functions are called by reference.
+     * @param functions Callables with signature void()
+     * @return WorkerPoolStatus::OK if the operation succeed, error status otherwise
+     */
+    template <typename... Functions>
+    WorkerPoolStatus parallel_invoke(Functions&&... functions)
+    {
+        using Invoker = void (*)(void*);
+        const std::array<std::pair<Invoker, void*>, sizeof...(Functions)> calls = {{
+            {[](void* data) {(*static_cast<std::remove_reference_t<Functions>*>(data))();},
+             const_cast<void*>(static_cast<const void*>(std::addressof(functions)))}...
+        }};
+        return parallel_for(0, static_cast<int>(calls.size()), 1, [&calls](int chunk_begin, int chunk_end)
+        {
+            for (int i = chunk_begin; i < chunk_end; ++i)
+            {
+                calls[i].first(calls[i].second);
+            }
+        });
+    }
+
+    /**
+     * @brief Type erased implementation of parallel_for(), calls callback(data, chunk_begin,
+     *        chunk_end) for every chunk of the range.
+     * @return WorkerPoolStatus::OK if the operation succeed, error status otherwise
+     */
+    virtual WorkerPoolStatus run_parallel_for(int begin, int end, int grain, RangeCallback callback,
+                                              void* data, ChunkScheduling scheduling) = 0;
+
 protected:
     WorkerPool() = default;
 };
@@ -162,16 +661,650 @@ public:
     /**
      * @brief Blocks until notify() is called from a realtime thread. Call from a non-rt
      *        thread to wait until the rt thread signals. A maximum of one thread can wait
-     *        on the condition variable at a time.
+     *        on the condition variable at a time. A call to notify() made while no
+     *        thread was waiting makes the next call return immediately, and several
+     *        calls to notify() may be merged into one wakeup.
      * @return true if the condition variable was woken up by a call to notify()
      *              spurious wakeups could happen on some systems.
      */
     virtual bool wait() = 0;
 
+    /**
+     * @brief Same as wait(), but returns the number of calls to notify() since the
+     *        last wait returned, so that a consumer can handle all of them in one batch.
+     * @return The number of notifications, at least 1
+     */
+    virtual int wait_counted() = 0;
+
+    /**
+     * @brief Same as wait_counted(), but gives up waiting when deadline passes
+     * @param deadline The latest time to return, in the time of current_rt_time()
+     * @return The number of notifications since the last wait returned, 0 if the
+     *         deadline passed without any
+     */
+    virtual int wait_until(std::chrono::nanoseconds deadline) = 0;
+
+    /**
+     * @brief Same as wait_counted(), but gives up waiting after timeout
+     * @return The number of notifications since the last wait returned, 0 if the
+     *         timeout passed without any
+     */
+    int wait_for(std::chrono::nanoseconds timeout)
+    {
+        return wait_until(current_rt_time() + timeout);
+    }
+
+    /**
+     * @brief Get a file descriptor that becomes readable when notify() is called, so
+     *        that the condition variable can be watched with poll(), select() or epoll
+     *        together with other file descriptors. When it is readable, call
+     *        wait_until() with a deadline that has passed to take the notifications,
+     *        which also resets the descriptor. It may occasionally be readable without
+     *        any notifications, in which case that call returns 0. Do not read from
+     *        or close the descriptor, it is owned by the condition variable.
+     *        Not safe to call from a realtime thread.
+     * @return A file descriptor, or -1 if it could not be created
+     */
+    virtual int native_handle() = 0;
+
+    /**
+     * @brief Wait until one or more of a set of condition variables are notified.
+     *        The notifications of all condition variables that fired are taken, as if
+     *        wait_counted() was called on each of them. Not safe to call from a
+     *        realtime thread.
+     * @param cond_vars An array of condition variables, none of which may be waited on
+     *        by another thread at the same time
+     * @param no_cond_vars The number of condition variables, at most 64
+     * @param deadline The latest time to return, in the time of current_rt_time(),
+     *        or no value to wait indefinitely
+     * @param notifications If not null, an array of no_cond_vars elements that is filled
+     *        with the number of notifications of every condition variable
+     * @return A mask with bit n set if cond_vars[n] was notified, 0 if the deadline
+     *         passed without any notifications or if the arguments were not valid
+     */
+    static uint64_t wait_any(RtConditionVariable* const* cond_vars, int no_cond_vars,
+                             std::optional<std::chrono::nanoseconds> deadline = std::nullopt,
+                             int* notifications = nullptr);
+
 protected:
     RtConditionVariable() = default;
 };
 
+/**
+ * @brief Wait-free ring buffer for passing data from one producer thread to one
+ *        consumer thread, typically from an rt thread to a non-rt thread. Neither
+ *        side ever locks or allocates, and the read and write indices are kept on
+ *        separate cache lines. If a notifier is given, it is notified only when the
+ *        ring goes from empty to non-empty, not for every element. The consumer should
+ *        therefore pop until the ring is empty before it waits on the notifier again.
+ *        T must be trivially copyable, as elements are copied in and out of the ring.
+ */
+template <typename T>
+class SpscRingBuffer
+{
+    static_assert(std::is_trivially_copyable_v<T> && std::is_default_constructible_v<T>,
+                  "SpscRingBuffer elements must be trivially copyable");
+public:
+    /**
+     * @brief Construct an SpscRingBuffer object. Allocates memory, so must not be called
+     *        from an rt thread. Will throw std::runtime_error if capacity is invalid.
+     * @param capacity The maximum number of elements in the ring, rounded up to a power of 2
+     * @param notifier The condition variable to notify when the ring becomes non-empty,
+     *                 may be nullptr
+     */
+    explicit SpscRingBuffer(int capacity, RtConditionVariable* notifier = nullptr) : _notifier(notifier)
+    {
+        if (capacity <= 0 || capacity > (1 << 30))
+        {
+            throw std::runtime_error("Invalid ring buffer capacity");
+        }
+        size_t rounded_capacity = 1;
+        while (rounded_capacity < static_cast<size_t>(capacity))
+        {
+            rounded_capacity *= 2;
+        }
+        _mask = rounded_capacity - 1;
+        _buffer.resize(rounded_capacity);
+    }
+
+    SpscRingBuffer(const SpscRingBuffer&) = delete;
+    SpscRingBuffer& operator=(const SpscRingBuffer&) = delete;
+
+    /**
+     * @brief Push an element to the ring, call from the producer thread only
+     * @return true if the element was pushed, false if the ring was full
+     */
+    bool push(const T& element)
+    {
+        return push(&element, 1) == 1;
+    }
+
+    /**
+     * @brief Push up to count elements to the ring, call from the producer thread only
+     * @return The number of elements pushed, fewer than count if the ring became full
+     */
+    int push(const T* elements, int count)
+    {
+        int pushed = 0;
+        while (pushed < count)
+        {
+            auto [space, size] = reserve(count - pushed);
+            if (size == 0)
+            {
+                break;
+            }
+            std::copy(elements + pushed, elements + pushed + size, space);
+            commit(size);
+            pushed += size;
+        }
+        return pushed;
+    }
+
+    /**
+     * @brief Get space in the ring to write up to count elements to directly, without
+     *        copying. Call from the producer thread only, then call commit() to make the
+     *        elements written available to the consumer. The space is contiguous, so
+     *        fewer elements than count may be returned at the end of the ring even if
+     *        there is more free space, call reserve() again after commit() for the rest.
+     * @param count The maximum number of elements to reserve
+     * @return A pointer to the first element and the number of elements reserved,
+     *         0 if the ring is full
+     */
+    std::pair<T*, int> reserve(int count)
+    {
+        size_t write = _write.load(std::memory_order_relaxed);
+        size_t free = _mask + 1 - (write - _cached_read);
+        if (free < static_cast<size_t>(count))
+        {
+            _cached_read = _read.load(std::memory_order_acquire);
+            free = _mask + 1 - (write - _cached_read);
+        }
+        size_t offset = write & _mask;
+        size_t size = std::min({free, static_cast<size_t>(std::max(count, 0)), _mask + 1 - offset});
+        return {_buffer.data() + offset, static_cast<int>(size)};
+    }
+
+    /**
+     * @brief Make count elements written to the space returned by reserve() available
+     *        to the consumer. Call from the producer thread only.
+     * @param count The number of elements written, not more than were reserved
+     */
+    void commit(int count)
+    {
+        size_t write = _write.load(std::memory_order_relaxed);
+        _write.store(write + count, std::memory_order_release);
+        if (_notifier != nullptr && count > 0)
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            _cached_read = _read.load(std::memory_order_relaxed);
+            if (_cached_read == write)
+            {
+                _notifier->notify();
+            }
+        }
+    }
+
+    /**
+     * @brief Pop an element from the ring, call from the consumer thread only
+     * @return true if an element was popped, false if the ring was empty
+     */
+    bool pop(T& element)
+    {
+        return pop(&element, 1) == 1;
+    }
+
+    /**
+     * @brief Pop up to max_count elements from the ring, call from the consumer thread only
+     * @return The number of elements popped, 0 if the ring was empty
+     */
+    int pop(T* elements, int max_count)
+    {
+        int popped = 0;
+        while (popped < max_count)
+        {
+            auto [data, size] = peek(max_count - popped);
+            if (size == 0)
+            {
+                break;
+            }
+            std::copy(data, data + size, elements + popped);
+            consume(size);
+            popped += size;
+        }
+        return popped;
+    }
+
+    /**
+     * @brief Get up to max_count elements at the front of the ring to read directly,
+     *        without copying. Call from the consumer thread only, then call consume() to
+     *        remove the elements read. Like reserve(), returns only contiguous elements.
+     * @param max_count The maximum number of elements to get
+     * @return A pointer to the first element and the number of elements, 0 if the ring
+     *         is empty
+     */
+    std::pair<const T*, int> peek(int max_count)
+    {
+        size_t read = _read.load(std::memory_order_relaxed);
+        if (_cached_write - read < static_cast<size_t>(max_count))
+        {
+            if (_notifier != nullptr)
+            {
+                // Pairs with the fence in commit(), either the producer sees that the
+                // ring was emptied or the consumer sees the new elements
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            }
+            _cached_write = _write.load(std::memory_order_acquire);
+        }
+        size_t offset = read & _mask;
+        size_t size = std::min({_cached_write - read, static_cast<size_t>(std::max(max_count, 0)),
+                                _mask + 1 - offset});
+        return {_buffer.data() + offset, static_cast<int>(size)};
+    }
+
+    /**
+     * @brief Remove count elements returned by peek() from the ring. Call from the
+     *        consumer thread only.
+     * @param count The number of elements to remove, not more than were returned
+     */
+    void consume(int count)
+    {
+        _read.store(_read.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+
+    /**
+     * @return The number of elements in the ring. Only exact when called from the
+     *         producer or consumer thread while the other side is not active.
+     */
+    int size() const
+    {
+        size_t read = _read.load(std::memory_order_acquire);
+        return static_cast<int>(_write.load(std::memory_order_acquire) - read);
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    /**
+     * @return The maximum number of elements in the ring
+     */
+    int capacity() const
+    {
+        return static_cast<int>(_mask + 1);
+    }
+
+private:
+    RtConditionVariable* _notifier;
+    size_t               _mask{0};
+    std::vector<T>       _buffer;
+
+    // Written by the producer only
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> _write{0};
+    size_t _cached_read{0};
+
+    // Written by the consumer only
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> _read{0};
+    size_t _cached_write{0};
+};
+
+/**
+ * @brief Bounded lock-free queue for passing data from many producer threads to one
+ *        consumer thread, typically from the workers of a WorkerPool to a non-rt thread.
+ *        Pushing never locks, blocks or allocates. Pushing does not notify the consumer,
+ *        instead notify_consumer() is called once per batch, i.e. once per pool cycle by
+ *        the thread waking up the pool, so that the consumer is woken up at most once
+ *        per cycle however many elements the workers push. A producer that is preempted
+ *        in the middle of push() delays the consumer from seeing elements pushed after
+ *        it until the producer is resumed.
+ *        T must be trivially copyable, as elements are copied in and out of the queue.
+ */
+template <typename T>
+class MpscQueue
+{
+    static_assert(std::is_trivially_copyable_v<T> && std::is_default_constructible_v<T>,
+                  "MpscQueue elements must be trivially copyable");
+public:
+    /**
+     * @brief Construct an MpscQueue object. Allocates memory, so must not be called
+     *        from an rt thread. Will throw std::runtime_error if capacity is invalid.
+     * @param capacity The maximum number of elements in the queue, rounded up to a power of 2
+     * @param notifier The condition variable to notify from notify_consumer(), may be nullptr
+     */
+    explicit MpscQueue(int capacity, RtConditionVariable* notifier = nullptr) : _notifier(notifier)
+    {
+        if (capacity <= 0 || capacity > (1 << 30))
+        {
+            throw std::runtime_error("Invalid queue capacity");
+        }
+        size_t rounded_capacity = 1;
+        while (rounded_capacity < static_cast<size_t>(capacity))
+        {
+            rounded_capacity *= 2;
+        }
+        _mask = rounded_capacity - 1;
+        _cells = std::vector<Cell>(rounded_capacity);
+        for (size_t i = 0; i < rounded_capacity; ++i)
+        {
+            _cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    /**
+     * @brief Push an element to the queue, safe to call from any number of threads
+     *        concurrently, including rt threads
+     * @return true if the element was pushed, false if the queue was full
+     */
+    bool push(const T& element)
+    {
+        size_t position = _tail.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true)
+        {
+            cell = &_cells[position & _mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(sequence - position);
+            if (diff == 0)
+            {
+                if (_tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                // The cell still holds an element from the previous lap
+                return false;
+            }
+            else
+            {
+                position = _tail.load(std::memory_order_relaxed);
+            }
+        }
+        cell->element = element;
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Notify the consumer if elements were pushed since the last call. Call once
+     *        per batch of pushes, e.g. after each call to WorkerPool::wakeup_and_wait().
+     *        Safe to call from an rt thread.
+     */
+    void notify_consumer()
+    {
+        size_t tail = _tail.load(std::memory_order_acquire);
+        if (_notifier != nullptr && _notified_tail.exchange(tail, std::memory_order_relaxed) != tail)
+        {
+            _notifier->notify();
+        }
+    }
+
+    /**
+     * @brief Pop an element from the queue, call from the consumer thread only
+     * @return true if an element was popped, false if the queue was empty
+     */
+    bool pop(T& element)
+    {
+        size_t position = _head.load(std::memory_order_relaxed);
+        Cell& cell = _cells[position & _mask];
+        if (cell.sequence.load(std::memory_order_acquire) != position + 1)
+        {
+            return false;
+        }
+        element = cell.element;
+        // Marks the cell as free for the producers in the next lap
+        cell.sequence.store(position + _mask + 1, std::memory_order_release);
+        _head.store(position + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * @brief Pop up to max_count elements from the queue, call from the consumer thread only
+     * @return The number of elements popped, 0 if the queue was empty
+     */
+    int pop(T* elements, int max_count)
+    {
+        int popped = 0;
+        while (popped < max_count && pop(elements[popped]))
+        {
+            popped++;
+        }
+        return popped;
+    }
+
+    /**
+     * @brief Pop all elements in the queue and call function(const T& element) for each,
+     *        call from the consumer thread only
+     * @return The number of elements popped
+     */
+    template <typename Function>
+    int drain(Function&& function)
+    {
+        int popped = 0;
+        T element;
+        while (pop(element))
+        {
+            function(element);
+            popped++;
+        }
+        return popped;
+    }
+
+    /**
+     * @return The approximate number of elements in the queue, including elements that
+     *         are in the middle of being pushed
+     */
+    int size() const
+    {
+        size_t head = _head.load(std::memory_order_relaxed);
+        return static_cast<int>(_tail.load(std::memory_order_relaxed) - head);
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    /**
+     * @return The maximum number of elements in the queue
+     */
+    int capacity() const
+    {
+        return static_cast<int>(_mask + 1);
+    }
+
+private:
+    struct Cell
+    {
+        // Equal to the position when the cell is free, and to position + 1 when an
+        // element has been pushed to it
+        std::atomic<size_t> sequence{0};
+        T                   element;
+    };
+
+    RtConditionVariable* _notifier;
+    size_t               _mask{0};
+    std::vector<Cell>    _cells;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> _tail{0};
+    std::atomic<size_t> _notified_tail{0};
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> _head{0};
+};
+
+/**
+ * @brief Statistics of a BlockPool
+ */
+struct BlockPoolStats
+{
+    int      capacity{0};            // The total number of blocks in the pool
+    int      available{0};           // Free blocks, not counting those held in thread caches
+    int      min_available{0};       // The lowest value of available since the last refill
+    uint64_t failed_allocations{0};  // Calls to allocate() that returned nullptr
+};
+
+/**
+ * @brief Pool of fixed size memory blocks that can be allocated and freed from any
+ *        thread, including rt threads, without locks or system calls. All memory is
+ *        allocated and prefaulted by non-rt threads, when creating the pool or from
+ *        refill(). Every thread keeps a small cache of free blocks, so that most calls
+ *        don't touch memory shared with other threads. Blocks freed by a thread beyond
+ *        those it has allocated itself go straight back to the pool, so a thread that
+ *        only frees blocks holds on to none of them. The cache of a thread is set up
+ *        on its first call to allocate() or deallocate(), which is not rt safe, so rt
+ *        threads should make one call before they start running in rt context. A thread
+ *        has caches for a limited number of pools, beyond that it uses the pool directly.
+ *        Its caches of destroyed pools are released when it creates or refills a pool.
+ */
+class BlockPool
+{
+public:
+    /**
+     * @brief Construct a BlockPool object.
+     *        Will throw std::runtime_error if the arguments are invalid or the memory
+     *        can not be allocated.
+     * @param block_size The size of each block in bytes. Blocks are aligned as memory
+     *                   returned from malloc().
+     * @param no_blocks The number of blocks to allocate up front
+     * @param low_watermark When the number of available blocks drops to this, notifier is
+     *                      notified, so that a non-rt thread waiting on it can call refill()
+     *                      before the pool runs out. Notified once each time the number
+     *                      of available blocks drops below it.
+     * @param notifier The condition variable to notify, may be nullptr
+     * @return
+     */
+    static std::unique_ptr<BlockPool> create_block_pool(size_t block_size,
+                                                        int no_blocks,
+                                                        int low_watermark = 0,
+                                                        RtConditionVariable* notifier = nullptr);
+
+    virtual ~BlockPool() = default;
+
+    /**
+     * @brief Allocate a block, safe to call from an rt thread
+     * @return A pointer to the block, or nullptr if there are no free blocks
+     */
+    virtual void* allocate() = 0;
+
+    /**
+     * @brief Return a block to the pool, safe to call from an rt thread. The block may
+     *        be returned from a different thread than it was allocated from.
+     * @param block A block allocated from this pool, or nullptr
+     */
+    virtual void deallocate(void* block) = 0;
+
+    /**
+     * @brief Add blocks to the pool. Allocates memory, so must not be called from an
+     *        rt thread, but can be called while other threads use the pool.
+     * @param no_blocks The number of blocks to add
+     * @return WorkerPoolStatus::OK if the operation succeed, WorkerPoolStatus::LIMIT_EXCEEDED
+     *         if the memory could not be allocated or the pool has been refilled too many
+     *         times, other error status otherwise
+     */
+    virtual WorkerPoolStatus refill(int no_blocks) = 0;
+
+    /**
+     * @return The size in bytes of the blocks in the pool
+     */
+    virtual size_t block_size() const = 0;
+
+    /**
+     * @brief Get the statistics of the pool, safe to call from an rt thread
+     */
+    virtual BlockPoolStats stats() const = 0;
+
+protected:
+    BlockPool() = default;
+};
+
+/**
+ * @brief Carries many logical condition variables, called channels, over a single
+ *        RtConditionVariable, so that the number of channels is not limited by the
+ *        number of kernel objects, i.e. xenomai rtp devices. Any number of rt threads
+ *        can notify channels, and a single non-rt thread dispatches the notifications
+ *        of all channels with one wait. Notifying a channel is O(1), and only the
+ *        first notification of a channel since it was last dispatched signals the
+ *        underlying condition variable.
+ */
+class ConditionVariableHub
+{
+public:
+    /**
+     * @brief Construct a ConditionVariableHub object.
+     *        Will throw std::runtime_error if max_channels is invalid, or if the
+     *        underlying RtConditionVariable can not be created.
+     * @param max_channels The maximum number of simultaneous channels
+     * @return
+     */
+    static std::unique_ptr<ConditionVariableHub> create_condition_variable_hub(int max_channels);
+
+    virtual ~ConditionVariableHub() = default;
+
+    /**
+     * @brief Add a channel. Not safe to call from an rt thread.
+     * @return The id of the channel, in the range [0, max_channels), or -1 if the
+     *         maximum number of channels has been reached
+     */
+    virtual int add_channel() = 0;
+
+    /**
+     * @brief Remove a channel so that its id can be reused. Not safe to call from an rt
+     *        thread. A channel that is added again after being removed may get one
+     *        spurious dispatch, from notifications made before it was removed.
+     */
+    virtual void remove_channel(int channel) = 0;
+
+    /**
+     * @brief Notify a channel, safe to call from any thread, including rt threads
+     * @param channel The id of a channel returned from add_channel()
+     */
+    virtual void notify(int channel) = 0;
+
+    /**
+     * @brief Wait until one or more channels are notified and call
+     *        function(channel, notifications) for each of them, with the number of calls
+     *        to notify() for the channel since it was last dispatched. Only one thread
+     *        at a time may dispatch.
+     * @param function Callable with signature void(int channel, int notifications)
+     * @param deadline The latest time to return, in the time of current_rt_time(),
+     *        or no value to wait indefinitely. Pass a deadline that has passed to
+     *        dispatch without waiting, i.e. when native_handle() is readable.
+     * @return The number of channels dispatched, 0 if the deadline passed without any
+     */
+    template <typename Function>
+    int dispatch(Function&& function, std::optional<std::chrono::nanoseconds> deadline = std::nullopt)
+    {
+        using FunctionType = std::remove_reference_t<Function>;
+        auto channel_callback = [](void* data, int channel, int notifications)
+        {
+            (*static_cast<FunctionType*>(data))(channel, notifications);
+        };
+        return run_dispatch(channel_callback, const_cast<void*>(static_cast<const void*>(std::addressof(function))),
+                            deadline);
+    }
+
+    /**
+     * @brief Type erased implementation of dispatch(), calls callback(data, channel,
+     *        notifications) for every channel notified.
+     * @return The number of channels dispatched, 0 if the deadline passed without any
+     */
+    virtual int run_dispatch(ChannelCallback callback, void* data,
+                             std::optional<std::chrono::nanoseconds> deadline) = 0;
+
+    /**
+     * @brief Get a file descriptor that becomes readable when any channel is notified,
+     *        see RtConditionVariable::native_handle(). Not safe to call from an rt thread.
+     * @return A file descriptor, or -1 if it could not be created
+     */
+    virtual int native_handle() = 0;
+
+protected:
+    ConditionVariableHub() = default;
+};
+
 }// namespace twine
 
 #endif // TWINE_TWINE_H_
@@ -0,0 +1,505 @@
+/*
+ * Copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk
+ * Twine is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * Twine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Twine.
+ * If not, see http://www.gnu.org/licenses/ .
+ */
+
+/**
+ * @brief Lock-free pool of fixed size memory blocks
+ * @copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk, Stockholm
+ */
+
+#ifndef TWINE_BLOCK_POOL_H
+#define TWINE_BLOCK_POOL_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include "twine/twine.h"
+#include "twine_internal.h"
+
+namespace twine {
+
+// Must be even, blocks are moved between a cache and the pool half a cache at a time
+constexpr int BLOCK_CACHE_SIZE = 32;
+constexpr int MAX_BLOCK_CACHES_PER_POOL = 64;
+constexpr int MAX_CACHED_POOLS_PER_THREAD = 8;
+constexpr int MAX_BLOCK_POOL_CHUNKS = 64;
+// Block indices are made up of a chunk index and the index of the block in the chunk
+constexpr int CHUNK_INDEX_BITS = 24;
+constexpr int MAX_BLOCKS_PER_CHUNK = 1 << CHUNK_INDEX_BITS;
+constexpr uint32_t NO_BLOCK = UINT32_MAX;
+
+/**
+ * @brief Free blocks of one pool that are owned by a single thread
+ */
+struct BlockCache
+{
+    std::atomic_bool                       in_use{false};
+    int                                    count{0};
+    // Blocks the thread has allocated and not yet freed, at most BLOCK_CACHE_SIZE
+    int                                    allocated{0};
+    std::array<uint32_t, BLOCK_CACHE_SIZE> blocks;
+};
+
+/**
+ * @brief The caches of a thread, one for each pool it has used. Returns the cached
+ *        blocks to their pools when the thread exits.
+ */
+class BlockCacheTable
+{
+public:
+    BlockCacheTable() = default;
+
+    ~BlockCacheTable();
+
+    TWINE_DECLARE_NON_COPYABLE(BlockCacheTable);
+
+    /**
+     * @brief Find the cache of a pool
+     * @return true if the pool has an entry, in which case cache is set to the cache
+     *         of the pool, which is nullptr if the pool had no cache to spare
+     */
+    bool find(uint64_t pool_id, BlockCache*& cache) const
+    {
+        for (const auto& entry : _entries)
+        {
+            if (entry.pool_id == pool_id)
+            {
+                cache = entry.cache;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool full() const
+    {
+        return _entries.back().pool_id != 0;
+    }
+
+    /**
+     * @brief Remove the entries of pools for which is_stale returns true
+     */
+    template <typename Predicate>
+    void remove_if(Predicate is_stale)
+    {
+        auto end = std::remove_if(_entries.begin(), _entries.end(), [&](const Entry& entry)
+        {
+            return entry.pool_id != 0 && is_stale(entry.pool_id);
+        });
+        std::fill(end, _entries.end(), Entry());
+    }
+
+    /**
+     * @brief Add the cache of a pool, must only be called if the table is not full
+     */
+    void add(uint64_t pool_id, BlockCache* cache)
+    {
+        for (auto& entry : _entries)
+        {
+            if (entry.pool_id == 0)
+            {
+                entry = {pool_id, cache};
+                return;
+            }
+        }
+    }
+
+private:
+    struct Entry
+    {
+        uint64_t    pool_id{0};
+        BlockCache* cache{nullptr};
+    };
+
+    std::array<Entry, MAX_CACHED_POOLS_PER_THREAD> _entries;
+};
+
+/**
+ * @brief Treiber stack of free blocks, where each free block stores the index of the
+ *        next one. The head is an index with a tag that is incremented on every change,
+ *        which avoids the ABA problem without double width atomics. Memory is never
+ *        returned to the system while the pool exists, so reading the link of a block
+ *        that was just allocated by another thread is harmless, the tag makes that
+ *        compare-exchange fail.
+ */
+class BlockPoolImpl : public BlockPool
+{
+public:
+    TWINE_DECLARE_NON_COPYABLE(BlockPoolImpl);
+
+    BlockPoolImpl(size_t block_size, int no_blocks, int low_watermark, RtConditionVariable* notifier) :
+            _block_size(block_size),
+            _stride(_aligned_stride(block_size)),
+            _low_watermark(low_watermark),
+            _notifier(notifier),
+            _id(_next_id.fetch_add(1) + 1)
+    {
+        if (block_size == 0 || no_blocks <= 0)
+        {
+            throw std::runtime_error("Invalid block pool size");
+        }
+        if (refill(no_blocks) != WorkerPoolStatus::OK)
+        {
+            _free_chunks();
+            throw std::runtime_error("Failed to allocate block pool memory");
+        }
+        std::lock_guard<std::mutex> lock(_registry_mutex);
+        _registry.push_back(this);
+    }
+
+    ~BlockPoolImpl() override
+    {
+        {
+            // Waits for any exiting thread that is returning blocks to this pool
+            std::lock_guard<std::mutex> lock(_registry_mutex);
+            _registry.erase(std::find(_registry.begin(), _registry.end(), this));
+        }
+        _free_chunks();
+    }
+
+    void* allocate() override
+    {
+        uint32_t index = NO_BLOCK;
+        auto cache = _thread_cache();
+        if (cache != nullptr)
+        {
+            if (cache->count == 0)
+            {
+                _fill(*cache);
+            }
+            if (cache->count > 0)
+            {
+                index = cache->blocks[--cache->count];
+                cache->allocated = std::min(cache->allocated + 1, BLOCK_CACHE_SIZE);
+            }
+        }
+        else
+        {
+            index = _pop();
+        }
+        if (index == NO_BLOCK)
+        {
+            _failed_allocations.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        return _address(index);
+    }
+
+    void deallocate(void* block) override
+    {
+        if (block == nullptr)
+        {
+            return;
+        }
+        uint32_t index = _index_of(block);
+        assert(index != NO_BLOCK);
+        // Only threads that also allocate keep freed blocks, a thread that just frees
+        // blocks allocated by others would otherwise hold on to them in its cache
+        auto cache = _thread_cache();
+        if (cache != nullptr && cache->allocated > 0)
+        {
+            cache->allocated--;
+            if (cache->count == BLOCK_CACHE_SIZE)
+            {
+                _drain(*cache, BLOCK_CACHE_SIZE / 2);
+            }
+            cache->blocks[cache->count++] = index;
+        }
+        else
+        {
+            _push(index);
+        }
+    }
+
+    WorkerPoolStatus refill(int no_blocks) override
+    {
+        if (no_blocks <= 0 || no_blocks > MAX_BLOCKS_PER_CHUNK)
+        {
+            return WorkerPoolStatus::INVALID_ARGUMENTS;
+        }
+        {
+            // Done here, also when creating a pool, so that allocate() and deallocate()
+            // never lock. A thread whose table is full uses the shared stack directly.
+            std::lock_guard<std::mutex> lock(_registry_mutex);
+            _remove_stale_caches();
+        }
+        std::lock_guard<std::mutex> lock(_refill_mutex);
+        int chunk = _no_chunks.load(std::memory_order_relaxed);
+        if (chunk == MAX_BLOCK_POOL_CHUNKS)
+        {
+            return WorkerPoolStatus::LIMIT_EXCEEDED;
+        }
+        size_t size = static_cast<size_t>(no_blocks) * _stride;
+        auto memory = static_cast<char*>(std::malloc(size));
+        if (memory == nullptr)
+        {
+            return WorkerPoolStatus::LIMIT_EXCEEDED;
+        }
+        // Prefault the memory so that rt threads don't take page faults on first use
+        std::memset(memory, 0, size);
+        _chunks[chunk] = {memory, no_blocks};
+        _no_chunks.store(chunk + 1, std::memory_order_release);
+        _capacity.fetch_add(no_blocks, std::memory_order_relaxed);
+
+        // In reverse so that blocks are handed out in address order
+        for (int i = no_blocks - 1; i >= 0; --i)
+        {
+            _push(static_cast<uint32_t>(chunk) << CHUNK_INDEX_BITS | static_cast<uint32_t>(i));
+        }
+        _min_available.store(_available.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        return WorkerPoolStatus::OK;
+    }
+
+    size_t block_size() const override
+    {
+        return _block_size;
+    }
+
+    BlockPoolStats stats() const override
+    {
+        BlockPoolStats stats;
+        stats.capacity = _capacity.load(std::memory_order_relaxed);
+        stats.available = std::max(0, _available.load(std::memory_order_relaxed));
+        stats.min_available = std::max(0, _min_available.load(std::memory_order_relaxed));
+        stats.failed_allocations = _failed_allocations.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    /**
+     * @brief Return the blocks in a cache to the pool it belongs to, if the pool still
+     *        exists, and make the cache available to other threads. Called when a
+     *        thread exits.
+     */
+    static void release_cache(uint64_t pool_id, BlockCache* cache)
+    {
+        std::lock_guard<std::mutex> lock(_registry_mutex);
+        for (auto pool : _registry)
+        {
+            if (pool->_id == pool_id)
+            {
+                pool->_drain(*cache, cache->count);
+                cache->in_use.store(false, std::memory_order_release);
+                return;
+            }
+        }
+    }
+
+private:
+    struct Chunk
+    {
+        char* memory{nullptr};
+        int   no_blocks{0};
+    };
+
+    static size_t _aligned_stride(size_t block_size)
+    {
+        constexpr size_t alignment = alignof(std::max_align_t);
+        size_t size = std::max(block_size, sizeof(std::atomic<uint32_t>));
+        return (size + alignment - 1) & ~(alignment - 1);
+    }
+
+    static uint64_t _next_tag(uint64_t head, uint32_t index)
+    {
+        return ((head >> 32) + 1) << 32 | index;
+    }
+
+    char* _address(uint32_t index) const
+    {
+        return _chunks[index >> CHUNK_INDEX_BITS].memory + (index & (MAX_BLOCKS_PER_CHUNK - 1)) * _stride;
+    }
+
+    std::atomic<uint32_t>& _link(uint32_t index) const
+    {
+        return *reinterpret_cast<std::atomic<uint32_t>*>(_address(index));
+    }
+
+    uint32_t _index_of(void* block) const
+    {
+        auto address = static_cast<char*>(block);
+        int no_chunks = _no_chunks.load(std::memory_order_acquire);
+        for (int chunk = 0; chunk < no_chunks; ++chunk)
+        {
+            const auto& c = _chunks[chunk];
+            if (address >= c.memory && address < c.memory + c.no_blocks * _stride)
+            {
+                auto block_index = static_cast<uint32_t>((address - c.memory) / _stride);
+                return static_cast<uint32_t>(chunk) << CHUNK_INDEX_BITS | block_index;
+            }
+        }
+        return NO_BLOCK;
+    }
+
+    uint32_t _pop()
+    {
+        uint64_t head = _head.load(std::memory_order_acquire);
+        uint32_t index;
+        do
+        {
+            index = static_cast<uint32_t>(head);
+            if (index == NO_BLOCK)
+            {
+                return NO_BLOCK;
+            }
+        }
+        while (_head.compare_exchange_weak(head, _next_tag(head, _link(index).load(std::memory_order_relaxed)),
+                                           std::memory_order_acquire, std::memory_order_acquire) == false);
+
+        int available = _available.fetch_sub(1, std::memory_order_relaxed) - 1;
+        int min_available = _min_available.load(std::memory_order_relaxed);
+        while (available < min_available &&
+               _min_available.compare_exchange_weak(min_available, available, std::memory_order_relaxed) == false) {}
+
+        if (available <= _low_watermark && _notifier != nullptr &&
+            _low_watermark_reached.exchange(true, std::memory_order_relaxed) == false)
+        {
+            _notifier->notify();
+        }
+        return index;
+    }
+
+    void _push(uint32_t index)
+    {
+        uint64_t head = _head.load(std::memory_order_relaxed);
+        do
+        {
+            _link(index).store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+        }
+        while (_head.compare_exchange_weak(head, _next_tag(head, index),
+                                           std::memory_order_release, std::memory_order_relaxed) == false);
+
+        int available = _available.fetch_add(1, std::memory_order_relaxed) + 1;
+        if (available > _low_watermark && _low_watermark_reached.load(std::memory_order_relaxed))
+        {
+            _low_watermark_reached.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    void _fill(BlockCache& cache)
+    {
+        while (cache.count < BLOCK_CACHE_SIZE / 2)
+        {
+            uint32_t index = _pop();
+            if (index == NO_BLOCK)
+            {
+                break;
+            }
+            cache.blocks[cache.count++] = index;
+        }
+    }
+
+    void _drain(BlockCache& cache, int no_blocks)
+    {
+        for (int i = 0; i < no_blocks; ++i)
+        {
+            _push(cache.blocks[--cache.count]);
+        }
+    }
+
+    /**
+     * @return The cache of the calling thread, or nullptr if it has none
+     */
+    BlockCache* _thread_cache()
+    {
+        BlockCache* cache = nullptr;
+        if (_thread_caches.find(_id, cache) || _thread_caches.full())
+        {
+            return cache;
+        }
+        // Threads that don't get a cache use the shared stack directly
+        for (auto& c : _caches)
+        {
+            if (c.in_use.exchange(true, std::memory_order_acquire) == false)
+            {
+                cache = &c;
+                cache->count = 0;
+                cache->allocated = 0;
+                break;
+            }
+        }
+        _thread_caches.add(_id, cache);
+        return cache;
+    }
+
+    /**
+     * @brief Remove the entries of pools that no longer exist from the table of the
+     *        calling thread. Their caches were freed together with the pools.
+     *        Must be called with the registry mutex held, so never from allocate()
+     *        or deallocate(), which only use the table.
+     */
+    static void _remove_stale_caches()
+    {
+        _thread_caches.remove_if([](uint64_t pool_id)
+        {
+            return std::none_of(_registry.begin(), _registry.end(), [&](const BlockPoolImpl* pool)
+            {
+                return pool->_id == pool_id;
+            });
+        });
+    }
+
+    void _free_chunks()
+    {
+        for (int chunk = 0; chunk < _no_chunks.load(); ++chunk)
+        {
+            std::free(_chunks[chunk].memory);
+        }
+        _no_chunks.store(0);
+    }
+
+    size_t                  _block_size;
+    size_t                  _stride;
+    int                     _low_watermark;
+    RtConditionVariable*    _notifier;
+    uint64_t                _id;
+
+    std::atomic<uint64_t>   _head{NO_BLOCK};
+    std::atomic_int         _available{0};
+    std::atomic_int         _min_available{0};
+    std::atomic_int         _capacity{0};
+    std::atomic<uint64_t>   _failed_allocations{0};
+    std::atomic_bool        _low_watermark_reached{false};
+
+    std::array<Chunk, MAX_BLOCK_POOL_CHUNKS>            _chunks;
+    std::atomic_int                                     _no_chunks{0};
+    std::mutex                                          _refill_mutex;
+    std::array<BlockCache, MAX_BLOCK_CACHES_PER_POOL>   _caches;
+
+    static std::atomic<uint64_t>          _next_id;
+    static std::mutex                     _registry_mutex;
+    static std::vector<BlockPoolImpl*>    _registry;
+    static thread_local BlockCacheTable   _thread_caches;
+};
+
+inline BlockCacheTable::~BlockCacheTable()
+{
+    for (const auto& entry : _entries)
+    {
+        if (entry.cache != nullptr)
+        {
+            BlockPoolImpl::release_cache(entry.pool_id, entry.cache);
+        }
+    }
+}
+
+} // namespace twine
+
+#endif //TWINE_BLOCK_POOL_H
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk
+ * Twine is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * Twine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Twine.
+ * If not, see http://www.gnu.org/licenses/ .
+ */
+
+/**
+ * @brief Many logical condition variables multiplexed over one RtConditionVariable
+ * @copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk, Stockholm
+ */
+
+#ifndef TWINE_CONDITION_VARIABLE_HUB_H
+#define TWINE_CONDITION_VARIABLE_HUB_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <stdexcept>
+#include <cassert>
+
+#include "twine/twine.h"
+#include "twine_internal.h"
+
+namespace twine {
+
+constexpr int MAX_HUB_CHANNELS = 1 << 16;
+
+/**
+ * @brief The ids of notified channels are passed to the dispatching thread in an
+ *        MpscQueue. A channel is only queued when its number of pending notifications
+ *        goes from 0 to 1, and it is dequeued before its notifications are reset, so
+ *        a channel is never in the queue more than once and the queue can't overflow.
+ */
+class ConditionVariableHubImpl : public ConditionVariableHub
+{
+public:
+    /**
+     * @param max_channels The maximum number of simultaneous channels
+     * @param cond_var The condition variable to carry the notifications of all channels
+     */
+    ConditionVariableHubImpl(int max_channels, std::unique_ptr<RtConditionVariable> cond_var) :
+                                                    _cond_var(std::move(cond_var)),
+                                                    _channels(_checked_size(max_channels)),
+                                                    _queue(max_channels)
+    {}
+
+    TWINE_DECLARE_NON_COPYABLE(ConditionVariableHubImpl);
+
+    int add_channel() override
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (size_t i = 0; i < _channels.size(); ++i)
+        {
+            if (_channels[i].active.load(std::memory_order_relaxed) == false)
+            {
+                _channels[i].active.store(true, std::memory_order_release);
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+    void remove_channel(int channel) override
+    {
+        if (_valid(channel))
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _channels[channel].active.store(false, std::memory_order_release);
+        }
+    }
+
+    void notify(int channel) override
+    {
+        if (_valid(channel) == false)
+        {
+            return;
+        }
+        if (_channels[channel].pending.fetch_add(1, std::memory_order_acq_rel) == 0)
+        {
+            [[maybe_unused]] bool pushed = _queue.push(channel);
+            assert(pushed);
+            _cond_var->notify();
+        }
+    }
+
+    int run_dispatch(ChannelCallback callback, void* data,
+                     std::optional<std::chrono::nanoseconds> deadline) override
+    {
+        while (true)
+        {
+            int notifications = deadline.has_value() ? _cond_var->wait_until(deadline.value()) :
+                                                       _cond_var->wait_counted();
+            int dispatched = _dispatch_pending(callback, data);
+            // Channels may have been dispatched on an earlier wakeup than the one
+            // caused by their notification, in which case there is nothing to dispatch
+            if (dispatched > 0 || notifications == 0)
+            {
+                return dispatched;
+            }
+        }
+    }
+
+    int native_handle() override
+    {
+        return _cond_var->native_handle();
+    }
+
+private:
+    struct alignas(CACHE_LINE_SIZE) Channel
+    {
+        std::atomic_int  pending{0};
+        std::atomic_bool active{false};
+    };
+
+    static size_t _checked_size(int max_channels)
+    {
+        if (max_channels <= 0 || max_channels > MAX_HUB_CHANNELS)
+        {
+            throw std::runtime_error("Invalid number of channels");
+        }
+        return static_cast<size_t>(max_channels);
+    }
+
+    bool _valid(int channel) const
+    {
+        return channel >= 0 && channel < static_cast<int>(_channels.size());
+    }
+
+    int _dispatch_pending(ChannelCallback callback, void* data)
+    {
+        int dispatched = 0;
+        int channel;
+        while (_queue.pop(channel))
+        {
+            // A notification after this is queued again, as the count is reset
+            int notifications = _channels[channel].pending.exchange(0, std::memory_order_acq_rel);
+            if (notifications > 0 && _channels[channel].active.load(std::memory_order_acquire))
+            {
+                callback(data, channel, notifications);
+                dispatched++;
+            }
+        }
+        return dispatched;
+    }
+
+    std::unique_ptr<RtConditionVariable> _cond_var;
+    std::vector<Channel>                 _channels;
+    MpscQueue<int>                       _queue;
+    std::mutex                           _mutex;
+};
+
+} // namespace twine
+
+#endif //TWINE_CONDITION_VARIABLE_HUB_H
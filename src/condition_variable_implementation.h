@@ -21,12 +21,24 @@
 #include <exception>
 #include <cstring>
 #include <cassert>
+#include <array>
+#include <chrono>
+#include <limits>
+#include <optional>
+#include <utility>
 
+#include "thread_helpers.h"
 #include "twine_internal.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
 #ifdef TWINE_BUILD_WITH_XENOMAI
 #include <poll.h>
-#include <sys/eventfd.h>
+#include <sys/epoll.h>
 #include <rtdm/ipc.h>
 #include <cobalt/sys/socket.h>
 #endif
@@ -35,49 +47,283 @@ namespace twine {
 
 /**
  * @brief Implementation with regular c++ std library constructs for
- *        use in a regular linux context.
+ *        use in a regular linux context. notify() takes a mutex, so the notifying
+ *        thread can be blocked by the waiting thread, FutexConditionVariable is
+ *        used instead where futexes are available. The native handle is the read
+ *        end of a pipe, that notify() writes a byte to when there were no pending
+ *        notifications.
  */
 class PosixConditionVariable : public RtConditionVariable
 {
 public:
-    ~PosixConditionVariable() override = default;
+    ~PosixConditionVariable() override;
 
     void notify() override;
 
     bool wait() override;
 
+    int wait_counted() override;
+
+    int wait_until(std::chrono::nanoseconds deadline) override;
+
+    int native_handle() override;
+
 private:
-    bool                    _flag{false};
+    int _take_notifications();
+
+    int                     _notifications{0};
+    std::array<int, 2>      _pipe{-1, -1};
     std::mutex              _mutex;
     std::condition_variable _cond_var;
 };
 
-void PosixConditionVariable::notify()
+inline PosixConditionVariable::~PosixConditionVariable()
+{
+    for (auto fd : _pipe)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+}
+
+inline void PosixConditionVariable::notify()
 {
     std::unique_lock<std::mutex> lock(_mutex);
-    _flag = true;
+    if (_notifications == 0 && _pipe[1] >= 0)
+    {
+        char data = 1;
+        [[maybe_unused]] auto unused = write(_pipe[1], &data, sizeof(data));
+    }
+    // Saturates if nothing waits, the waiter is woken up all the same
+    if (_notifications < std::numeric_limits<int>::max())
+    {
+        _notifications++;
+    }
     _cond_var.notify_one();
 }
 
-bool PosixConditionVariable::wait()
+inline bool PosixConditionVariable::wait()
+{
+    return wait_counted() > 0;
+}
+
+inline int PosixConditionVariable::wait_counted()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cond_var.wait(lock, [this]() {return _notifications > 0;});
+    return _take_notifications();
+}
+
+inline int PosixConditionVariable::wait_until(std::chrono::nanoseconds deadline)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    // current_rt_time() is the time of steady_clock when not running xenomai
+    std::chrono::steady_clock::time_point time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(deadline));
+    _cond_var.wait_until(lock, time_point, [this]() {return _notifications > 0;});
+    return _take_notifications();
+}
+
+inline int PosixConditionVariable::native_handle()
 {
     std::unique_lock<std::mutex> lock(_mutex);
-    _cond_var.wait(lock);
-    bool notified = _flag;
-    _flag = false;
-    return notified;
+    if (_pipe[0] < 0)
+    {
+        if (pipe(_pipe.data()) != 0)
+        {
+            return -1;
+        }
+        for (auto fd : _pipe)
+        {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        if (_notifications > 0)
+        {
+            char data = 1;
+            [[maybe_unused]] auto unused = write(_pipe[1], &data, sizeof(data));
+        }
+    }
+    return _pipe[0];
+}
+
+/**
+ * @brief Reset the notifications, must be called with the mutex held
+ */
+inline int PosixConditionVariable::_take_notifications()
+{
+    if (_notifications > 0 && _pipe[0] >= 0)
+    {
+        char buffer[16];
+        while (read(_pipe[0], buffer, sizeof(buffer)) > 0) {}
+    }
+    return std::exchange(_notifications, 0);
+}
+
+#ifdef TWINE_HAS_FUTEX
+/**
+ * @brief Lock-free implementation on a single atomic state word, that holds the number
+ *        of notifications, whether the waiting thread is asleep and whether there is
+ *        a native handle. notify() is one atomic operation, followed by a futex wake
+ *        only if the waiting thread is asleep, or an eventfd write only if there is a
+ *        native handle and there were no pending notifications. So a notifying rt
+ *        thread can never be blocked by the waiting thread.
+ */
+class FutexConditionVariable : public RtConditionVariable
+{
+public:
+    ~FutexConditionVariable() override;
+
+    void notify() override;
+
+    bool wait() override;
+
+    int wait_counted() override;
+
+    int wait_until(std::chrono::nanoseconds deadline) override;
+
+    int native_handle() override;
+
+private:
+    int _wait(std::optional<std::chrono::nanoseconds> deadline);
+
+    static constexpr int WAITER_ASLEEP = 1;
+    static constexpr int HAS_EVENT_FD = 2;
+    static constexpr int NOTIFICATION = 4;
+    static constexpr int MAX_NOTIFICATIONS = std::numeric_limits<int>::max() / NOTIFICATION;
+
+    std::atomic<int> _state{0};
+    int              _event_fd{-1};
+};
+
+inline FutexConditionVariable::~FutexConditionVariable()
+{
+    if (_event_fd >= 0)
+    {
+        close(_event_fd);
+    }
+}
+
+inline void FutexConditionVariable::notify()
+{
+    // The count saturates instead of wrapping into the sign bit if nothing waits for
+    // a long time, e.g. a waiter that only polls the native handle. A saturated count
+    // is already seen as notified, so there is nothing more to do then.
+    int state = _state.load(std::memory_order_relaxed);
+    do
+    {
+        if (state / NOTIFICATION >= MAX_NOTIFICATIONS)
+        {
+            return;
+        }
+    }
+    while (_state.compare_exchange_weak(state, state + NOTIFICATION,
+                                        std::memory_order_acq_rel, std::memory_order_relaxed) == false);
+    // Only the first notification since the last wait needs to wake the waiter
+    if (state < NOTIFICATION)
+    {
+        if (state & WAITER_ASLEEP)
+        {
+            futex_wake(&_state, 1);
+        }
+        if (state & HAS_EVENT_FD)
+        {
+            uint64_t data = 1;
+            [[maybe_unused]] auto unused = write(_event_fd, &data, sizeof(data));
+        }
+    }
+}
+
+inline bool FutexConditionVariable::wait()
+{
+    return _wait(std::nullopt) > 0;
+}
+
+inline int FutexConditionVariable::wait_counted()
+{
+    return _wait(std::nullopt);
+}
+
+inline int FutexConditionVariable::wait_until(std::chrono::nanoseconds deadline)
+{
+    return _wait(deadline);
 }
 
+inline int FutexConditionVariable::native_handle()
+{
+    if (_event_fd < 0)
+    {
+        _event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (_event_fd < 0)
+        {
+            return -1;
+        }
+        int state = _state.fetch_or(HAS_EVENT_FD, std::memory_order_acq_rel);
+        if (state >= NOTIFICATION)
+        {
+            uint64_t data = 1;
+            [[maybe_unused]] auto unused = write(_event_fd, &data, sizeof(data));
+        }
+    }
+    return _event_fd;
+}
+
+inline int FutexConditionVariable::_wait(std::optional<std::chrono::nanoseconds> deadline)
+{
+    while (true)
+    {
+        int state = _state.load(std::memory_order_acquire);
+        if (state >= NOTIFICATION)
+        {
+            break;
+        }
+        if (deadline.has_value() && current_rt_time() >= deadline.value())
+        {
+            if ((state & WAITER_ASLEEP) &&
+                _state.compare_exchange_weak(state, state & ~WAITER_ASLEEP, std::memory_order_relaxed) == false)
+            {
+                continue;
+            }
+            return 0;
+        }
+        if ((state & WAITER_ASLEEP) == 0 &&
+            _state.compare_exchange_weak(state, state | WAITER_ASLEEP, std::memory_order_relaxed) == false)
+        {
+            continue;
+        }
+        // Returns immediately if notify() changed the state after it was read
+        if (deadline.has_value())
+        {
+            futex_wait_until(&_state, state | WAITER_ASLEEP, deadline.value());
+        }
+        else
+        {
+            futex_wait(&_state, state | WAITER_ASLEEP);
+        }
+    }
+    if (_event_fd >= 0)
+    {
+        // Before resetting the state, so that a notification after the reset is not
+        // read here, which would leave it without a readable handle
+        uint64_t data;
+        [[maybe_unused]] auto unused = read(_event_fd, &data, sizeof(data));
+    }
+    // Several notifications since the last call are merged into one wakeup
+    return _state.fetch_and(HAS_EVENT_FD, std::memory_order_acquire) / NOTIFICATION;
+}
+#endif
+
 #ifdef TWINE_BUILD_WITH_XENOMAI
 using MsgType = uint8_t;
 using NonRTMsgType = uint64_t;
 
 constexpr size_t NUM_ELEMENTS = 64;
-constexpr int INFINITE_POLL_TIME = -1;
 
 /**
  * @brief Implementation using xenomai xddp queues that allow signalling a
- *        non xenomai thread from a xenomai thread.
+ *        non xenomai thread from a xenomai thread. The native handle is an
+ *        epoll instance watching both the rt pipe and the eventfd.
  */
 class XenomaiConditionVariable : public RtConditionVariable
 {
@@ -90,7 +336,15 @@ public:
 
     bool wait() override;
 
+    int wait_counted() override;
+
+    int wait_until(std::chrono::nanoseconds deadline) override;
+
+    int native_handle() override;
+
 private:
+    int _wait(std::optional<std::chrono::nanoseconds> deadline);
+    int _drain();
     void _set_up_socket();
     void _set_up_files();
 
@@ -100,6 +354,7 @@ private:
 
     int          _rt_file{0};
     int          _non_rt_file{0};
+    int          _epoll_file{-1};
     int          _id{0};
 
     std::array<pollfd, 2> _poll_targets;
@@ -118,6 +373,7 @@ static std::mutex mutex;
 
 int get_next_id()
 {
+    std::unique_lock<std::mutex> lock(mutex);
     for (auto i = 0u; i < active_ids.size(); ++i)
     {
         if (active_ids[i] == false)
@@ -144,6 +400,10 @@ XenomaiConditionVariable::XenomaiConditionVariable(int id) : _id(id)
 
 XenomaiConditionVariable::~XenomaiConditionVariable()
 {
+    if (_epoll_file >= 0)
+    {
+        close(_epoll_file);
+    }
     close(_rt_file);
     close(_non_rt_file);
     __cobalt_close(_socket_handle);
@@ -167,22 +427,102 @@ void XenomaiConditionVariable::notify()
 
 bool XenomaiConditionVariable::wait()
 {
-    MsgType buffer[NUM_ELEMENTS];
-    poll(_poll_targets.data(), _poll_targets.size(), INFINITE_POLL_TIME);
+    return _wait(std::nullopt) > 0;
+}
 
-    int len = 0;
+int XenomaiConditionVariable::wait_counted()
+{
+    return _wait(std::nullopt);
+}
 
-    // drain file descriptors.
-    for (auto& t : _poll_targets)
+int XenomaiConditionVariable::wait_until(std::chrono::nanoseconds deadline)
+{
+    return _wait(deadline);
+}
+
+int XenomaiConditionVariable::native_handle()
+{
+    if (_epoll_file < 0)
+    {
+        int epoll_file = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_file < 0)
+        {
+            return -1;
+        }
+        for (const auto& t : _poll_targets)
+        {
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.fd = t.fd;
+            if (epoll_ctl(epoll_file, EPOLL_CTL_ADD, t.fd, &event) != 0)
+            {
+                close(epoll_file);
+                return -1;
+            }
+        }
+        _epoll_file = epoll_file;
+    }
+    return _epoll_file;
+}
+
+int XenomaiConditionVariable::_wait(std::optional<std::chrono::nanoseconds> deadline)
+{
+    int notifications = 0;
+    while (notifications == 0)
     {
-        if (t.revents != 0)
+        timespec timeout{0, 0};
+        if (deadline.has_value())
+        {
+            auto time_left = deadline.value() - current_rt_time();
+            if (time_left.count() > 0)
+            {
+                timeout = to_timespec(time_left);
+            }
+        }
+        int res = ppoll(_poll_targets.data(), _poll_targets.size(), deadline.has_value() ? &timeout : nullptr, nullptr);
+        if (res == 0)
+        {
+            return 0;
+        }
+        if (res > 0)
         {
-            len += read(t.fd, &buffer, sizeof(buffer));
-            t.revents = 0;
+            notifications = _drain();
         }
     }
+    return notifications;
+}
 
-    return len > 1;
+int XenomaiConditionVariable::_drain()
+{
+    int notifications = 0;
+    for (auto& t : _poll_targets)
+    {
+        if (t.revents == 0)
+        {
+            continue;
+        }
+        if (t.fd == _rt_file)
+        {
+            // Every notification from an rt thread is one byte in the pipe
+            MsgType buffer[NUM_ELEMENTS];
+            ssize_t len;
+            while ((len = read(t.fd, &buffer, sizeof(buffer))) > 0)
+            {
+                notifications += static_cast<int>(len);
+            }
+        }
+        else
+        {
+            // The eventfd holds the number of notifications from non-rt threads
+            NonRTMsgType count = 0;
+            if (read(t.fd, &count, sizeof(count)) == sizeof(count))
+            {
+                notifications += static_cast<int>(count);
+            }
+        }
+        t.revents = 0;
+    }
+    return notifications;
 }
 
 void XenomaiConditionVariable::_set_up_socket()
@@ -210,7 +550,7 @@ void XenomaiConditionVariable::_set_up_socket()
 void XenomaiConditionVariable::_set_up_files()
 {
     _socket_name = "/dev/rtp" + std::to_string(_id);
-    _non_rt_file = eventfd(0, EFD_SEMAPHORE);
+    _non_rt_file = eventfd(0, EFD_NONBLOCK);
     if (_non_rt_file <= 0)
     {
         throw std::runtime_error(strerror(errno));
@@ -0,0 +1,304 @@
+/*
+ * Copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk
+ * Twine is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * Twine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Twine.
+ * If not, see http://www.gnu.org/licenses/ .
+ */
+
+/**
+ * @brief Cpu topology discovery and placement of realtime workers
+ * @copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk, Stockholm
+ */
+
+#ifndef TWINE_CPU_TOPOLOGY_H
+#define TWINE_CPU_TOPOLOGY_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <tuple>
+#include <algorithm>
+#include <cstdlib>
+
+namespace twine {
+
+constexpr auto SYSFS_CPU_ROOT = "/sys/devices/system/cpu";
+
+/**
+ * @brief Parse a cpu list in the kernel's format, i.e. "0-3,8,10-11". Anything that
+ *        is not a valid list, like "(null)", gives an empty list.
+ */
+inline std::vector<int> parse_cpu_list(const std::string& list)
+{
+    std::vector<int> cpus;
+    std::stringstream stream(list);
+    std::string range;
+    while (std::getline(stream, range, ','))
+    {
+        int first;
+        int last;
+        char separator;
+        std::stringstream range_stream(range);
+        if (!(range_stream >> first) || first < 0)
+        {
+            return {};
+        }
+        last = first;
+        if (range_stream >> separator)
+        {
+            if (separator != '-' || !(range_stream >> last) || last < first)
+            {
+                return {};
+            }
+        }
+        for (int cpu = first; cpu <= last; ++cpu)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+/**
+ * @brief Describes the cpus of the machine, as far as placing rt threads is concerned.
+ *        Cpus are identified by their number in the kernel, and there is no limit on
+ *        the number of cpus.
+ */
+class CpuTopology
+{
+public:
+    /**
+     * @brief Create a uniform topology of no_cpus online cpus, without smt, shared
+     *        caches or isolated cpus.
+     */
+    explicit CpuTopology(int no_cpus = 0) : _cpus(no_cpus)
+    {
+        for (int i = 0; i < no_cpus; ++i)
+        {
+            _cpus[i] = {true, false, false, i, i};
+        }
+    }
+
+    /**
+     * @brief Read the topology from sysfs
+     * @param sysfs_root The sysfs cpu directory, normally /sys/devices/system/cpu
+     * @param fallback_cpus The number of cpus of the uniform topology returned if
+     *                      sysfs can not be read, i.e. on other systems than linux
+     */
+    static CpuTopology read(const std::string& sysfs_root, int fallback_cpus)
+    {
+        std::string online;
+        if (_read_file(sysfs_root + "/online", online) == false)
+        {
+            return CpuTopology(fallback_cpus);
+        }
+        CpuTopology topology;
+        auto online_cpus = parse_cpu_list(online);
+        if (online_cpus.empty())
+        {
+            return CpuTopology(fallback_cpus);
+        }
+        topology._cpus.resize(online_cpus.back() + 1, {false, false, false, -1, -1});
+        for (int cpu : online_cpus)
+        {
+            topology._cpus[cpu] = {true, false, false, cpu, cpu};
+            topology._read_cpu(sysfs_root + "/cpu" + std::to_string(cpu), cpu);
+        }
+        // Not all kernels have these, and nohz_full contains "(null)" if not set
+        std::string contents;
+        if (_read_file(sysfs_root + "/isolated", contents))
+        {
+            for (int cpu : parse_cpu_list(contents))
+            {
+                if (topology.online(cpu))
+                {
+                    topology._cpus[cpu].isolated = true;
+                }
+            }
+        }
+        if (_read_file(sysfs_root + "/nohz_full", contents))
+        {
+            for (int cpu : parse_cpu_list(contents))
+            {
+                if (topology.online(cpu))
+                {
+                    topology._cpus[cpu].nohz_full = true;
+                }
+            }
+        }
+        return topology;
+    }
+
+    /**
+     * @return One more than the highest cpu number known
+     */
+    int no_cpus() const
+    {
+        return static_cast<int>(_cpus.size());
+    }
+
+    bool online(int cpu) const
+    {
+        return cpu >= 0 && cpu < no_cpus() && _cpus[cpu].online;
+    }
+
+    /**
+     * @return true if the cpu is isolated from the scheduler (isolcpus) or runs
+     *         without a scheduler tick (nohz_full)
+     */
+    bool isolated(int cpu) const
+    {
+        return online(cpu) && (_cpus[cpu].isolated || _cpus[cpu].nohz_full);
+    }
+
+    /**
+     * @return An id shared by the smt siblings of a physical core, -1 if offline
+     */
+    int core(int cpu) const
+    {
+        return online(cpu) ? _cpus[cpu].core : -1;
+    }
+
+    /**
+     * @return An id shared by the cpus sharing the last level cache, -1 if offline
+     */
+    int cache_domain(int cpu) const
+    {
+        return online(cpu) ? _cpus[cpu].cache_domain : -1;
+    }
+
+private:
+    struct Cpu
+    {
+        bool online;
+        bool isolated;
+        bool nohz_full;
+        int  core;          // Lowest numbered smt sibling
+        int  cache_domain;  // Lowest numbered cpu sharing the last level cache
+    };
+
+    static bool _read_file(const std::string& path, std::string& contents)
+    {
+        std::ifstream file(path);
+        if (!file)
+        {
+            return false;
+        }
+        contents.clear();
+        std::getline(file, contents);
+        return true;
+    }
+
+    void _read_cpu(const std::string& cpu_path, int cpu)
+    {
+        std::string contents;
+        // core_cpus_list replaced thread_siblings_list in linux 5.7
+        if (_read_file(cpu_path + "/topology/core_cpus_list", contents) ||
+            _read_file(cpu_path + "/topology/thread_siblings_list", contents))
+        {
+            auto siblings = parse_cpu_list(contents);
+            if (siblings.empty() == false && siblings.front() <= cpu)
+            {
+                _cpus[cpu].core = siblings.front();
+            }
+        }
+
+        int highest_level = 0;
+        for (int index = 0; _read_file(cpu_path + "/cache/index" + std::to_string(index) + "/level", contents); ++index)
+        {
+            auto cache_path = cpu_path + "/cache/index" + std::to_string(index);
+            int level = std::atoi(contents.c_str());
+            std::string type;
+            if (level <= highest_level || (_read_file(cache_path + "/type", type) && type == "Instruction"))
+            {
+                continue;
+            }
+            if (_read_file(cache_path + "/shared_cpu_list", contents))
+            {
+                auto sharing = parse_cpu_list(contents);
+                if (sharing.empty() == false && sharing.front() <= cpu)
+                {
+                    highest_level = level;
+                    _cpus[cpu].cache_domain = sharing.front();
+                }
+            }
+        }
+    }
+
+    std::vector<Cpu> _cpus;
+};
+
+/**
+ * @brief Pick the cpu for a new rt worker, among cpus [0, cpu_usage.size()). In
+ *        order of importance, it prefers:
+ *        - Cpus with fewer workers.
+ *        - Cpus with fewer workers on their smt siblings, as siblings share execution units.
+ *        - Isolated cpus.
+ *        - Cpus sharing the last level cache with more workers of the same cache group,
+ *          so that workers sharing data keep it in the same cache.
+ *        - Cpus sharing the last level cache with fewer workers, so that unrelated
+ *          workers don't compete for the same cache.
+ *        - The lowest numbered cpu.
+ * @param topology The cpu topology of the machine
+ * @param cpu_usage The number of workers on each cpu
+ * @param group_cpus The cpus of the workers in the same cache group as the new
+ *                   worker, empty if it is not in a group
+ * @return The cpu number, or -1 if no cpu in the range is online
+ */
+inline int pick_worker_cpu(const CpuTopology& topology, const std::vector<int>& cpu_usage,
+                           const std::vector<int>& group_cpus = {})
+{
+    int no_cpus = static_cast<int>(cpu_usage.size());
+    std::vector<int> core_usage(topology.no_cpus(), 0);
+    std::vector<int> domain_usage(topology.no_cpus(), 0);
+    std::vector<int> group_domain_usage(topology.no_cpus(), 0);
+    for (int cpu = 0; cpu < no_cpus; ++cpu)
+    {
+        if (topology.online(cpu))
+        {
+            core_usage[topology.core(cpu)] += cpu_usage[cpu];
+            domain_usage[topology.cache_domain(cpu)] += cpu_usage[cpu];
+        }
+    }
+    for (int cpu : group_cpus)
+    {
+        if (topology.online(cpu))
+        {
+            group_domain_usage[topology.cache_domain(cpu)]++;
+        }
+    }
+
+    int best_cpu = -1;
+    std::tuple<int, int, bool, int, int> best_score;
+    for (int cpu = 0; cpu < no_cpus; ++cpu)
+    {
+        if (topology.online(cpu) == false)
+        {
+            continue;
+        }
+        int domain = topology.cache_domain(cpu);
+        auto score = std::make_tuple(cpu_usage[cpu],
+                                     core_usage[topology.core(cpu)] - cpu_usage[cpu],
+                                     !topology.isolated(cpu),
+                                     -group_domain_usage[domain],
+                                     domain_usage[domain]);
+        if (best_cpu < 0 || score < best_score)
+        {
+            best_cpu = cpu;
+            best_score = score;
+        }
+    }
+    return best_cpu;
+}
+
+} // namespace twine
+
+#endif //TWINE_CPU_TOPOLOGY_H
@@ -0,0 +1,283 @@
+/*
+ * Copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk
+ * Twine is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * Twine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Twine.
+ * If not, see http://www.gnu.org/licenses/ .
+ */
+
+/**
+ * @brief Lock-free barrier for linux native threads
+ * @copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk, Stockholm
+ */
+
+#ifndef TWINE_FUTEX_BARRIER_H
+#define TWINE_FUTEX_BARRIER_H
+
+#include <cassert>
+#include <atomic>
+#include <array>
+
+#include "thread_helpers.h"
+#include "worker_pool_common.h"
+#include "twine_internal.h"
+
+#ifdef TWINE_HAS_FUTEX
+
+namespace twine {
+
+/**
+ * @brief Drop-in replacement for BarrierWithTrigger using futexes directly.
+ *        Arrivals are counted with atomics and no locks are taken. Every thread
+ *        has its own release counter on a separate cache line, so that a subset
+ *        of the threads can be released. Threads sleep on a shared wakeup counter
+ *        with a futex bitset, and all released threads are woken with a single
+ *        futex wake that leaves the other threads asleep. The controlling thread
+ *        sleeps on the arrival counter and is only woken by the last thread to
+ *        arrive.
+ */
+class FutexBarrier
+{
+public:
+    TWINE_DECLARE_NON_COPYABLE(FutexBarrier);
+
+    FutexBarrier() = default;
+
+    /**
+     * @brief Wait for signal to finish, called from threads participating on the
+     *        barrier
+     * @param index The index of the calling thread, in [0, no_threads)
+     */
+    void wait(int index)
+    {
+        wait(index, std::chrono::nanoseconds(0));
+    }
+
+    /**
+     * @brief Same as wait(), but busy waits for up to spin_time for the release
+     *        before blocking.
+     */
+    void wait(int index, std::chrono::nanoseconds spin_time)
+    {
+        assert(index >= 0 && index < MAX_WORKERS_PER_POOL);
+        auto& release_count = _release_counts[index].count;
+        // The release count must be read before arriving, or a release could be missed
+        int released = release_count.load(std::memory_order_acquire);
+        _release_counts[index].arrived.store(released, std::memory_order_release);
+        _arrive();
+
+        auto is_released = [&]() {return release_count.load(std::memory_order_acquire) != released;};
+        if (spin_time.count() > 0 && spin_until(is_released, spin_time))
+        {
+            return;
+        }
+        uint32_t wake_bit = 1u << (index % 32);
+        while (true)
+        {
+            // Read the wakeup counter before checking for the release, so that a release
+            // after the check makes the futex wait return immediately
+            int wakeups = _wakeups.load(std::memory_order_acquire);
+            if (is_released())
+            {
+                return;
+            }
+            futex_wait_bitset(&_wakeups, wakeups, wake_bit);
+        }
+    }
+
+    /**
+     * @brief Wait for all threads to halt on the barrier, called from a thread
+     *        not waiting on the barrier and will block until all threads are
+     *        waiting on the barrier.
+     */
+    void wait_for_all()
+    {
+        int arrived = _arrived.load(std::memory_order_acquire);
+        while (arrived < _no_threads.load(std::memory_order_acquire))
+        {
+            // Returns immediately if more threads have arrived since the load
+            futex_wait(&_arrived, arrived);
+            arrived = _arrived.load(std::memory_order_acquire);
+        }
+    }
+
+    /**
+     * @brief Same as wait_for_all(), but returns when deadline passes
+     * @param deadline The latest time to return, in the time of current_rt_time()
+     * @return true if all threads are waiting on the barrier, false if the deadline passed
+     */
+    bool wait_for_all_until(std::chrono::nanoseconds deadline)
+    {
+        int arrived = _arrived.load(std::memory_order_acquire);
+        while (arrived < _no_threads.load(std::memory_order_acquire))
+        {
+            if (current_rt_time() >= deadline)
+            {
+                return false;
+            }
+            futex_wait_until(&_arrived, arrived, deadline);
+            arrived = _arrived.load(std::memory_order_acquire);
+        }
+        return true;
+    }
+
+    /**
+     * @return true if all threads are waiting on the barrier, i.e. if they can be released
+     */
+    bool all_arrived() const
+    {
+        return _arrived.load(std::memory_order_acquire) >= _no_threads.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @return Bitmask of the threads that have been released and not yet waited on
+     *         the barrier again
+     */
+    WorkerMask running_threads() const
+    {
+        WorkerMask running = 0;
+        for (WorkerMask threads = _threads.load(std::memory_order_relaxed); threads != 0; threads &= threads - 1)
+        {
+            int index = __builtin_ctzll(threads);
+            const auto& release_count = _release_counts[index];
+            if (release_count.arrived.load(std::memory_order_acquire) != release_count.count.load(std::memory_order_relaxed))
+            {
+                running |= WorkerMask(1) << index;
+            }
+        }
+        return running;
+    }
+
+    /**
+     * @brief Change the number of threads for the barrier to handle.
+     * @param threads
+     * @return 0 on success
+     */
+    int set_no_threads(int threads)
+    {
+        assert(threads <= MAX_WORKERS_PER_POOL);
+        return set_threads(threads < MAX_WORKERS_PER_POOL ? (WorkerMask(1) << threads) - 1 : ALL_WORKERS);
+    }
+
+    /**
+     * @brief Change the set of threads for the barrier to handle.
+     * @param threads Bitmask of the indexes of the threads participating on the barrier
+     * @return 0 on success
+     */
+    int set_threads(WorkerMask threads)
+    {
+        _threads.store(threads, std::memory_order_relaxed);
+        _no_threads.store(__builtin_popcountll(threads), std::memory_order_release);
+        return 0;
+    }
+
+    /**
+     * @brief Remove a thread from the barrier and release it, without waiting for it
+     *        to arrive again. Like release(), must only be called when all threads
+     *        are waiting on the barrier, and the removed thread must not wait on the
+     *        barrier again after being released.
+     * @param index The index of the thread to remove
+     */
+    void remove_thread(int index)
+    {
+        WorkerMask thread = WorkerMask(1) << index;
+        WorkerMask threads = _threads.load(std::memory_order_relaxed);
+        assert(threads & thread);
+        assert(_arrived.load() == _no_threads.load());
+        set_threads(threads & ~thread);
+        _arrived.fetch_sub(1, std::memory_order_relaxed);
+        _wake(thread);
+    }
+
+    /**
+     * @brief Release all threads waiting on the barrier.
+     */
+    void release_all()
+    {
+        release(ALL_WORKERS);
+    }
+
+    /**
+     * @brief Release the threads selected by threads, the other threads stay
+     *        blocked on the barrier and are not woken up.
+     * @param threads Bitmask of thread indexes to release
+     */
+    void release(WorkerMask threads)
+    {
+        int no_threads = _no_threads.load(std::memory_order_relaxed);
+        assert(_arrived.load() == no_threads);
+        threads &= _threads.load(std::memory_order_relaxed);
+        if (threads == 0)
+        {
+            return;
+        }
+        // Threads not released count as already arrived
+        _arrived.store(no_threads - __builtin_popcountll(threads), std::memory_order_relaxed);
+        _wake(threads);
+    }
+
+    void release_and_wait()
+    {
+        release_and_wait(ALL_WORKERS);
+    }
+
+    void release_and_wait(WorkerMask threads)
+    {
+        release(threads);
+        wait_for_all();
+    }
+
+private:
+    void _wake(WorkerMask threads)
+    {
+        uint32_t wake_bits = 0;
+        while (threads != 0)
+        {
+            int index = __builtin_ctzll(threads);
+            threads &= threads - 1;
+            // Release ordering makes the counter reset visible to threads seeing the new count
+            _release_counts[index].count.fetch_add(1, std::memory_order_release);
+            wake_bits |= 1u << (index % 32);
+        }
+        _wakeups.fetch_add(1, std::memory_order_release);
+        futex_wake_bitset(&_wakeups, wake_bits);
+    }
+
+    void _arrive()
+    {
+        int arrived = _arrived.fetch_add(1, std::memory_order_acq_rel) + 1;
+        if (arrived >= _no_threads.load(std::memory_order_acquire))
+        {
+            futex_wake(&_arrived);
+        }
+    }
+
+    struct alignas(CACHE_LINE_SIZE) ReleaseCount
+    {
+        std::atomic<int> count{0};
+        // The count the thread last arrived at, written by the thread
+        std::atomic<int> arrived{0};
+    };
+
+    // Each written by the controlling thread and read by one thread
+    std::array<ReleaseCount, MAX_WORKERS_PER_POOL> _release_counts;
+    // Written by the controlling thread, read by all threads
+    alignas(CACHE_LINE_SIZE) std::atomic<int> _wakeups{0};
+    // Written by all workers, read by the controlling thread
+    alignas(CACHE_LINE_SIZE) std::atomic<int> _arrived{0};
+    // Only change when the pool is reconfigured
+    alignas(CACHE_LINE_SIZE) std::atomic<int> _no_threads{0};
+    std::atomic<WorkerMask> _threads{0};
+};
+
+} // namespace twine
+
+#endif // TWINE_HAS_FUTEX
+
+#endif //TWINE_FUTEX_BARRIER_H
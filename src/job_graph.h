@@ -0,0 +1,210 @@
+/*
+ * Copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk
+ * Twine is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * Twine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Twine.
+ * If not, see http://www.gnu.org/licenses/ .
+ */
+
+/**
+ * @brief Dependency graph of jobs executed by a WorkerPool
+ * @copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk, Stockholm
+ */
+
+#ifndef TWINE_JOB_GRAPH_H
+#define TWINE_JOB_GRAPH_H
+
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+
+#include "thread_helpers.h"
+#include "worker_pool_common.h"
+#include "twine_internal.h"
+
+namespace twine {
+
+// Idle threads yield their cpu with this interval while waiting for jobs to become ready
+constexpr int GRAPH_SPINS_PER_YIELD = 64;
+// Weight of previous measurements when averaging job durations, as a power of 2
+constexpr int DURATION_AVERAGING_SHIFT = 3;
+
+/**
+ * @brief A directed acyclic graph of jobs, where every job is run only after all
+ *        the jobs it depends on have finished. Any number of threads can run jobs
+ *        from the graph concurrently by calling run_jobs(), ready jobs are then
+ *        picked in order of the longest remaining path through the graph, using
+ *        the durations measured in previous runs.
+ *        Building the graph allocates and must not be done while it is running.
+ *        Running it is lock-free and does not allocate.
+ */
+class JobGraph
+{
+public:
+    TWINE_DECLARE_NON_COPYABLE(JobGraph);
+
+    JobGraph() = default;
+
+    /**
+     * @brief Add a job to the graph.
+     * @param job_cb The job function
+     * @param job_data Data passed to job_cb
+     * @param dependencies Ids of previously added jobs that must finish before this job runs
+     * @return The id of the new job and WorkerPoolStatus::OK if successful
+     */
+    std::pair<WorkerPoolStatus, int> add_job(WorkerCallback job_cb, void* job_data, const std::vector<int>& dependencies)
+    {
+        int id = static_cast<int>(_jobs.size());
+        if (job_cb == nullptr)
+        {
+            return {WorkerPoolStatus::INVALID_ARGUMENTS, -1};
+        }
+        for (auto dependency : dependencies)
+        {
+            if (dependency < 0 || dependency >= id)
+            {
+                return {WorkerPoolStatus::INVALID_ARGUMENTS, -1};
+            }
+        }
+        auto job = std::make_unique<Job>();
+        job->callback = job_cb;
+        job->data = job_data;
+        job->dependency_count = static_cast<int>(dependencies.size());
+        for (auto dependency : dependencies)
+        {
+            _jobs[dependency]->dependents.push_back(id);
+        }
+        _jobs.push_back(std::move(job));
+        _priority_order.push_back(id);
+        return {WorkerPoolStatus::OK, id};
+    }
+
+    /**
+     * @brief Remove all jobs from the graph
+     */
+    void clear()
+    {
+        _jobs.clear();
+        _priority_order.clear();
+    }
+
+    bool empty() const
+    {
+        return _jobs.empty();
+    }
+
+    /**
+     * @brief Prepare the graph for a new run, must be called before the threads
+     *        running the graph are started.
+     */
+    void prepare_run()
+    {
+        // Jobs are stored in topological order, so critical paths can be
+        // calculated in a single pass from the end.
+        for (auto i = static_cast<int>(_jobs.size()) - 1; i >= 0; --i)
+        {
+            auto& job = *_jobs[i];
+            std::chrono::nanoseconds longest_dependent_path(0);
+            for (auto dependent : job.dependents)
+            {
+                longest_dependent_path = std::max(longest_dependent_path, _jobs[dependent]->critical_path);
+            }
+            job.critical_path = job.mean_duration + longest_dependent_path;
+            job.remaining_dependencies.store(job.dependency_count, std::memory_order_relaxed);
+            job.claimed.store(false, std::memory_order_relaxed);
+        }
+        std::sort(_priority_order.begin(), _priority_order.end(), [&](int lhs, int rhs)
+        {
+            auto lhs_path = _jobs[lhs]->critical_path;
+            auto rhs_path = _jobs[rhs]->critical_path;
+            return lhs_path == rhs_path ? lhs < rhs : lhs_path > rhs_path;
+        });
+        _remaining_jobs.store(static_cast<int>(_jobs.size()), std::memory_order_release);
+    }
+
+    /**
+     * @brief Run ready jobs until all jobs in the graph have finished.
+     *        Call concurrently from all threads executing the graph.
+     * @param may_yield If false, an idle thread only spins and never yields its cpu.
+     *        Must be false for SCHED_DEADLINE threads, as a yield gives up the rest
+     *        of their runtime until the next period.
+     */
+    template <ThreadType type>
+    void run_jobs(bool may_yield)
+    {
+        int idle_spins = 0;
+        while (_remaining_jobs.load(std::memory_order_acquire) > 0)
+        {
+            if (_run_next_ready_job())
+            {
+                idle_spins = 0;
+                continue;
+            }
+            // Nothing ready, dependencies are still running in other threads
+            cpu_relax();
+            if (may_yield && ++idle_spins % GRAPH_SPINS_PER_YIELD == 0)
+            {
+                thread_yield<type>();
+            }
+        }
+    }
+
+private:
+    struct alignas(CACHE_LINE_SIZE) Job
+    {
+        WorkerCallback           callback;
+        void*                    data;
+        int                      dependency_count{0};
+        std::vector<int>         dependents;
+        std::chrono::nanoseconds mean_duration{0};
+        std::chrono::nanoseconds critical_path{0};
+        std::atomic<int>         remaining_dependencies{0};
+        std::atomic_bool         claimed{false};
+    };
+
+    bool _run_next_ready_job()
+    {
+        for (auto id : _priority_order)
+        {
+            auto& job = *_jobs[id];
+            if (job.remaining_dependencies.load(std::memory_order_acquire) == 0 &&
+                job.claimed.load(std::memory_order_relaxed) == false &&
+                job.claimed.exchange(true, std::memory_order_acq_rel) == false)
+            {
+                _run_job(job);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void _run_job(Job& job)
+    {
+        auto start_time = current_rt_time();
+        job.callback(job.data);
+        auto duration = current_rt_time() - start_time;
+        job.mean_duration += (duration - job.mean_duration) / (1 << DURATION_AVERAGING_SHIFT);
+
+        for (auto dependent : job.dependents)
+        {
+            _jobs[dependent]->remaining_dependencies.fetch_sub(1, std::memory_order_acq_rel);
+        }
+        _remaining_jobs.fetch_sub(1, std::memory_order_acq_rel);
+    }
+
+    std::vector<std::unique_ptr<Job>> _jobs;
+    std::vector<int>                  _priority_order;
+    alignas(CACHE_LINE_SIZE) std::atomic<int> _remaining_jobs{0};
+};
+
+} // namespace twine
+
+#endif //TWINE_JOB_GRAPH_H
@@ -0,0 +1,199 @@
+/*
+ * Copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk
+ * Twine is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * Twine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Twine.
+ * If not, see http://www.gnu.org/licenses/ .
+ */
+
+/**
+ * @brief Balancing of worker loads over cpu cores
+ * @copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk, Stockholm
+ */
+
+#ifndef TWINE_LOAD_BALANCER_H
+#define TWINE_LOAD_BALANCER_H
+
+#include <array>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include "cpu_topology.h"
+#include "worker_pool_common.h"
+
+namespace twine {
+
+// Must be a power of 2
+constexpr int LOAD_WINDOW_CYCLES = 64;
+// Only move workers if it lowers the highest cpu load by at least this many percent
+constexpr int REBALANCE_HYSTERESIS_PERCENT = 10;
+
+/**
+ * @brief Total callback time of a worker over the last LOAD_WINDOW_CYCLES cycles
+ */
+class LoadWindow
+{
+public:
+    void add(std::chrono::nanoseconds duration)
+    {
+        _total += duration - _durations[_position];
+        _durations[_position] = duration;
+        _position = (_position + 1) & (LOAD_WINDOW_CYCLES - 1);
+    }
+
+    std::chrono::nanoseconds total() const
+    {
+        return _total;
+    }
+
+private:
+    std::array<std::chrono::nanoseconds, LOAD_WINDOW_CYCLES> _durations{};
+    std::chrono::nanoseconds _total{0};
+    int _position{0};
+};
+
+/**
+ * @brief Distributes workers over cpus to minimise the load of the most loaded core,
+ *        which sets the critical path of a cycle. Smt siblings share the execution
+ *        units of a core, so the load of a cpu is counted together with the load of
+ *        its siblings, and on equal load isolated cpus are preferred, following the
+ *        same rules as pick_worker_cpu(). All memory is allocated up front so that
+ *        rebalance() can be called from an rt thread.
+ */
+class LoadBalancer
+{
+public:
+    struct Worker
+    {
+        std::chrono::nanoseconds load;
+        int  cpu;
+        bool pinned;  // Workers with a user defined cpu are never moved
+    };
+
+    /**
+     * @param topology Workers are only moved to online cpus
+     * @param no_cpus Workers are placed on cpus [0, no_cpus)
+     */
+    LoadBalancer(const CpuTopology& topology, int no_cpus) : _cpus(no_cpus),
+                                                              _core_loads(no_cpus)
+    {
+        for (int cpu = 0; cpu < no_cpus; ++cpu)
+        {
+            // The core id is the lowest numbered sibling, so it is always in range
+            _cpus[cpu] = {topology.online(cpu), topology.isolated(cpu), std::max(topology.core(cpu), 0)};
+        }
+    }
+
+    /**
+     * @brief Assign new cpus to the workers that are not pinned, using longest processing
+     *        time first scheduling. The new assignment is only kept if it lowers the highest
+     *        core load by more than REBALANCE_HYSTERESIS_PERCENT, so that workers don't move
+     *        back and forth on small variations in load.
+     * @param workers The workers to balance, cpus are updated in place
+     * @param no_workers The number of workers, at most MAX_WORKERS_PER_POOL
+     * @return true if any worker was assigned a new cpu
+     */
+    bool rebalance(Worker* workers, int no_workers)
+    {
+        if (no_workers == 0 || _core_loads.empty())
+        {
+            return false;
+        }
+        std::fill(_core_loads.begin(), _core_loads.end(), std::chrono::nanoseconds(0));
+        for (int i = 0; i < no_workers; ++i)
+        {
+            _core_loads[_cpus[workers[i].cpu].core] += workers[i].load;
+        }
+        auto current_max = *std::max_element(_core_loads.begin(), _core_loads.end());
+
+        // Start from the load of the pinned workers and add the others, heaviest first
+        int no_movable = 0;
+        std::fill(_core_loads.begin(), _core_loads.end(), std::chrono::nanoseconds(0));
+        for (int i = 0; i < no_workers; ++i)
+        {
+            if (workers[i].pinned)
+            {
+                _core_loads[_cpus[workers[i].cpu].core] += workers[i].load;
+            }
+            else
+            {
+                _order[no_movable++] = i;
+            }
+        }
+        std::sort(_order.begin(), _order.begin() + no_movable, [&](int a, int b)
+        {
+            return workers[a].load > workers[b].load || (workers[a].load == workers[b].load && a < b);
+        });
+        for (int i = 0; i < no_movable; ++i)
+        {
+            auto& worker = workers[_order[i]];
+            int best_cpu = -1;
+            for (int cpu = 0; cpu < static_cast<int>(_cpus.size()); ++cpu)
+            {
+                if (_cpus[cpu].online && (best_cpu < 0 || _better_cpu(cpu, best_cpu, worker.cpu)))
+                {
+                    best_cpu = cpu;
+                }
+            }
+            _new_cpus[_order[i]] = best_cpu < 0 ? worker.cpu : best_cpu;
+            _core_loads[_cpus[_new_cpus[_order[i]]].core] += worker.load;
+        }
+        auto new_max = *std::max_element(_core_loads.begin(), _core_loads.end());
+
+        if (new_max * 100 >= current_max * (100 - REBALANCE_HYSTERESIS_PERCENT))
+        {
+            return false;
+        }
+        bool moved = false;
+        for (int i = 0; i < no_movable; ++i)
+        {
+            auto& worker = workers[_order[i]];
+            moved |= worker.cpu != _new_cpus[_order[i]];
+            worker.cpu = _new_cpus[_order[i]];
+        }
+        return moved;
+    }
+
+private:
+    struct Cpu
+    {
+        bool online;
+        bool isolated;
+        int  core;
+    };
+
+    /**
+     * @return true if cpu is a better choice than best_cpu for a worker on current_cpu
+     */
+    bool _better_cpu(int cpu, int best_cpu, int current_cpu) const
+    {
+        auto load = _core_loads[_cpus[cpu].core];
+        auto best_load = _core_loads[_cpus[best_cpu].core];
+        if (load != best_load)
+        {
+            return load < best_load;
+        }
+        if (_cpus[cpu].isolated != _cpus[best_cpu].isolated)
+        {
+            return _cpus[cpu].isolated;
+        }
+        // Staying on the current cpu avoids needless migrations
+        return cpu == current_cpu;
+    }
+
+    std::vector<Cpu>                          _cpus;
+    std::vector<std::chrono::nanoseconds>     _core_loads;
+    std::array<int, MAX_WORKERS_PER_POOL>     _order;
+    std::array<int, MAX_WORKERS_PER_POOL>     _new_cpus;
+};
+
+} // namespace twine
+
+#endif //TWINE_LOAD_BALANCER_H
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk
+ * Twine is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * Twine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Twine.
+ * If not, see http://www.gnu.org/licenses/ .
+ */
+
+/**
+ * @brief Range of indices processed in parallel by a WorkerPool
+ * @copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk, Stockholm
+ */
+
+#ifndef TWINE_PARALLEL_RANGE_H
+#define TWINE_PARALLEL_RANGE_H
+
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+
+#include "twine/twine.h"
+#include "worker_pool_common.h"
+#include "twine_internal.h"
+
+namespace twine {
+
+/**
+ * @brief An index range split into chunks that are processed by several
+ *        threads, either distributed round robin up front or handed out
+ *        one at a time to the first thread asking for one.
+ */
+class ParallelRange
+{
+public:
+    TWINE_DECLARE_NON_COPYABLE(ParallelRange);
+
+    ParallelRange() = default;
+
+    /**
+     * @brief Set up a new range, must be called before the threads processing it are started.
+     *        Chunks are counted in 64 bits, so that any int range and grain are valid.
+     * @param no_threads The number of threads that will process the range
+     */
+    void set(int begin, int end, int grain, RangeCallback callback, void* data,
+             ChunkScheduling scheduling, int no_threads)
+    {
+        _begin = begin;
+        _end = end;
+        _grain = grain;
+        _no_chunks = (static_cast<int64_t>(end) - begin + grain - 1) / grain;
+        _callback = callback;
+        _data = data;
+        _scheduling = scheduling;
+        _no_threads = no_threads;
+        _next_chunk.store(0, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Process chunks until the range is done, called concurrently from all threads
+     * @param thread_index Index of the calling thread in [0, no_threads)
+     */
+    void run(int thread_index)
+    {
+        if (_scheduling == ChunkScheduling::STATIC)
+        {
+            for (int64_t chunk = thread_index; chunk < _no_chunks; chunk += _no_threads)
+            {
+                _run_chunk(chunk);
+            }
+        }
+        else
+        {
+            int64_t chunk;
+            while ((chunk = _next_chunk.fetch_add(1, std::memory_order_relaxed)) < _no_chunks)
+            {
+                _run_chunk(chunk);
+            }
+        }
+    }
+
+private:
+    void _run_chunk(int64_t chunk)
+    {
+        int64_t chunk_begin = _begin + chunk * _grain;
+        int64_t chunk_end = std::min<int64_t>(chunk_begin + _grain, _end);
+        _callback(_data, static_cast<int>(chunk_begin), static_cast<int>(chunk_end));
+    }
+
+    int             _begin{0};
+    int             _end{0};
+    int             _grain{1};
+    int64_t         _no_chunks{0};
+    RangeCallback   _callback{nullptr};
+    void*           _data{nullptr};
+    ChunkScheduling _scheduling{ChunkScheduling::DYNAMIC};
+    int             _no_threads{1};
+    alignas(CACHE_LINE_SIZE) std::atomic<int64_t> _next_chunk{0};
+};
+
+} // namespace twine
+
+#endif //TWINE_PARALLEL_RANGE_H
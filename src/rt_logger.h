@@ -0,0 +1,610 @@
+/*
+ * Copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk
+ * Twine is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * Twine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Twine.
+ * If not, see http://www.gnu.org/licenses/ .
+ */
+
+/**
+ * @brief Asynchronous logger behind rt_printf() for non-xenomai builds
+ * @copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk, Stockholm
+ */
+
+#ifndef TWINE_RT_LOGGER_H
+#define TWINE_RT_LOGGER_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <sys/types.h>
+
+#include "twine/twine.h"
+#include "twine_internal.h"
+
+namespace twine {
+
+constexpr int MAX_LOGGING_THREADS = 64;
+constexpr int LOG_RECORDS_PER_THREAD = 32;
+constexpr size_t LOG_RECORD_SIZE = 256;
+constexpr size_t MAX_LOG_LINE_LENGTH = 1024;
+// How often a non-rt thread checks for space when its ring is full
+constexpr auto LOG_POLL_INTERVAL = std::chrono::milliseconds(5);
+
+/**
+ * @brief A message as stored by the logging thread, the format string pointer followed
+ *        by the raw arguments, and the contents of string arguments, packed in order.
+ */
+struct LogRecord
+{
+    const char* format;
+    uint16_t    payload_size;
+    uint8_t     no_conversions;  // The number of conversions whose arguments were stored
+    bool        truncated;       // Set if the arguments of all conversions did not fit
+    char        payload[LOG_RECORD_SIZE - sizeof(const char*) - 4];
+};
+
+static_assert(sizeof(LogRecord) == LOG_RECORD_SIZE);
+
+/**
+ * @brief A printf conversion specification, i.e. "%-*.3lld"
+ */
+struct Conversion
+{
+    const char* begin;
+    const char* end;
+    char        length[3];
+    char        conversion;
+    int         stars;
+};
+
+/**
+ * @brief Find the next conversion specification in a format string
+ * @param format The format string, set to the character after the conversion
+ * @param text_end Set to the end of the literal text before the conversion
+ * @return true if a conversion was found, false if the rest of the string is text
+ */
+inline bool next_conversion(const char*& format, const char*& text_end, Conversion& conversion)
+{
+    const char* percent = std::strchr(format, '%');
+    if (percent == nullptr)
+    {
+        text_end = format + std::strlen(format);
+        format = text_end;
+        return false;
+    }
+    text_end = percent;
+    const char* c = percent + 1;
+    if (*c == '%')
+    {
+        // Printed as text, including one of the two '%'
+        text_end = c;
+        format = c + 1;
+        conversion = {c, c, {}, '%', 0};
+        return true;
+    }
+    conversion = {percent, nullptr, {}, 0, 0};
+    while (*c != '\0' && std::strchr("-+ #0'", *c) != nullptr)
+    {
+        c++;
+    }
+    // Width and precision
+    for (int field = 0; field < 2; ++field)
+    {
+        if (*c == '*')
+        {
+            conversion.stars++;
+            c++;
+        }
+        while (*c >= '0' && *c <= '9')
+        {
+            c++;
+        }
+        if (field == 1 || *c != '.')
+        {
+            break;
+        }
+        c++;
+    }
+    int length = 0;
+    while (*c != '\0' && std::strchr("hlLjzt", *c) != nullptr && length < 2)
+    {
+        conversion.length[length++] = *c++;
+    }
+    if (*c == '\0' || std::strchr("diouxXcfFeEgGaAspn", *c) == nullptr)
+    {
+        // Not a valid conversion, print the rest of the format string as text
+        text_end = c + std::strlen(c);
+        format = text_end;
+        return false;
+    }
+    conversion.conversion = *c;
+    conversion.end = c + 1;
+    format = c + 1;
+    return true;
+}
+
+inline bool is_length(const Conversion& conversion, const char* length)
+{
+    return std::strcmp(conversion.length, length) == 0;
+}
+
+/**
+ * @brief Appends values to the payload of a record, and reads them back in order
+ */
+class PayloadWriter
+{
+public:
+    explicit PayloadWriter(LogRecord& record) : _record(record) {}
+
+    template <typename T>
+    bool write(T value)
+    {
+        if (_record.payload_size + sizeof(T) > sizeof(_record.payload))
+        {
+            return false;
+        }
+        std::memcpy(_record.payload + _record.payload_size, &value, sizeof(T));
+        _record.payload_size += sizeof(T);
+        return true;
+    }
+
+    bool write_string(const char* string)
+    {
+        if (string == nullptr)
+        {
+            string = "(null)";
+        }
+        size_t space = sizeof(_record.payload) - _record.payload_size;
+        if (space == 0)
+        {
+            return false;
+        }
+        size_t length = strnlen(string, space - 1);
+        std::memcpy(_record.payload + _record.payload_size, string, length);
+        _record.payload[_record.payload_size + length] = '\0';
+        _record.payload_size += length + 1;
+        return true;
+    }
+
+private:
+    LogRecord& _record;
+};
+
+class PayloadReader
+{
+public:
+    explicit PayloadReader(const LogRecord& record) : _record(record) {}
+
+    template <typename T>
+    T read()
+    {
+        T value;
+        std::memcpy(&value, _record.payload + _position, sizeof(T));
+        _position += sizeof(T);
+        return value;
+    }
+
+    const char* read_string()
+    {
+        const char* string = _record.payload + _position;
+        _position += std::strlen(string) + 1;
+        return string;
+    }
+
+private:
+    const LogRecord& _record;
+    size_t           _position{0};
+};
+
+/**
+ * @brief Store the arguments of a printf call in a record, without formatting them.
+ *        Integers are widened to 64 bits and converted back when formatting.
+ */
+inline void store_arguments(LogRecord& record, const char* format, va_list args)
+{
+    record.format = format;
+    record.payload_size = 0;
+    record.no_conversions = 0;
+    record.truncated = false;
+    PayloadWriter writer(record);
+    const char* text_end;
+    Conversion c;
+    while (next_conversion(format, text_end, c))
+    {
+        if (c.conversion == '%')
+        {
+            continue;
+        }
+        bool stored = true;
+        for (int i = 0; i < c.stars; ++i)
+        {
+            stored &= writer.write<int64_t>(va_arg(args, int));
+        }
+        switch (c.conversion)
+        {
+            case 'd':
+            case 'i':
+            case 'c':
+                if (is_length(c, "ll"))     stored &= writer.write<int64_t>(va_arg(args, long long));
+                else if (is_length(c, "l")) stored &= writer.write<int64_t>(va_arg(args, long));
+                else if (is_length(c, "j")) stored &= writer.write<int64_t>(va_arg(args, intmax_t));
+                else if (is_length(c, "z")) stored &= writer.write<int64_t>(va_arg(args, ssize_t));
+                else if (is_length(c, "t")) stored &= writer.write<int64_t>(va_arg(args, ptrdiff_t));
+                else                        stored &= writer.write<int64_t>(va_arg(args, int));
+                break;
+
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X':
+                if (is_length(c, "ll"))     stored &= writer.write<uint64_t>(va_arg(args, unsigned long long));
+                else if (is_length(c, "l")) stored &= writer.write<uint64_t>(va_arg(args, unsigned long));
+                else if (is_length(c, "j")) stored &= writer.write<uint64_t>(va_arg(args, uintmax_t));
+                else if (is_length(c, "z")) stored &= writer.write<uint64_t>(va_arg(args, size_t));
+                else if (is_length(c, "t")) stored &= writer.write<uint64_t>(va_arg(args, ptrdiff_t));
+                else                        stored &= writer.write<uint64_t>(va_arg(args, unsigned int));
+                break;
+
+            case 's':
+                stored &= writer.write_string(va_arg(args, const char*));
+                break;
+
+            case 'p':
+                stored &= writer.write<const void*>(va_arg(args, const void*));
+                break;
+
+            case 'n':
+                // Can not be supported as the message is formatted later
+                va_arg(args, void*);
+                break;
+
+            default:
+                if (is_length(c, "L")) stored &= writer.write<long double>(va_arg(args, long double));
+                else                   stored &= writer.write<double>(va_arg(args, double));
+        }
+        if (stored == false)
+        {
+            record.truncated = true;
+            return;
+        }
+        record.no_conversions++;
+    }
+}
+
+/**
+ * @brief Format a record stored with store_arguments()
+ * @return The length of the formatted message, not more than size - 1
+ */
+inline size_t format_record(const LogRecord& record, char* buffer, size_t size)
+{
+    PayloadReader reader(record);
+    size_t length = 0;
+    auto append = [&](int written)
+    {
+        if (written > 0)
+        {
+            length = std::min(length + written, size - 1);
+        }
+    };
+
+    const char* format = record.format;
+    const char* text = format;
+    const char* text_end;
+    Conversion c;
+    int conversions = 0;
+    while (true)
+    {
+        bool found = next_conversion(format, text_end, c);
+        append(snprintf(buffer + length, size - length, "%.*s", static_cast<int>(text_end - text), text));
+        if (found == false)
+        {
+            break;
+        }
+        text = format;
+        if (c.conversion == '%')
+        {
+            continue;
+        }
+        if (conversions++ == record.no_conversions)
+        {
+            if (record.truncated)
+            {
+                append(snprintf(buffer + length, size - length, "[...]"));
+            }
+            break;
+        }
+
+        std::array<char, 32> spec{};
+        std::memcpy(spec.data(), c.begin, std::min(static_cast<size_t>(c.end - c.begin), spec.size() - 1));
+        std::array<int, 2> stars{};
+        for (int i = 0; i < c.stars; ++i)
+        {
+            stars[i] = static_cast<int>(reader.read<int64_t>());
+        }
+        auto print = [&](auto value)
+        {
+            char* out = buffer + length;
+            size_t space = size - length;
+            switch (c.stars)
+            {
+                case 0:  return snprintf(out, space, spec.data(), value);
+                case 1:  return snprintf(out, space, spec.data(), stars[0], value);
+                default: return snprintf(out, space, spec.data(), stars[0], stars[1], value);
+            }
+        };
+
+        switch (c.conversion)
+        {
+            case 'd':
+            case 'i':
+            case 'c':
+            {
+                auto value = reader.read<int64_t>();
+                if (is_length(c, "ll"))     append(print(static_cast<long long>(value)));
+                else if (is_length(c, "l")) append(print(static_cast<long>(value)));
+                else if (is_length(c, "j")) append(print(static_cast<intmax_t>(value)));
+                else if (is_length(c, "z")) append(print(static_cast<ssize_t>(value)));
+                else if (is_length(c, "t")) append(print(static_cast<ptrdiff_t>(value)));
+                else                        append(print(static_cast<int>(value)));
+                break;
+            }
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X':
+            {
+                auto value = reader.read<uint64_t>();
+                if (is_length(c, "ll"))     append(print(static_cast<unsigned long long>(value)));
+                else if (is_length(c, "l")) append(print(static_cast<unsigned long>(value)));
+                else if (is_length(c, "j")) append(print(static_cast<uintmax_t>(value)));
+                else if (is_length(c, "z")) append(print(static_cast<size_t>(value)));
+                else if (is_length(c, "t")) append(print(static_cast<ptrdiff_t>(value)));
+                else                        append(print(static_cast<unsigned int>(value)));
+                break;
+            }
+            case 's':
+                append(print(reader.read_string()));
+                break;
+
+            case 'p':
+                append(print(reader.read<const void*>()));
+                break;
+
+            case 'n':
+                break;
+
+            default:
+                if (is_length(c, "L")) append(print(reader.read<long double>()));
+                else                   append(print(reader.read<double>()));
+        }
+    }
+    return length;
+}
+
+/**
+ * @brief Messages logged from one thread, waiting to be written
+ */
+struct ThreadLog
+{
+    explicit ThreadLog(RtConditionVariable* notifier) : records(LOG_RECORDS_PER_THREAD, notifier) {}
+
+    SpscRingBuffer<LogRecord> records;
+    std::atomic_bool          in_use{false};
+    std::atomic<uint64_t>     dropped{0};
+};
+
+/**
+ * @brief Logger where rt threads only copy the format string pointer and the raw
+ *        arguments of a message to a lock-free ring of their own, and a background
+ *        thread formats and writes the messages. All memory is allocated when the
+ *        logger is created, a thread claims one of the rings on its first message.
+ *        Messages from rt threads are dropped if their ring is full, non-rt threads
+ *        wait for space instead. The background thread sleeps until a ring goes from
+ *        empty to non-empty, or a message is dropped.
+ */
+class RtLogger
+{
+public:
+    TWINE_DECLARE_NON_COPYABLE(RtLogger);
+
+    ~RtLogger()
+    {
+        _running.store(false, std::memory_order_release);
+        _notifier->notify();
+        _thread.join();
+        flush();
+    }
+
+    /**
+     * @brief The logger used by rt_printf(), created on first use
+     */
+    static RtLogger& instance()
+    {
+        static RtLogger logger(stdout);
+        return logger;
+    }
+
+    /**
+     * @brief Log a message, safe to call from an rt thread once the logger exists
+     * @return 0 if the message was logged, -1 if it was dropped
+     */
+    int log(const char* format, va_list args)
+    {
+        ThreadLog* thread_log = _thread_log();
+        if (thread_log == nullptr)
+        {
+            if (ThreadRtFlag::is_realtime())
+            {
+                _unowned_dropped.fetch_add(1, std::memory_order_relaxed);
+                _notifier->notify();
+                return -1;
+            }
+            std::lock_guard<std::mutex> lock(_consumer_mutex);
+            return vfprintf(_output, format, args);
+        }
+        auto [record, count] = thread_log->records.reserve(1);
+        while (count == 0)
+        {
+            if (ThreadRtFlag::is_realtime())
+            {
+                thread_log->dropped.fetch_add(1, std::memory_order_relaxed);
+                _notifier->notify();
+                return -1;
+            }
+            std::this_thread::sleep_for(LOG_POLL_INTERVAL);
+            std::tie(record, count) = thread_log->records.reserve(1);
+        }
+        store_arguments(*record, format, args);
+        thread_log->records.commit(1);
+        return 0;
+    }
+
+    /**
+     * @brief Write all logged messages, blocks and must not be called from an rt thread
+     */
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(_consumer_mutex);
+        _write_messages();
+    }
+
+    /**
+     * @return The total number of messages dropped
+     */
+    uint64_t dropped_messages() const
+    {
+        uint64_t dropped = _unowned_dropped.load(std::memory_order_relaxed);
+        for (const auto& log : _logs)
+        {
+            dropped += log->dropped.load(std::memory_order_relaxed);
+        }
+        return dropped;
+    }
+
+private:
+    // Private as threads keep the ring they claimed from the one instance
+    explicit RtLogger(FILE* output) : _output(output),
+                                      _notifier(RtConditionVariable::create_rt_condition_variable())
+    {
+        for (auto& log : _logs)
+        {
+            log = std::make_unique<ThreadLog>(_notifier.get());
+        }
+        _thread = std::thread(&RtLogger::_run, this);
+    }
+
+    /**
+     * @brief Releases the ring of a thread when the thread exits. Messages left in the
+     *        ring are still written, also if another thread claims the ring.
+     */
+    struct ThreadLogHandle
+    {
+        ThreadLog* log{nullptr};
+        bool       claimed{false};
+
+        ~ThreadLogHandle()
+        {
+            if (log != nullptr)
+            {
+                log->in_use.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    ThreadLog* _thread_log()
+    {
+        thread_local ThreadLogHandle handle;
+        if (handle.claimed == false)
+        {
+            handle.claimed = true;
+            for (auto& log : _logs)
+            {
+                if (log->in_use.exchange(true, std::memory_order_acquire) == false)
+                {
+                    handle.log = log.get();
+                    break;
+                }
+            }
+        }
+        return handle.log;
+    }
+
+    void _run()
+    {
+        while (_running.load(std::memory_order_acquire))
+        {
+            {
+                std::lock_guard<std::mutex> lock(_consumer_mutex);
+                _write_messages();
+            }
+            // Rings notify when they become non-empty, which they are not after writing
+            _notifier->wait();
+        }
+    }
+
+    /**
+     * @brief Format and write the messages in all rings, the caller must hold _consumer_mutex
+     */
+    void _write_messages()
+    {
+        bool written = false;
+        for (auto& log : _logs)
+        {
+            while (true)
+            {
+                auto [record, count] = log->records.peek(1);
+                if (count == 0)
+                {
+                    break;
+                }
+                size_t length = format_record(*record, _line.data(), _line.size());
+                fwrite(_line.data(), 1, length, _output);
+                log->records.consume(1);
+                written = true;
+            }
+        }
+        uint64_t dropped = dropped_messages();
+        if (dropped != _reported_dropped)
+        {
+            fprintf(_output, "twine: %llu rt_printf messages dropped\n",
+                    static_cast<unsigned long long>(dropped - _reported_dropped));
+            _reported_dropped = dropped;
+            written = true;
+        }
+        if (written)
+        {
+            fflush(_output);
+        }
+    }
+
+    FILE*                                                    _output;
+    std::unique_ptr<RtConditionVariable>                     _notifier;
+    std::array<std::unique_ptr<ThreadLog>, MAX_LOGGING_THREADS> _logs;
+    std::atomic<uint64_t>                                    _unowned_dropped{0};
+
+    std::mutex                                               _consumer_mutex;
+    std::array<char, MAX_LOG_LINE_LENGTH>                    _line;
+    uint64_t                                                 _reported_dropped{0};
+
+    std::thread                                              _thread;
+    std::atomic_bool                                         _running{true};
+};
+
+} // namespace twine
+
+#endif //TWINE_RT_LOGGER_H
@@ -0,0 +1,192 @@
+/*
+ * Copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk
+ * Twine is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * Twine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Twine.
+ * If not, see http://www.gnu.org/licenses/ .
+ */
+
+/**
+ * @brief Per-worker memory for temporary allocations
+ * @copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk, Stockholm
+ */
+
+#ifndef TWINE_SCRATCH_ARENA_H
+#define TWINE_SCRATCH_ARENA_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "twine_internal.h"
+
+namespace twine {
+
+constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+/**
+ * @brief Bump allocator over a block of memory that is allocated up front. Allocations
+ *        are never freed one by one, instead the whole arena is reset at once, which
+ *        makes both allocating and freeing O(1) and safe from an rt thread.
+ */
+class ScratchArena
+{
+public:
+    TWINE_DECLARE_NON_COPYABLE(ScratchArena);
+
+    ScratchArena() = default;
+
+    ~ScratchArena()
+    {
+        _free();
+    }
+
+    /**
+     * @brief Allocate the memory of the arena and touch every page of it. Should be
+     *        called from the thread that will use the arena, so that the pages are
+     *        placed on the memory node of its cpu.
+     * @param size The size of the arena in bytes
+     * @param huge_pages If set, back the arena with huge pages if possible, which
+     *                   reduces tlb misses when a lot of memory is used every cycle.
+     *                   Uses reserved huge pages if there are any and otherwise asks for
+     *                   transparent huge pages. The size is rounded up to whole huge pages.
+     * @return 0 if the operation succeed, an errno value otherwise
+     */
+    int init(size_t size, bool huge_pages)
+    {
+        _free();
+        if (size == 0)
+        {
+            return 0;
+        }
+        size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        void* memory = MAP_FAILED;
+        if (huge_pages)
+        {
+            size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+            memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (memory != MAP_FAILED)
+            {
+                page_size = HUGE_PAGE_SIZE;
+            }
+#endif
+        }
+        else
+        {
+            size = (size + page_size - 1) & ~(page_size - 1);
+        }
+        if (memory == MAP_FAILED)
+        {
+            memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED)
+            {
+                return errno;
+            }
+#ifdef MADV_HUGEPAGE
+            if (huge_pages)
+            {
+                // Only a hint, the arena works with regular pages too
+                madvise(memory, size, MADV_HUGEPAGE);
+            }
+#endif
+        }
+        _memory = static_cast<char*>(memory);
+        _size = size;
+        _used = 0;
+        for (size_t offset = 0; offset < size; offset += page_size)
+        {
+            static_cast<volatile char*>(_memory)[offset] = 0;
+        }
+        return 0;
+    }
+
+    /**
+     * @brief Allocate memory from the arena, which stays valid until the next reset()
+     * @param size The number of bytes to allocate
+     * @param alignment The alignment of the memory, must be a power of 2
+     * @return A pointer to the memory, or nullptr if the arena doesn't have enough
+     *         free memory left or the alignment is invalid
+     */
+    void* allocate(size_t size, size_t alignment)
+    {
+        if (_memory == nullptr || alignment == 0 || (alignment & (alignment - 1)) != 0)
+        {
+            return nullptr;
+        }
+        auto base = reinterpret_cast<uintptr_t>(_memory);
+        size_t offset = ((base + _used + alignment - 1) & ~(alignment - 1)) - base;
+        if (offset > _size || size > _size - offset)
+        {
+            return nullptr;
+        }
+        _used = offset + size;
+        return _memory + offset;
+    }
+
+    /**
+     * @brief Free all allocations made from the arena at once
+     */
+    void reset()
+    {
+        _used = 0;
+    }
+
+    size_t capacity() const
+    {
+        return _size;
+    }
+
+    size_t used() const
+    {
+        return _used;
+    }
+
+    /**
+     * @return The arena of the calling thread, or nullptr if it has none
+     */
+    static ScratchArena* current()
+    {
+        return _current;
+    }
+
+    /**
+     * @brief Set the arena of the calling thread, returned from current()
+     */
+    static void set_current(ScratchArena* arena)
+    {
+        _current = arena;
+    }
+
+private:
+    void _free()
+    {
+        if (_memory != nullptr)
+        {
+            munmap(_memory, _size);
+            _memory = nullptr;
+            _size = 0;
+            _used = 0;
+        }
+    }
+
+    char*   _memory{nullptr};
+    size_t  _size{0};
+    size_t  _used{0};
+
+    static thread_local ScratchArena* _current;
+};
+
+} // namespace twine
+
+#endif //TWINE_SCRATCH_ARENA_H
@@ -0,0 +1,307 @@
+/*
+ * Copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk
+ * Twine is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * Twine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Twine.
+ * If not, see http://www.gnu.org/licenses/ .
+ */
+
+/**
+ * @brief Work-stealing scheduling of tasks submitted to a WorkerPool
+ * @copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk, Stockholm
+ */
+
+#ifndef TWINE_TASK_SCHEDULER_H
+#define TWINE_TASK_SCHEDULER_H
+
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cassert>
+
+#include "twine/twine.h"
+#include "worker_pool_common.h"
+#include "twine_internal.h"
+
+namespace twine {
+
+constexpr int NO_TASK = -1;
+constexpr int STEAL_ABORTED = -2;
+
+/**
+ * @brief Fixed capacity Chase-Lev work-stealing deque of task indices, see
+ *        "Correct and Efficient Work-Stealing for Weak Memory Models", Lê et al. 2013.
+ *        push() and pop() may only be called by the thread owning the queue, while
+ *        steal() can be called concurrently from any thread. Lock-free and
+ *        allocation free, except for the constructor.
+ */
+class WorkStealingQueue
+{
+public:
+    TWINE_DECLARE_NON_COPYABLE(WorkStealingQueue);
+
+    /**
+     * @param capacity Maximum number of elements, must be a power of 2
+     */
+    explicit WorkStealingQueue(int capacity) : _mask(capacity - 1),
+                                               _buffer(capacity)
+    {
+        assert((capacity & _mask) == 0);
+    }
+
+    /**
+     * @brief Push a task to the bottom of the queue, owner only
+     * @return false if the queue is full
+     */
+    bool push(int task)
+    {
+        auto bottom = _bottom.load(std::memory_order_relaxed);
+        auto top = _top.load(std::memory_order_acquire);
+        if (bottom - top > _mask)
+        {
+            return false;
+        }
+        _buffer[bottom & _mask].store(task, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        _bottom.store(bottom + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * @brief Pop a task from the bottom of the queue, owner only
+     * @return The task, or NO_TASK if the queue is empty
+     */
+    int pop()
+    {
+        auto bottom = _bottom.load(std::memory_order_relaxed) - 1;
+        _bottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto top = _top.load(std::memory_order_relaxed);
+
+        if (top > bottom)
+        {
+            _bottom.store(bottom + 1, std::memory_order_relaxed);
+            return NO_TASK;
+        }
+        int task = _buffer[bottom & _mask].load(std::memory_order_relaxed);
+        if (top == bottom)
+        {
+            // Last element, race against thieves for it
+            if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            {
+                task = NO_TASK;
+            }
+            _bottom.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    /**
+     * @brief Steal a task from the top of the queue, can be called from any thread
+     * @return The task, NO_TASK if the queue is empty or STEAL_ABORTED if another
+     *         thread took the task first
+     */
+    int steal()
+    {
+        auto top = _top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto bottom = _bottom.load(std::memory_order_acquire);
+        if (top >= bottom)
+        {
+            return NO_TASK;
+        }
+        int task = _buffer[top & _mask].load(std::memory_order_relaxed);
+        if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        {
+            return STEAL_ABORTED;
+        }
+        return task;
+    }
+
+private:
+    alignas(CACHE_LINE_SIZE) std::atomic<int64_t> _top{0};
+    alignas(CACHE_LINE_SIZE) std::atomic<int64_t> _bottom{0};
+    const int64_t _mask;
+    std::vector<std::atomic<int>> _buffer;
+};
+
+/**
+ * @brief Distributes tasks submitted by the thread controlling a WorkerPool over
+ *        per-worker work-stealing queues. Workers run the tasks in their own queue
+ *        and steal from the other workers' queues when theirs is empty. Tasks are
+ *        queued when the cycle starts, so that they are spread over the workers
+ *        taking part in that cycle, even if workers were removed after submitting.
+ *        Tasks are matched between cycles by the order they were submitted in and
+ *        are preferably queued to the worker that ran them in the previous cycle,
+ *        so that data used by the task is likely still in that worker's cache.
+ */
+class TaskScheduler
+{
+public:
+    TWINE_DECLARE_NON_COPYABLE(TaskScheduler);
+
+    TaskScheduler() : _tasks(MAX_TASKS_PER_CYCLE),
+                      _last_worker(MAX_TASKS_PER_CYCLE, NO_WORKER)
+    {
+        set_no_workers(0);
+    }
+
+    /**
+     * @brief Create queues for the given number of workers, not safe to call while
+     *        tasks are running
+     */
+    void set_no_workers(int workers)
+    {
+        // One extra queue for the calling thread when it participates
+        while (static_cast<int>(_queues.size()) < workers + 1)
+        {
+            _queues.push_back(std::make_unique<WorkStealingQueue>(MAX_TASKS_PER_CYCLE));
+        }
+        _no_workers = workers;
+    }
+
+    /**
+     * @brief If enabled, tasks are also queued to the thread submitting them, which
+     *        will then run tasks with index no_workers. Not safe to call while tasks
+     *        are running.
+     */
+    void set_caller_participation(bool enabled)
+    {
+        _caller_participates = enabled;
+    }
+
+    /**
+     * @brief Add a task to the next cycle, not safe to call while tasks are running
+     */
+    WorkerPoolStatus submit(WorkerCallback task_cb, void* task_data)
+    {
+        if (task_cb == nullptr)
+        {
+            return WorkerPoolStatus::INVALID_ARGUMENTS;
+        }
+        int participants = _no_participants();
+        if (participants == 0)
+        {
+            return WorkerPoolStatus::ERROR;
+        }
+        if (_no_tasks >= MAX_TASKS_PER_CYCLE)
+        {
+            return WorkerPoolStatus::LIMIT_EXCEEDED;
+        }
+        _tasks[_no_tasks++] = {task_cb, task_data};
+        return WorkerPoolStatus::OK;
+    }
+
+    /**
+     * @brief Queue the submitted tasks to the current participants, call just before
+     *        releasing the workers to run them
+     * @return false if there are no participants to run the tasks
+     */
+    bool distribute()
+    {
+        int participants = _no_participants();
+        if (participants == 0)
+        {
+            return false;
+        }
+        for (int task = 0; task < _no_tasks; ++task)
+        {
+            int worker = _last_worker[task];
+            if (worker == NO_WORKER || worker >= participants)
+            {
+                worker = task % participants;
+            }
+            _queues[worker]->push(task);
+        }
+        return true;
+    }
+
+    int no_tasks() const
+    {
+        return _no_tasks;
+    }
+
+    /**
+     * @brief Forget the submitted tasks, call when all tasks have run
+     */
+    void clear()
+    {
+        _no_tasks = 0;
+    }
+
+    /**
+     * @brief Run tasks until all queues are empty, called concurrently by all workers
+     * @param worker_index The index of the calling worker, or no_workers for the
+     *                     participating calling thread
+     */
+    void run_tasks(int worker_index)
+    {
+        while (true)
+        {
+            int task = _queues[worker_index]->pop();
+            if (task == NO_TASK)
+            {
+                task = _steal_task(worker_index);
+                if (task == NO_TASK)
+                {
+                    return;
+                }
+            }
+            _last_worker[task] = worker_index;
+            _tasks[task].callback(_tasks[task].data);
+        }
+    }
+
+private:
+    static constexpr int NO_WORKER = -1;
+
+    struct Task
+    {
+        WorkerCallback callback;
+        void*          data;
+    };
+
+    int _no_participants() const
+    {
+        return _no_workers + (_caller_participates ? 1 : 0);
+    }
+
+    int _steal_task(int thief_index)
+    {
+        int participants = _no_participants();
+        bool retry = true;
+        while (retry)
+        {
+            retry = false;
+            // Start with the neighbouring worker to spread out thieves
+            for (int i = 1; i < participants; ++i)
+            {
+                int task = _queues[(thief_index + i) % participants]->steal();
+                if (task >= 0)
+                {
+                    return task;
+                }
+                retry |= task == STEAL_ABORTED;
+            }
+        }
+        return NO_TASK;
+    }
+
+    std::vector<Task> _tasks;
+    std::vector<int>  _last_worker;
+    int               _no_tasks{0};
+    int               _no_workers{0};
+    bool              _caller_participates{false};
+    std::vector<std::unique_ptr<WorkStealingQueue>> _queues;
+};
+
+} // namespace twine
+
+#endif //TWINE_TASK_SCHEDULER_H
@@ -21,15 +21,35 @@
 #define TWINE_THREAD_HELPERS_H
 
 #include <cassert>
+#include <atomic>
+#include <algorithm>
+#include <climits>
+#include <cerrno>
+#include <ctime>
 
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef __APPLE__
+#include <cstdio>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#define TWINE_HAS_FUTEX
+#define TWINE_HAS_SCHED_DEADLINE
+#endif
 
 #ifdef TWINE_BUILD_WITH_XENOMAI
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 #include <cobalt/pthread.h>
 #include <cobalt/semaphore.h>
+#include <cobalt/sched.h>
 #pragma GCC diagnostic pop
 #endif
 #ifndef TWINE_BUILD_WITH_XENOMAI
@@ -111,6 +131,38 @@ inline int condition_var_create(pthread_cond_t* condition_var, const pthread_con
     }
 }
 
+/**
+ * @brief Create a condition variable whose timed waits use CLOCK_MONOTONIC, the clock
+ *        of current_rt_time(). On Apple, where the clock can not be set, timed waits
+ *        use a relative timeout instead.
+ */
+template<ThreadType type>
+inline int condition_var_create_monotonic(pthread_cond_t* condition_var)
+{
+    if constexpr (type == ThreadType::PTHREAD)
+    {
+#ifdef __APPLE__
+        return pthread_cond_init(condition_var, nullptr);
+#else
+        pthread_condattr_t attributes;
+        pthread_condattr_init(&attributes);
+        pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+        int res = pthread_cond_init(condition_var, &attributes);
+        pthread_condattr_destroy(&attributes);
+        return res;
+#endif
+    }
+    else if constexpr (type == ThreadType::XENOMAI)
+    {
+        pthread_condattr_t attributes;
+        __cobalt_pthread_condattr_init(&attributes);
+        __cobalt_pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+        int res = __cobalt_pthread_cond_init(condition_var, &attributes);
+        __cobalt_pthread_condattr_destroy(&attributes);
+        return res;
+    }
+}
+
 template<ThreadType type>
 inline int condition_var_destroy(pthread_cond_t* condition_var)
 {
@@ -137,6 +189,42 @@ inline int condition_wait(pthread_cond_t*condition_var, pthread_mutex_t* mutex)
     }
 }
 
+inline timespec to_timespec(std::chrono::nanoseconds time)
+{
+    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(time);
+    return {static_cast<time_t>(seconds.count()), static_cast<long>((time - seconds).count())};
+}
+
+/**
+ * @brief Wait on a condition variable created with condition_var_create_monotonic()
+ *        until deadline, in the time of current_rt_time()
+ * @return 0 if signaled, ETIMEDOUT if the deadline passed
+ */
+template<ThreadType type>
+inline int condition_timed_wait(pthread_cond_t* condition_var, pthread_mutex_t* mutex, std::chrono::nanoseconds deadline)
+{
+    if constexpr (type == ThreadType::PTHREAD)
+    {
+#ifdef __APPLE__
+        auto timeout = deadline - current_rt_time();
+        if (timeout.count() <= 0)
+        {
+            return ETIMEDOUT;
+        }
+        auto relative_time = to_timespec(timeout);
+        return pthread_cond_timedwait_relative_np(condition_var, mutex, &relative_time);
+#else
+        auto absolute_time = to_timespec(deadline);
+        return pthread_cond_timedwait(condition_var, mutex, &absolute_time);
+#endif
+    }
+    else if constexpr (type == ThreadType::XENOMAI)
+    {
+        auto absolute_time = to_timespec(deadline);
+        return __cobalt_pthread_cond_timedwait(condition_var, mutex, &absolute_time);
+    }
+}
+
 template<ThreadType type>
 inline int condition_signal(pthread_cond_t* condition_var)
 {
@@ -190,17 +278,48 @@ inline int thread_join(pthread_t thread, void** return_var = nullptr)
 }
 
 template<ThreadType type>
-inline int semaphore_create(sem_t** semaphore, [[maybe_unused]] const char* semaphore_name)
+inline int thread_yield()
 {
     if constexpr (type == ThreadType::PTHREAD)
     {
-        sem_unlink(semaphore_name);
-        *semaphore = sem_open(semaphore_name, O_CREAT, 0, 0);
+        return sched_yield();
+    }
+    else if constexpr (type == ThreadType::XENOMAI)
+    {
+        return __cobalt_sched_yield();
+    }
+}
+
+/**
+ * @brief Create a semaphore that is private to the process. semaphore must point
+ *        to storage for the semaphore, except on Apple where it is replaced.
+ */
+template<ThreadType type>
+inline int semaphore_create(sem_t** semaphore)
+{
+    if constexpr (type == ThreadType::PTHREAD)
+    {
+#ifdef __APPLE__
+        // Unnamed semaphores are not supported on macOS. Use a name unique to this
+        // process and semaphore, and unlink it directly so that no one else can open it
+        static std::atomic<int> semaphore_counter{0};
+        char semaphore_name[32];
+        std::snprintf(semaphore_name, sizeof(semaphore_name), "/twine_%d_%d",
+                      static_cast<int>(getpid()), semaphore_counter.fetch_add(1));
+        *semaphore = sem_open(semaphore_name, O_CREAT | O_EXCL, 0600, 0);
         if (*semaphore == SEM_FAILED)
         {
             return errno;
         }
+        sem_unlink(semaphore_name);
+        return 0;
+#else
+        if (sem_init(*semaphore, 0, 0) != 0)
+        {
+            return errno;
+        }
         return 0;
+#endif
     }
     else if constexpr (type == ThreadType::XENOMAI)
     {
@@ -209,13 +328,15 @@ inline int semaphore_create(sem_t** semaphore, [[maybe_unused]] const char* sema
 }
 
 template<ThreadType type>
-inline int semaphore_destroy(sem_t* semaphore, [[maybe_unused]] const char* semaphore_name)
+inline int semaphore_destroy(sem_t* semaphore)
 {
     if constexpr (type == ThreadType::PTHREAD)
     {
-        sem_unlink(semaphore_name);
-        sem_close(semaphore);
-        return 0;
+#ifdef __APPLE__
+        return sem_close(semaphore);
+#else
+        return sem_destroy(semaphore);
+#endif
     }
     else if constexpr (type == ThreadType::XENOMAI)
     {
@@ -236,6 +357,19 @@ inline int semaphore_wait(sem_t* semaphore)
     }
 }
 
+template<ThreadType type>
+inline int semaphore_try_wait(sem_t* semaphore)
+{
+    if constexpr (type == ThreadType::PTHREAD)
+    {
+        return sem_trywait(semaphore);
+    }
+    else if constexpr (type == ThreadType::XENOMAI)
+    {
+        return __cobalt_sem_trywait(semaphore);
+    }
+}
+
 template<ThreadType type>
 inline int semaphore_signal(sem_t* semaphore)
 {
@@ -249,6 +383,221 @@ inline int semaphore_signal(sem_t* semaphore)
     }
 }
 
+/**
+ * @brief Hint to the cpu that the calling thread is busy waiting
+ */
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#endif
+}
+
+// How many times to busy wait between checking the clock when spinning
+constexpr int SPIN_ITERATIONS_PER_CLOCK_CHECK = 16;
+
+/**
+ * @brief Busy wait until condition() returns true or spin_time has passed.
+ * @return true if condition() returned true, false if spin_time passed
+ */
+template <typename Condition>
+inline bool spin_until(Condition condition, std::chrono::nanoseconds spin_time)
+{
+    auto deadline = current_rt_time() + spin_time;
+    for (int i = 1; ; ++i)
+    {
+        if (condition())
+        {
+            return true;
+        }
+        cpu_relax();
+        if (i % SPIN_ITERATIONS_PER_CLOCK_CHECK == 0 && current_rt_time() > deadline)
+        {
+            return false;
+        }
+    }
+}
+
+#ifdef TWINE_HAS_FUTEX
+/* Futex wrappers for the linux native synchronisation primitives. These are only
+ * used with ThreadType::PTHREAD, xenomai threads must use the cobalt primitives */
+
+static_assert(sizeof(std::atomic<int>) == sizeof(int) && std::atomic<int>::is_always_lock_free);
+
+/**
+ * @brief Block until word is woken by futex_wake(), returns immediately if word
+ *        does not contain expected_value. Spurious wakeups may occur.
+ */
+inline int futex_wait(std::atomic<int>* word, int expected_value)
+{
+    return syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAIT_PRIVATE, expected_value, nullptr, nullptr, 0);
+}
+
+/**
+ * @brief Wake up to waiters blocked on word in futex_wait()
+ */
+inline int futex_wake(std::atomic<int>* word, int waiters = INT_MAX)
+{
+    return syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAKE_PRIVATE, waiters, nullptr, nullptr, 0);
+}
+
+/**
+ * @brief Same as futex_wait(), but the waiter is only woken by calls to
+ *        futex_wake_bitset() with a bitset that has bits in common with wake_bits.
+ */
+inline int futex_wait_bitset(std::atomic<int>* word, int expected_value, uint32_t wake_bits)
+{
+    return syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAIT_BITSET_PRIVATE, expected_value,
+                   nullptr, nullptr, wake_bits);
+}
+
+/**
+ * @brief Same as futex_wait(), but returns with ETIMEDOUT in errno when deadline,
+ *        in the time of current_rt_time(), passes
+ */
+inline int futex_wait_until(std::atomic<int>* word, int expected_value, std::chrono::nanoseconds deadline)
+{
+    // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC time, unlike FUTEX_WAIT
+    auto absolute_time = to_timespec(deadline);
+    return syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAIT_BITSET_PRIVATE, expected_value,
+                   &absolute_time, nullptr, FUTEX_BITSET_MATCH_ANY);
+}
+
+/**
+ * @brief Wake up waiters blocked on word in futex_wait_bitset() that share at least
+ *        one bit with wake_bits.
+ */
+inline int futex_wake_bitset(std::atomic<int>* word, uint32_t wake_bits, int waiters = INT_MAX)
+{
+    return syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAKE_BITSET_PRIVATE, waiters,
+                   nullptr, nullptr, wake_bits);
+}
+#endif
+
+/**
+ * @brief Write to every page of the calling thread's stack below the current stack
+ *        frame, so that using it later doesn't cause page faults. The guard area at
+ *        the end of the stack is left untouched.
+ * @param max_size Prefault at most this many bytes below the current frame. The main
+ *                 thread's stack is reported as large as its rlimit, though only part
+ *                 of it can be mapped.
+ * @param stack_begin Set to the lowest address of the stack, excluding the guard area
+ * @param stack_size Set to the size of the stack, excluding the guard area
+ * @return 0 on success, an errno code if the stack could not be found
+ */
+inline int prefault_current_stack(size_t max_size, char*& stack_begin, size_t& stack_size)
+{
+    size_t guard_size = 0;
+#ifdef __APPLE__
+    pthread_t self = pthread_self();
+    stack_size = pthread_get_stacksize_np(self);
+    stack_begin = static_cast<char*>(pthread_get_stackaddr_np(self)) - stack_size;
+#else
+    pthread_attr_t attributes;
+    int res = pthread_getattr_np(pthread_self(), &attributes);
+    if (res != 0)
+    {
+        return res;
+    }
+    void* stack_address;
+    pthread_attr_getstack(&attributes, &stack_address, &stack_size);
+    pthread_attr_getguardsize(&attributes, &guard_size);
+    pthread_attr_destroy(&attributes);
+    stack_begin = static_cast<char*>(stack_address);
+#endif
+    // Older glibc versions include the guard area in the stack, skipping it either way
+    // leaves at most one unused page untouched
+    guard_size = std::min(guard_size, stack_size);
+    stack_begin += guard_size;
+    stack_size -= guard_size;
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    volatile char current_frame = 0;
+    char* frame = const_cast<char*>(&current_frame);
+    char* end = frame - stack_begin > static_cast<ptrdiff_t>(max_size) ? frame - max_size : stack_begin;
+    // The stack grows down, the memory below the current frame is unused
+    for (char* page = frame - page_size; page >= end; page -= page_size)
+    {
+        *reinterpret_cast<volatile char*>(page) = current_frame;
+    }
+    return 0;
+}
+
+/**
+ * @brief Prefault the calling thread's stack and lock it in memory, so that the thread
+ *        never takes page faults on its stack.
+ * @return 0 on success, an errno code otherwise, i.e. EPERM or ENOMEM if the memory
+ *         could not be locked
+ */
+inline int lock_and_prefault_current_stack()
+{
+    char* stack_begin;
+    size_t stack_size;
+    int res = prefault_current_stack(SIZE_MAX, stack_begin, stack_size);
+    if (res != 0)
+    {
+        return res;
+    }
+    if (mlock(stack_begin, stack_size) != 0)
+    {
+        return errno;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parameters for running a thread under SCHED_DEADLINE, the thread gets runtime
+ *        of cpu time every period, within deadline from the start of the period.
+ *        A runtime of 0 means SCHED_DEADLINE is not used.
+ */
+struct DeadlineParameters
+{
+    std::chrono::nanoseconds runtime{0};
+    std::chrono::nanoseconds deadline{0};
+    std::chrono::nanoseconds period{0};
+};
+
+#ifdef TWINE_HAS_SCHED_DEADLINE
+/* glibc has no sched_setattr() wrapper before 2.41, and newer versions define their
+ * own struct sched_attr, so the kernel's layout is declared here under another name */
+struct SchedAttributes
+{
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t  sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+};
+
+constexpr uint32_t SCHED_DEADLINE_POLICY = 6;
+
+/**
+ * @brief Switch the calling thread to SCHED_DEADLINE. Only for ThreadType::PTHREAD.
+ *        The affinity of the thread must include all cpus, or the kernel refuses.
+ * @return 0 on success, EBUSY if the kernel's admission control rejects the
+ *         parameters, EPERM if not permitted, other errno values on other errors
+ */
+inline int set_current_thread_deadline(const DeadlineParameters& parameters)
+{
+    SchedAttributes attributes = {};
+    attributes.size = sizeof(attributes);
+    attributes.sched_policy = SCHED_DEADLINE_POLICY;
+    attributes.sched_runtime = parameters.runtime.count();
+    attributes.sched_deadline = parameters.deadline.count();
+    attributes.sched_period = parameters.period.count();
+    if (syscall(SYS_sched_setattr, 0, &attributes, 0) != 0)
+    {
+        return errno;
+    }
+    return 0;
+}
+#endif
+
 } // namespace twine
 
 #endif //TWINE_THREAD_HELPERS_H
@@ -0,0 +1,153 @@
+/*
+ * Copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk
+ * Twine is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * Twine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Twine.
+ * If not, see http://www.gnu.org/licenses/ .
+ */
+
+/**
+ * @brief Recording of worker cycle timings
+ * @copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk, Stockholm
+ */
+
+#ifndef TWINE_TIMING_STATS_H
+#define TWINE_TIMING_STATS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+
+#include "twine/twine.h"
+
+namespace twine {
+
+// Must be a power of 2
+constexpr int TIMING_WINDOW_CYCLES = 256;
+
+/**
+ * @brief Lock-free ring of the wake offsets and callback durations of a worker's
+ *        last TIMING_WINDOW_CYCLES cycles. Written only by the worker, and can be read
+ *        from any thread while the worker runs.
+ */
+class TimingRecorder
+{
+public:
+    /**
+     * @brief Clear all recorded timings. Must not be called while the worker runs.
+     * @param budget Callbacks longer than this count as overruns, 0 to not count overruns
+     */
+    void reset(std::chrono::nanoseconds budget)
+    {
+        _budget = budget;
+        _cycles.store(0, std::memory_order_relaxed);
+        _overruns.store(0, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Record the timings of one cycle, must only be called from the worker
+     */
+    void record(std::chrono::nanoseconds wake_offset, std::chrono::nanoseconds duration)
+    {
+        // Single writer, so no read-modify-write operations needed
+        uint64_t cycles = _cycles.load(std::memory_order_relaxed);
+        auto& sample = _samples[cycles & (TIMING_WINDOW_CYCLES - 1)];
+        sample.wake_offset.store(wake_offset.count(), std::memory_order_relaxed);
+        sample.duration.store(duration.count(), std::memory_order_relaxed);
+        if (_budget.count() > 0 && duration > _budget)
+        {
+            _overruns.store(_overruns.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+        _cycles.store(cycles + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Compute statistics over the recorded window. Does not allocate or block,
+     *        but samples recorded during the call may be mixed into the result.
+     */
+    void snapshot(WorkerTimingStats& stats) const
+    {
+        stats = WorkerTimingStats();
+        uint64_t cycles = _cycles.load(std::memory_order_acquire);
+        int no_samples = static_cast<int>(std::min<uint64_t>(cycles, TIMING_WINDOW_CYCLES));
+        stats.cycles = cycles;
+        stats.overruns = _overruns.load(std::memory_order_relaxed);
+        if (no_samples == 0)
+        {
+            return;
+        }
+        std::array<int64_t, TIMING_WINDOW_CYCLES> wake_offsets;
+        std::array<int64_t, TIMING_WINDOW_CYCLES> durations;
+        for (int i = 0; i < no_samples; ++i)
+        {
+            const auto& sample = _samples[(cycles - 1 - i) & (TIMING_WINDOW_CYCLES - 1)];
+            wake_offsets[i] = sample.wake_offset.load(std::memory_order_relaxed);
+            durations[i] = sample.duration.load(std::memory_order_relaxed);
+            stats.duration_histogram[_histogram_bin(durations[i])]++;
+        }
+        stats.wake_offset = _summarize(wake_offsets, no_samples);
+        stats.duration = _summarize(durations, no_samples);
+    }
+
+private:
+    struct Sample
+    {
+        std::atomic<int64_t> wake_offset{0};
+        std::atomic<int64_t> duration{0};
+    };
+
+    static int _histogram_bin(int64_t duration_ns)
+    {
+        int64_t microseconds = duration_ns / 1000;
+        if (microseconds <= 0)
+        {
+            return 0;
+        }
+        int bin = 64 - __builtin_clzll(static_cast<uint64_t>(microseconds));
+        return std::min(bin, TIMING_HISTOGRAM_BINS - 1);
+    }
+
+    /**
+     * @brief Summarize the first no_samples values, reorders values
+     */
+    static TimingStats _summarize(std::array<int64_t, TIMING_WINDOW_CYCLES>& values, int no_samples)
+    {
+        TimingStats stats;
+        auto end = values.begin() + no_samples;
+        auto [min, max] = std::minmax_element(values.begin(), end);
+        stats.min = std::chrono::nanoseconds(*min);
+        stats.max = std::chrono::nanoseconds(*max);
+        int64_t sum = 0;
+        for (auto i = values.begin(); i != end; ++i)
+        {
+            sum += *i;
+        }
+        stats.mean = std::chrono::nanoseconds(sum / no_samples);
+        auto percentile = [&](int percent)
+        {
+            auto nth = values.begin() + (no_samples - 1) * percent / 100;
+            std::nth_element(values.begin(), nth, end);
+            return std::chrono::nanoseconds(*nth);
+        };
+        stats.p50 = percentile(50);
+        stats.p99 = percentile(99);
+        return stats;
+    }
+
+    std::array<Sample, TIMING_WINDOW_CYCLES> _samples;
+    std::atomic<uint64_t>                    _cycles{0};
+    std::atomic<uint64_t>                    _overruns{0};
+    std::chrono::nanoseconds                 _budget{0};
+};
+
+} // namespace twine
+
+#endif //TWINE_TIMING_STATS_H
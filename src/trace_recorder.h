@@ -0,0 +1,351 @@
+/*
+ * Copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk
+ * Twine is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * Twine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Twine.
+ * If not, see http://www.gnu.org/licenses/ .
+ */
+
+/**
+ * @brief Recording of worker pool cycle events for trace viewers
+ * @copyright 2018-2021 Modern Ancient Instruments Networked AB, dba Elk, Stockholm
+ */
+
+#ifndef TWINE_TRACE_RECORDER_H
+#define TWINE_TRACE_RECORDER_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "twine/twine.h"
+#include "twine_internal.h"
+
+namespace twine {
+
+constexpr int MAX_TRACED_THREADS = 64;
+
+enum class TraceEventType : uint8_t
+{
+    BARRIER_RELEASE,  // The thread controlling a pool released the workers
+    WORKER_WAKE,      // A worker returned from the barrier, arg is its index
+    CYCLE_START,      // A worker started its callback or share of the cycle
+    CYCLE_END,        // A worker finished its callback or share of the cycle
+    BARRIER_ARRIVE,   // A worker arrived at the barrier, arg is its index
+    ZONE_BEGIN,       // A user zone was entered
+    ZONE_END          // A user zone was left
+};
+
+struct TraceRecord
+{
+    int64_t        time;   // In the time of current_rt_time()
+    const char*    name;   // A string literal, or nullptr
+    int32_t        arg;
+    TraceEventType type;
+};
+
+/**
+ * @brief Ring of the events of one thread, where the oldest events are overwritten
+ *        when it is full. Written by a single thread, and can be read while it is written.
+ *        Every slot is a seqlock, its sequence is odd while the slot is being written and
+ *        otherwise tells which event the slot holds. The fields are relaxed atomics, so
+ *        reading a slot that is being written is well defined, and is then detected from
+ *        the sequence and the event left out.
+ */
+class TraceBuffer
+{
+public:
+    explicit TraceBuffer(int capacity) : _slots(capacity), _mask(capacity - 1) {}
+
+    void record(TraceEventType type, const char* name, int arg)
+    {
+        uint64_t written = _written.load(std::memory_order_relaxed);
+        auto& slot = _slots[written & _mask];
+        slot.sequence.store(2 * written + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.time.store(current_rt_time().count(), std::memory_order_relaxed);
+        slot.name.store(name, std::memory_order_relaxed);
+        slot.arg.store(arg, std::memory_order_relaxed);
+        slot.type.store(type, std::memory_order_relaxed);
+        slot.sequence.store(_completed_sequence(written), std::memory_order_release);
+        _written.store(written + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Copy the events in the buffer that were recorded after a point in time.
+     *        Events that were overwritten while copying are left out.
+     */
+    void snapshot(std::vector<TraceRecord>& records, int64_t since) const
+    {
+        uint64_t end = _written.load(std::memory_order_acquire);
+        uint64_t begin = end > _slots.size() ? end - _slots.size() : 0;
+        for (uint64_t i = begin; i < end; ++i)
+        {
+            const auto& slot = _slots[i & _mask];
+            uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence != _completed_sequence(i))
+            {
+                continue;
+            }
+            TraceRecord record{slot.time.load(std::memory_order_relaxed),
+                               slot.name.load(std::memory_order_relaxed),
+                               slot.arg.load(std::memory_order_relaxed),
+                               slot.type.load(std::memory_order_relaxed)};
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) == sequence && record.time >= since)
+            {
+                records.push_back(record);
+            }
+        }
+    }
+
+    std::atomic_bool in_use{false};
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t>       sequence{0};
+        std::atomic<int64_t>        time{0};
+        std::atomic<const char*>    name{nullptr};
+        std::atomic<int32_t>        arg{0};
+        std::atomic<TraceEventType> type{TraceEventType::ZONE_BEGIN};
+    };
+
+    static uint64_t _completed_sequence(uint64_t event)
+    {
+        return 2 * event + 2;
+    }
+
+    std::vector<Slot>        _slots;
+    uint64_t                 _mask;
+    std::atomic<uint64_t>    _written{0};
+};
+
+/**
+ * @brief Process wide recorder of worker pool events and user zones. Every thread
+ *        records to a buffer of its own, that it claims on its first event. Recording
+ *        an event doesn't lock, allocate or make system calls, and when tracing is
+ *        disabled the only cost is checking a flag.
+ */
+class TraceRecorder
+{
+public:
+    TWINE_DECLARE_NON_COPYABLE(TraceRecorder);
+
+    static bool enabled()
+    {
+        return _enabled.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Record an event from the calling thread, if tracing is enabled
+     */
+    static void trace(TraceEventType type, const char* name = nullptr, int arg = 0)
+    {
+        if (enabled())
+        {
+            instance()._record(type, name, arg);
+        }
+    }
+
+    static TraceRecorder& instance()
+    {
+        static TraceRecorder recorder;
+        return recorder;
+    }
+
+    /**
+     * @brief Start recording. The buffers are allocated the first time, later calls
+     *        keep the size of the first call. Events recorded before the call are not
+     *        exported. Not rt safe.
+     */
+    WorkerPoolStatus start(int events_per_thread)
+    {
+        if (events_per_thread <= 0 || events_per_thread > (1 << 24))
+        {
+            return WorkerPoolStatus::INVALID_ARGUMENTS;
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_buffers[0] == nullptr)
+        {
+            int capacity = 1;
+            while (capacity < events_per_thread)
+            {
+                capacity *= 2;
+            }
+            for (auto& buffer : _buffers)
+            {
+                buffer = std::make_unique<TraceBuffer>(capacity);
+            }
+            _buffers_created.store(true, std::memory_order_release);
+        }
+        _start_time = current_rt_time().count();
+        _enabled.store(true, std::memory_order_release);
+        return WorkerPoolStatus::OK;
+    }
+
+    void stop()
+    {
+        _enabled.store(false, std::memory_order_release);
+    }
+
+    /**
+     * @brief Write the recorded events as Chrome trace event format json, that can be
+     *        opened in Perfetto or chrome://tracing. Can be called while recording.
+     * @return WorkerPoolStatus::OK if the operation succeed, error status otherwise
+     */
+    WorkerPoolStatus write_json(FILE* file)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_buffers[0] == nullptr)
+        {
+            return WorkerPoolStatus::ERROR;
+        }
+        fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+        bool first = true;
+        std::vector<TraceRecord> records;
+        for (int thread = 0; thread < MAX_TRACED_THREADS; ++thread)
+        {
+            records.clear();
+            _buffers[thread]->snapshot(records, _start_time);
+            if (records.empty())
+            {
+                continue;
+            }
+            int worker = -1;
+            for (const auto& record : records)
+            {
+                if (record.type == TraceEventType::WORKER_WAKE)
+                {
+                    worker = record.arg;
+                }
+            }
+            _write_separator(file, first);
+            if (worker >= 0)
+            {
+                fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                              "\"args\":{\"name\":\"twine worker %d\"}}", thread, worker);
+            }
+            else
+            {
+                fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                              "\"args\":{\"name\":\"thread %d\"}}", thread, thread);
+            }
+            for (const auto& record : records)
+            {
+                _write_separator(file, first);
+                _write_event(file, record, thread);
+            }
+        }
+        fprintf(file, "\n]}\n");
+        return ferror(file) ? WorkerPoolStatus::ERROR : WorkerPoolStatus::OK;
+    }
+
+private:
+    /**
+     * @brief Releases the buffer of a thread when the thread exits
+     */
+    struct ThreadBufferHandle
+    {
+        TraceBuffer* buffer{nullptr};
+        bool         claimed{false};
+
+        ~ThreadBufferHandle()
+        {
+            if (buffer != nullptr)
+            {
+                buffer->in_use.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    TraceRecorder() = default;
+
+    void _record(TraceEventType type, const char* name, int arg)
+    {
+        thread_local ThreadBufferHandle handle;
+        if (handle.claimed == false)
+        {
+            if (_buffers_created.load(std::memory_order_acquire) == false)
+            {
+                return;
+            }
+            handle.claimed = true;
+            for (auto& buffer : _buffers)
+            {
+                if (buffer->in_use.exchange(true, std::memory_order_acquire) == false)
+                {
+                    handle.buffer = buffer.get();
+                    break;
+                }
+            }
+        }
+        if (handle.buffer != nullptr)
+        {
+            handle.buffer->record(type, name, arg);
+        }
+    }
+
+    static void _write_separator(FILE* file, bool& first)
+    {
+        if (first == false)
+        {
+            fprintf(file, ",\n");
+        }
+        first = false;
+    }
+
+    static void _write_event(FILE* file, const TraceRecord& record, int thread)
+    {
+        const char* name = "";
+        const char* phase = "i";
+        switch (record.type)
+        {
+            case TraceEventType::BARRIER_RELEASE: name = "release";                  break;
+            case TraceEventType::WORKER_WAKE:     name = "wake";                     break;
+            case TraceEventType::CYCLE_START:     name = record.name; phase = "B";   break;
+            case TraceEventType::CYCLE_END:       name = record.name; phase = "E";   break;
+            case TraceEventType::BARRIER_ARRIVE:  name = "arrive";                   break;
+            case TraceEventType::ZONE_BEGIN:      name = record.name; phase = "B";   break;
+            case TraceEventType::ZONE_END:        name = record.name; phase = "E";   break;
+        }
+        fprintf(file, "{\"name\":\"");
+        for (const char* c = name ? name : ""; *c != '\0'; ++c)
+        {
+            if (*c == '"' || *c == '\\')
+            {
+                fputc('\\', file);
+            }
+            if (static_cast<unsigned char>(*c) >= 0x20)
+            {
+                fputc(*c, file);
+            }
+        }
+        fprintf(file, "\",\"ph\":\"%s\",%s\"ts\":%lld.%03d,\"pid\":1,\"tid\":%d}", phase,
+                phase[0] == 'i' ? "\"s\":\"t\"," : "",
+                static_cast<long long>(record.time / 1000), static_cast<int>(record.time % 1000), thread);
+    }
+
+    static std::atomic_bool                                        _enabled;
+
+    std::mutex                                                     _mutex;
+    std::array<std::unique_ptr<TraceBuffer>, MAX_TRACED_THREADS>   _buffers;
+    std::atomic_bool                                               _buffers_created{false};
+    int64_t                                                        _start_time{0};
+};
+
+} // namespace twine
+
+#endif //TWINE_TRACE_RECORDER_H
@@ -31,7 +31,14 @@
 #else
     #include <cstdio>
     #include <cstdarg>
-    #define rt_vfprintf vfprintf
+#endif
+
+#include <cstdlib>
+#include <cerrno>
+#include <limits>
+#include <poll.h>
+#ifdef __linux__
+    #include <malloc.h>
 #endif
 
 #include "twine/twine.h"
@@ -39,12 +46,22 @@
 #include "twine_version.h"
 #include "worker_pool_implementation.h"
 #include "condition_variable_implementation.h"
+#include "condition_variable_hub.h"
+#include "block_pool.h"
+#include "rt_logger.h"
+#include "trace_recorder.h"
 
 namespace twine {
 
 constexpr int64_t NS_TO_S = 1'000'000'000;
 
 thread_local int ThreadRtFlag::_instance_counter = 0;
+thread_local ScratchArena* ScratchArena::_current = nullptr;
+std::atomic<uint64_t> BlockPoolImpl::_next_id{0};
+std::mutex BlockPoolImpl::_registry_mutex;
+std::vector<BlockPoolImpl*> BlockPoolImpl::_registry;
+thread_local BlockCacheTable BlockPoolImpl::_thread_caches;
+std::atomic_bool TraceRecorder::_enabled{false};
 bool XenomaiRtFlag::_enabled = false;
 static XenomaiRtFlag running_xenomai_realtime;
 
@@ -74,12 +91,67 @@ int rt_printf(const char *format, ...)
     int n;
 
     va_start(args, format);
+#ifdef TWINE_BUILD_WITH_XENOMAI
     n = rt_vfprintf(stdout, format, args);
+#else
+    n = RtLogger::instance().log(format, args);
+#endif
     va_end(args);
 
     return n;
 }
 
+void flush_rt_printf()
+{
+#ifndef TWINE_BUILD_WITH_XENOMAI
+    RtLogger::instance().flush();
+#endif
+}
+
+uint64_t rt_printf_dropped_messages()
+{
+#ifdef TWINE_BUILD_WITH_XENOMAI
+    return 0;
+#else
+    return RtLogger::instance().dropped_messages();
+#endif
+}
+
+WorkerPoolStatus start_tracing(int events_per_thread)
+{
+    return TraceRecorder::instance().start(events_per_thread);
+}
+
+void stop_tracing()
+{
+    TraceRecorder::instance().stop();
+}
+
+WorkerPoolStatus write_trace(const char* file_name)
+{
+    FILE* file = fopen(file_name, "w");
+    if (file == nullptr)
+    {
+        return errno_to_worker_status(errno);
+    }
+    auto status = TraceRecorder::instance().write_json(file);
+    if (fclose(file) != 0)
+    {
+        status = WorkerPoolStatus::ERROR;
+    }
+    return status;
+}
+
+void trace_zone_begin(const char* name)
+{
+    TraceRecorder::trace(TraceEventType::ZONE_BEGIN, name);
+}
+
+void trace_zone_end(const char* name)
+{
+    TraceRecorder::trace(TraceEventType::ZONE_END, name);
+}
+
 void init_xenomai()
 {
 #ifdef TWINE_BUILD_WITH_XENOMAI
@@ -115,6 +187,47 @@ void set_flush_denormals_to_zero()
     denormals_intrinsic();
 }
 
+WorkerPoolStatus lock_and_prefault_memory(size_t heap_size, size_t stack_size)
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+        return errno_to_worker_status(errno);
+    }
+#ifdef __GLIBC__
+    // Never trim the heap and serve large allocations from the heap instead of separate
+    // mappings, so that prefaulted memory is reused instead of returned to the system
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+#endif
+    if (heap_size > 0)
+    {
+        auto heap = static_cast<volatile char*>(std::malloc(heap_size));
+        if (heap == nullptr)
+        {
+            return WorkerPoolStatus::LIMIT_EXCEEDED;
+        }
+        long page_size = sysconf(_SC_PAGESIZE);
+        for (size_t i = 0; i < heap_size; i += page_size)
+        {
+            heap[i] = 0;
+        }
+        std::free(const_cast<char*>(heap));
+    }
+    char* stack_begin;
+    size_t total_stack_size;
+    return errno_to_worker_status(prefault_current_stack(stack_size, stack_begin, total_stack_size));
+}
+
+void* scratch_allocate(size_t size, size_t alignment)
+{
+    auto arena = ScratchArena::current();
+    if (arena == nullptr)
+    {
+        return nullptr;
+    }
+    return arena->allocate(size, alignment);
+}
+
 
 std::unique_ptr<RtConditionVariable> RtConditionVariable::create_rt_condition_variable()
 {
@@ -125,8 +238,80 @@ std::unique_ptr<RtConditionVariable> RtConditionVariable::create_rt_condition_va
         return std::make_unique<XenomaiConditionVariable>(id);
     }
 #endif
-
+#ifdef TWINE_HAS_FUTEX
+    return std::make_unique<FutexConditionVariable>();
+#else
     return std::make_unique<PosixConditionVariable>();
+#endif
+}
+
+uint64_t RtConditionVariable::wait_any(RtConditionVariable* const* cond_vars, int no_cond_vars,
+                                       std::optional<std::chrono::nanoseconds> deadline,
+                                       int* notifications)
+{
+    if (cond_vars == nullptr || no_cond_vars <= 0 || no_cond_vars > 64)
+    {
+        return 0;
+    }
+    std::vector<pollfd> poll_targets(no_cond_vars);
+    for (int i = 0; i < no_cond_vars; ++i)
+    {
+        poll_targets[i] = {.fd = cond_vars[i]->native_handle(), .events = POLLIN, .revents = 0};
+        if (poll_targets[i].fd < 0)
+        {
+            return 0;
+        }
+    }
+    while (true)
+    {
+        // A readable handle may be stale, so the notifications are always checked
+        uint64_t fired = 0;
+        for (int i = 0; i < no_cond_vars; ++i)
+        {
+            int count = cond_vars[i]->wait_until(std::chrono::nanoseconds(0));
+            if (count > 0)
+            {
+                fired |= uint64_t(1) << i;
+            }
+            if (notifications)
+            {
+                notifications[i] = count;
+            }
+        }
+        if (fired != 0)
+        {
+            return fired;
+        }
+        int timeout_ms = -1;
+        if (deadline.has_value())
+        {
+            auto time_left = deadline.value() - current_rt_time();
+            if (time_left.count() <= 0)
+            {
+                return 0;
+            }
+            // Rounded up, as returning before the deadline would be a busy wait
+            auto ms = std::chrono::ceil<std::chrono::milliseconds>(time_left).count();
+            timeout_ms = static_cast<int>(std::min<int64_t>(ms, std::numeric_limits<int>::max()));
+        }
+        if (poll(poll_targets.data(), poll_targets.size(), timeout_ms) < 0 && errno != EINTR)
+        {
+            return 0;
+        }
+    }
+}
+
+std::unique_ptr<ConditionVariableHub> ConditionVariableHub::create_condition_variable_hub(int max_channels)
+{
+    return std::make_unique<ConditionVariableHubImpl>(max_channels, RtConditionVariable::create_rt_condition_variable());
+}
+
+std::unique_ptr<BlockPool> BlockPool::create_block_pool(size_t block_size,
+                                                       int no_blocks,
+                                                       int low_watermark,
+                                                       RtConditionVariable* notifier)
+{
+    return std::make_unique<BlockPoolImpl>(block_size, no_blocks, low_watermark, notifier);
 }
 
 } // twine
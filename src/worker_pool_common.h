@@ -20,10 +20,16 @@
 #ifndef TWINE_WORKER_POOL_COMMON_H
 #define TWINE_WORKER_POOL_COMMON_H
 
+#include <cstddef>
+
+#include "twine/twine.h"
+
 namespace twine {
 
-constexpr int MAX_WORKERS_PER_POOL = 8;
-constexpr int N_CPU_CORES = 4;
+// One bit per worker in a WorkerMask
+constexpr int MAX_WORKERS_PER_POOL = 64;
+// Must be a power of 2
+constexpr int MAX_TASKS_PER_CYCLE = 1024;
 
 } // namespace twine
 
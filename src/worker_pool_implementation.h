@@ -27,12 +27,28 @@
 #include <cstring>
 #include <cerrno>
 #include <stdexcept>
+#include <type_traits>
+#include <thread>
 
 #include "thread_helpers.h"
+#include "futex_barrier.h"
+#include "job_graph.h"
+#include "task_scheduler.h"
+#include "parallel_range.h"
+#include "cpu_topology.h"
+#include "load_balancer.h"
+#include "timing_stats.h"
+#include "scratch_arena.h"
+#include "trace_recorder.h"
 #include "twine_internal.h"
 
 namespace twine {
 
+// How often a non-rt thread checks if a requested worker change has been applied
+constexpr auto CHANGE_POLL_INTERVAL = std::chrono::milliseconds(1);
+// How long a non-rt thread waits for a worker change to be applied
+constexpr auto CHANGE_TIMEOUT = std::chrono::seconds(1);
+
 void set_flush_denormals_to_zero();
 
 inline void enable_break_on_mode_sw()
@@ -48,6 +64,8 @@ inline WorkerPoolStatus errno_to_worker_status(int error)
             return WorkerPoolStatus::OK;
 
         case EAGAIN:
+        case EBUSY:
+        case ENOMEM:
             return WorkerPoolStatus::LIMIT_EXCEEDED;
 
         case EPERM:
@@ -62,7 +80,8 @@ inline WorkerPoolStatus errno_to_worker_status(int error)
 }
 
 /**
- * @brief Thread barrier that can be controlled from an external thread
+ * @brief Thread barrier that can be controlled from an external thread. Every thread
+ *        waits on its own semaphore, so that a subset of the threads can be released.
  */
 template <ThreadType type>
 class BarrierWithTrigger
@@ -74,24 +93,8 @@ public:
      */
     BarrierWithTrigger()
     {
-        if constexpr (type == ThreadType::XENOMAI)
-        {
-            _semaphores[0] = &_semaphore_store[0];
-            _semaphores[1] = &_semaphore_store[1];
-        }
         mutex_create<type>(&_calling_mutex, nullptr);
-        condition_var_create<type>(&_calling_cond, nullptr);
-        int res = semaphore_create<type>(&_semaphores[0], "twine_semaphore_0");
-        if (res != 0)
-        {
-            throw std::runtime_error(strerror(res));
-        }
-        res = semaphore_create<type>(&_semaphores[1], "twine_semaphore_1");
-        if (res != 0)
-        {
-            throw std::runtime_error(strerror(res));
-        }
-        _active_sem = _semaphores[0];
+        condition_var_create_monotonic<type>(&_calling_cond);
     }
 
     /**
@@ -101,25 +104,44 @@ public:
     {
         mutex_destroy<type>(&_calling_mutex);
         condition_var_destroy<type>(&_calling_cond);
-        semaphore_destroy<type>(_semaphores[0], "twine_semaphore_0");
-        semaphore_destroy<type>(_semaphores[1], "twine_semaphore_1");
+        for (int i = 0; i < _no_semaphores; ++i)
+        {
+            semaphore_destroy<type>(_semaphores[i]);
+        }
     }
 
     /**
      * @brief Wait for signal to finish, called from threads participating on the
      *        barrier
+     * @param index The index of the calling thread, in [0, no_threads)
+     */
+    void wait(int index)
+    {
+        wait(index, std::chrono::nanoseconds(0));
+    }
+
+    /**
+     * @brief Same as wait(), but busy waits for up to spin_time for the release
+     *        before blocking.
      */
-    void wait()
+    void wait(int index, std::chrono::nanoseconds spin_time)
     {
+        assert(index >= 0 && index < _no_semaphores);
+        auto semaphore = _semaphores[index];
         mutex_lock<type>(&_calling_mutex);
-        auto active_sem = _active_sem;
+        _waiting_threads |= WorkerMask(1) << index;
         if (++_no_threads_currently_on_barrier >= _no_threads)
         {
             condition_signal<type>(&_calling_cond);
         }
         mutex_unlock<type>(&_calling_mutex);
 
-        semaphore_wait<type>(active_sem);
+        if (spin_time.count() > 0 &&
+            spin_until([&]() {return semaphore_try_wait<type>(semaphore) == 0;}, spin_time))
+        {
+            return;
+        }
+        semaphore_wait<type>(semaphore);
     }
 
     /**
@@ -146,50 +168,132 @@ public:
     }
 
     /**
-     * @brief Change the number of threads for the barrier to handle.
-     * @param threads
+     * @brief Same as wait_for_all(), but returns when deadline passes
+     * @param deadline The latest time to return, in the time of current_rt_time()
+     * @return true if all threads are waiting on the barrier, false if the deadline passed
      */
-    void set_no_threads(int threads)
+    bool wait_for_all_until(std::chrono::nanoseconds deadline)
     {
         mutex_lock<type>(&_calling_mutex);
-        _no_threads = threads;
+        while (_no_threads_currently_on_barrier < _no_threads)
+        {
+            if (condition_timed_wait<type>(&_calling_cond, &_calling_mutex, deadline) == ETIMEDOUT)
+            {
+                break;
+            }
+        }
+        bool all_arrived = _no_threads_currently_on_barrier >= _no_threads;
         mutex_unlock<type>(&_calling_mutex);
+        return all_arrived;
     }
 
     /**
-     * @brief Release all threads waiting on the barrier.
+     * @return true if all threads are waiting on the barrier, i.e. if they can be released
      */
-    void release_all()
+    bool all_arrived() const
     {
-        mutex_lock<type>(&_calling_mutex);
+        return _no_threads_currently_on_barrier >= _no_threads;
+    }
 
-        assert(_no_threads_currently_on_barrier == _no_threads);
-        _no_threads_currently_on_barrier = 0;
+    /**
+     * @return Bitmask of the threads that have been released and not yet waited on
+     *         the barrier again
+     */
+    WorkerMask running_threads()
+    {
+        mutex_lock<type>(&_calling_mutex);
+        WorkerMask running = _threads & ~_waiting_threads;
+        mutex_unlock<type>(&_calling_mutex);
+        return running;
+    }
 
-        auto prev_sem = _active_sem;
-        _swap_semaphores();
+    /**
+     * @brief Change the number of threads for the barrier to handle.
+     * @param threads
+     * @return 0 on success, an errno code if a semaphore could not be created
+     */
+    int set_no_threads(int threads)
+    {
+        assert(threads <= MAX_WORKERS_PER_POOL);
+        return set_threads(threads < MAX_WORKERS_PER_POOL ? (WorkerMask(1) << threads) - 1 : ALL_WORKERS);
+    }
 
-        for (int i = 0; i < _no_threads; ++i)
+    /**
+     * @brief Change the set of threads for the barrier to handle. Semaphores for new
+     *        threads are created here, so this should not be called from an rt thread.
+     * @param threads Bitmask of the indexes of the threads participating on the barrier
+     * @return 0 on success, an errno code if a semaphore could not be created
+     */
+    int set_threads(WorkerMask threads)
+    {
+        int semaphores_needed = threads == 0 ? 0 : MAX_WORKERS_PER_POOL - __builtin_clzll(threads);
+        while (_no_semaphores < semaphores_needed)
         {
-            semaphore_signal<type>(prev_sem);
+            _semaphores[_no_semaphores] = &_semaphore_store[_no_semaphores];
+            int res = semaphore_create<type>(&_semaphores[_no_semaphores]);
+            if (res != 0)
+            {
+                return res;
+            }
+            _no_semaphores++;
         }
-
+        mutex_lock<type>(&_calling_mutex);
+        _threads = threads;
+        _no_threads = __builtin_popcountll(threads);
         mutex_unlock<type>(&_calling_mutex);
+        return 0;
     }
 
-    void release_and_wait()
+    /**
+     * @brief Remove a thread from the barrier and release it, without waiting for it
+     *        to arrive again. Like release(), must only be called when all threads
+     *        are waiting on the barrier, and the removed thread must not wait on the
+     *        barrier again after being released.
+     * @param index The index of the thread to remove
+     */
+    void remove_thread(int index)
     {
+        WorkerMask thread = WorkerMask(1) << index;
         mutex_lock<type>(&_calling_mutex);
+        assert(_threads & thread);
         assert(_no_threads_currently_on_barrier == _no_threads);
-        _no_threads_currently_on_barrier = 0;
+        _threads &= ~thread;
+        _waiting_threads &= ~thread;
+        _no_threads--;
+        _no_threads_currently_on_barrier--;
+        semaphore_signal<type>(_semaphores[index]);
+        mutex_unlock<type>(&_calling_mutex);
+    }
 
-        auto prev_sem = _active_sem;
-        _swap_semaphores();
+    /**
+     * @brief Release all threads waiting on the barrier.
+     */
+    void release_all()
+    {
+        release(ALL_WORKERS);
+    }
 
-        for (int i = 0; i < _no_threads; ++i)
-        {
-            semaphore_signal<type>(prev_sem);
-        }
+    /**
+     * @brief Release the threads selected by threads, the other threads stay
+     *        blocked on the barrier and are not woken up.
+     * @param threads Bitmask of thread indexes to release
+     */
+    void release(WorkerMask threads)
+    {
+        mutex_lock<type>(&_calling_mutex);
+        _release(threads);
+        mutex_unlock<type>(&_calling_mutex);
+    }
+
+    void release_and_wait()
+    {
+        release_and_wait(ALL_WORKERS);
+    }
+
+    void release_and_wait(WorkerMask threads)
+    {
+        mutex_lock<type>(&_calling_mutex);
+        _release(threads);
 
         int current_threads = _no_threads_currently_on_barrier;
 
@@ -202,27 +306,99 @@ public:
     }
 
 private:
-    void _swap_semaphores()
+    // Must be called with _calling_mutex held
+    void _release(WorkerMask threads)
     {
-        if (_active_sem == _semaphores[0])
-        {
-            _active_sem = _semaphores[1];
-        }
-        else
+        assert(_no_threads_currently_on_barrier == _no_threads);
+        threads &= _threads;
+        // Threads not released stay counted as waiting on the barrier
+        _no_threads_currently_on_barrier -= __builtin_popcountll(threads);
+        _waiting_threads &= ~threads;
+        while (threads != 0)
         {
-            _active_sem = _semaphores[0];
+            int index = __builtin_ctzll(threads);
+            threads &= threads - 1;
+            semaphore_signal<type>(_semaphores[index]);
         }
     }
 
-    std::array<sem_t, 2 > _semaphore_store;
-    std::array<sem_t*, 2> _semaphores;
-    sem_t* _active_sem;
+    std::array<sem_t, MAX_WORKERS_PER_POOL> _semaphore_store;
+    std::array<sem_t*, MAX_WORKERS_PER_POOL> _semaphores;
+    int _no_semaphores{0};
 
     pthread_mutex_t _calling_mutex;
     pthread_cond_t  _calling_cond;
 
     std::atomic<int> _no_threads_currently_on_barrier{0};
     std::atomic<int> _no_threads{0};
+    WorkerMask       _threads{0};
+    WorkerMask       _waiting_threads{0};
+};
+
+/**
+ * @brief Barrier used by the WorkerPool. Native linux threads use the lock-free futex
+ *        barrier, other thread types fall back to the semaphore based implementation.
+ */
+#ifdef TWINE_HAS_FUTEX
+template <ThreadType type>
+using PoolBarrier = std::conditional_t<type == ThreadType::PTHREAD, FutexBarrier, BarrierWithTrigger<type>>;
+#else
+template <ThreadType type>
+using PoolBarrier = BarrierWithTrigger<type>;
+#endif
+
+/**
+ * @brief What the workers do when released from the barrier
+ */
+enum class CycleType
+{
+    WORKER_CALLBACKS,
+    JOB_GRAPH,
+    TASKS,
+    PARALLEL_RANGE
+};
+
+// Names of the cycle types in traces, in the order of CycleType
+constexpr std::array<const char*, 4> CYCLE_NAMES = {"callback", "job graph", "tasks", "parallel_for"};
+
+/**
+ * @brief State shared between a WorkerPool and its workers. Members that are not
+ *        atomic are only written by the thread controlling the pool while all
+ *        workers are waiting on the barrier.
+ */
+template <ThreadType type>
+struct WorkerPoolState
+{
+    PoolBarrier<type>                     barrier;
+    std::atomic_bool                      running{true};
+    std::atomic<std::chrono::nanoseconds> spin_time{std::chrono::nanoseconds(0)};
+    bool                                  measure_timing{false};
+    std::chrono::nanoseconds              cycle_start{0};
+    CycleType                             cycle_type{CycleType::WORKER_CALLBACKS};
+    JobGraph                              job_graph;
+    TaskScheduler                         task_scheduler;
+    ParallelRange                         parallel_range;
+};
+
+/**
+ * @brief A change to a worker requested by a non-rt thread, that is applied by the
+ *        thread controlling the pool at the start of the next cycle
+ */
+enum class WorkerChange
+{
+    NONE,
+    REPLACE_CALLBACK,
+    REMOVE
+};
+
+/**
+ * @brief Stack settings of new workers
+ */
+struct WorkerStackSettings
+{
+    size_t                size{0};        // 0 for the system default
+    std::optional<size_t> guard_size;     // Empty for the system default
+    bool                  lock_and_prefault{false};
 };
 
 template <ThreadType type>
@@ -231,26 +407,203 @@ class WorkerThread
 public:
     TWINE_DECLARE_NON_COPYABLE(WorkerThread);
 
-    WorkerThread(BarrierWithTrigger<type>& barrier, WorkerCallback callback,
-                                         void*callback_data, std::atomic_bool& running_flag,
+    WorkerThread(WorkerPoolState<type>& pool_state, int index, WorkerCallback callback,
+                                         void*callback_data,
                                          bool disable_denormals,
-                                         bool break_on_mode_sw): _barrier(barrier),
+                                         bool break_on_mode_sw): _pool_state(pool_state),
+                                                                  _barrier(pool_state.barrier),
+                                                                  _index(index),
+                                                                  _rank(index),
                                                                   _callback(callback),
                                                                   _callback_data(callback_data),
-                                                                  _running(running_flag),
                                                                   _disable_denormals(disable_denormals),
                                                                   _break_on_mode_sw(break_on_mode_sw)
 
     {}
 
     ~WorkerThread()
+    {
+        join();
+    }
+
+    /**
+     * @brief Block until the worker thread has exited
+     */
+    void join()
     {
         if (_thread_handle != 0)
         {
             thread_join<type>(_thread_handle, nullptr);
+            _thread_handle = 0;
         }
     }
 
+    int cpu_id() const
+    {
+        return _cpu_id;
+    }
+
+    /**
+     * @return The total callback time over the last LOAD_WINDOW_CYCLES cycles. Must
+     *         only be called while the worker is waiting on the barrier.
+     */
+    std::chrono::nanoseconds load() const
+    {
+        return _load.total();
+    }
+
+    const TimingRecorder& timing() const
+    {
+        return _timing;
+    }
+
+    /**
+     * @brief Clear the recorded timings, must only be called while the worker is
+     *        waiting on the barrier
+     */
+    void reset_timing(std::chrono::nanoseconds budget)
+    {
+        _timing.reset(budget);
+    }
+
+    /**
+     * @brief Run the worker under SCHED_DEADLINE instead of SCHED_FIFO, must be called
+     *        before run(). The worker is not pinned to a cpu and cpu_id() returns -1.
+     */
+    void set_deadline(const DeadlineParameters& deadline)
+    {
+        _deadline = deadline;
+    }
+
+    /**
+     * @brief Set the stack of the worker thread, must be called before run()
+     */
+    void set_stack(const WorkerStackSettings& stack)
+    {
+        _stack = stack;
+    }
+
+    /**
+     * @brief Give the worker a scratch arena of the given size, 0 for none. The worker
+     *        allocates it itself when started, must be called before run().
+     */
+    void set_scratch_arena(size_t size, bool huge_pages)
+    {
+        _scratch_size = size;
+        _scratch_huge_pages = huge_pages;
+    }
+
+    /**
+     * @return 0 if the worker thread was set up as requested, with its scheduling class,
+     *         a locked stack and a scratch arena, an errno value otherwise, in which case it exits when
+     *         released. Must only be called after the worker has waited on the barrier.
+     */
+    int start_status() const
+    {
+        return _start_status;
+    }
+
+    /**
+     * @brief Mark the worker as placed on a cpu by the user, so it is never moved
+     */
+    void set_pinned(bool pinned)
+    {
+        _pinned = pinned;
+    }
+
+    bool pinned() const
+    {
+        return _pinned;
+    }
+
+    /**
+     * @brief Set the group of workers sharing data that the worker belongs to
+     */
+    void set_cache_group(std::optional<int> cache_group)
+    {
+        _cache_group = cache_group;
+    }
+
+    std::optional<int> cache_group() const
+    {
+        return _cache_group;
+    }
+
+#ifndef __APPLE__
+    /**
+     * @brief Move the worker to another cpu, so that the worker itself doesn't have to
+     *        when it is released. Must only be called while the worker is waiting on the
+     *        barrier.
+     * @param cpus A cpu set of cpus_size bytes to use, allocated up front so that no
+     *             memory is allocated here
+     * @return true if the worker was moved, on failure it stays where it is, which is harmless
+     */
+    bool migrate(int cpu_id, cpu_set_t* cpus, size_t cpus_size)
+    {
+        CPU_ZERO_S(cpus_size, cpus);
+        CPU_SET_S(cpu_id, cpus_size, cpus);
+        if (pthread_setaffinity_np(_thread_handle, cpus_size, cpus) != 0)
+        {
+            return false;
+        }
+        _cpu_id = cpu_id;
+        return true;
+    }
+#endif
+
+    /**
+     * @brief Set the index of the worker among the currently running workers, used to
+     *        divide tasks and ranges between them. Must only be called while the worker
+     *        is waiting on the barrier.
+     */
+    void set_rank(int rank)
+    {
+        _rank = rank;
+    }
+
+    /**
+     * @brief Request a change to the worker, called from a non-rt thread. The change
+     *        is not applied until apply_change() is called.
+     */
+    void request_change(WorkerChange change, WorkerCallback callback = nullptr, void* callback_data = nullptr)
+    {
+        _new_callback = callback;
+        _new_callback_data = callback_data;
+        _requested_change.store(change, std::memory_order_release);
+    }
+
+    /**
+     * @brief Apply a requested change, must only be called from the thread controlling
+     *        the pool while the worker is waiting on the barrier.
+     * @return The change that was applied
+     */
+    WorkerChange apply_change()
+    {
+        auto change = _requested_change.load(std::memory_order_acquire);
+        switch (change)
+        {
+            case WorkerChange::NONE:
+                break;
+
+            case WorkerChange::REPLACE_CALLBACK:
+                _callback = _new_callback;
+                _callback_data = _new_callback_data;
+                _requested_change.store(WorkerChange::NONE, std::memory_order_release);
+                break;
+
+            case WorkerChange::REMOVE:
+                // Exit the next time the worker is released, acknowledged by the thread exiting
+                _removed = true;
+                break;
+        }
+        return change;
+    }
+
+    bool change_pending() const
+    {
+        return _requested_change.load(std::memory_order_acquire) != WorkerChange::NONE;
+    }
+
     int run(int sched_priority, [[maybe_unused]] int cpu_id)
     {
         if ( (sched_priority < 0) || (sched_priority > 100) )
@@ -258,6 +611,8 @@ public:
             return EINVAL;
         }
         _priority = sched_priority;
+        bool uses_deadline = _deadline.runtime.count() > 0;
+        _cpu_id = uses_deadline ? -1 : cpu_id;
         struct sched_param rt_params = {.sched_priority = sched_priority};
         pthread_attr_t task_attributes;
         pthread_attr_init(&task_attributes);
@@ -267,15 +622,34 @@ public:
         pthread_attr_setschedpolicy(&task_attributes, SCHED_FIFO);
         pthread_attr_setschedparam(&task_attributes, &rt_params);
         auto res = 0;
+        if (_stack.size > 0)
+        {
+            res = pthread_attr_setstacksize(&task_attributes, _stack.size);
+        }
+        if (res == 0 && _stack.guard_size.has_value())
+        {
+            res = pthread_attr_setguardsize(&task_attributes, _stack.guard_size.value());
+        }
 #ifndef __APPLE__
-        cpu_set_t cpus;
-        CPU_ZERO(&cpus);
-        CPU_SET(cpu_id, &cpus);
-        res = pthread_attr_setaffinity_np(&task_attributes, sizeof(cpu_set_t), &cpus);
+        // Dynamically sized to support any number of cpus
+        if (res == 0 && uses_deadline == false)
+        {
+            cpu_set_t* cpus = CPU_ALLOC(cpu_id + 1);
+            size_t cpus_size = CPU_ALLOC_SIZE(cpu_id + 1);
+            CPU_ZERO_S(cpus_size, cpus);
+            CPU_SET_S(cpu_id, cpus_size, cpus);
+            res = pthread_attr_setaffinity_np(&task_attributes, cpus_size, cpus);
+            CPU_FREE(cpus);
+        }
 #endif
         if (res == 0)
         {
             res = thread_create<type>(&_thread_handle, &task_attributes, &_worker_function, this);
+            if (res != 0)
+            {
+                // The handle is undefined if creation failed, don't join it on destruction
+                _thread_handle = 0;
+            }
         }
         pthread_attr_destroy(&task_attributes);
         return res;
@@ -300,27 +674,115 @@ private:
         {
             enable_break_on_mode_sw();
         }
+        // If the thread can't be set up, it exits when released
+#ifdef TWINE_HAS_SCHED_DEADLINE
+        if (_deadline.runtime.count() > 0)
+        {
+            // The thread starts as SCHED_FIFO and switches itself
+            _start_status = set_current_thread_deadline(_deadline);
+        }
+#endif
+        if (_start_status == 0 && _stack.lock_and_prefault)
+        {
+            _start_status = lock_and_prefault_current_stack();
+        }
+        if (_start_status == 0 && _scratch_size > 0)
+        {
+            // Allocated here so that its pages are first touched from the worker's cpu
+            _start_status = _scratch_arena.init(_scratch_size, _scratch_huge_pages);
+            ScratchArena::set_current(&_scratch_arena);
+        }
+        _removed = _start_status != 0;
 
         while (true)
         {
-            _barrier.wait();
-            if (_running.load() == false)
+            _wait_for_next_cycle();
+            if (_pool_state.running.load() == false || _removed)
             {
                 // condition checked when coming out of wait as we might want to exit immediately here
                 break;
             }
-            _callback(_callback_data);
+            TraceRecorder::trace(TraceEventType::WORKER_WAKE, nullptr, _index);
+            const char* cycle_name = CYCLE_NAMES[static_cast<int>(_pool_state.cycle_type)];
+            TraceRecorder::trace(TraceEventType::CYCLE_START, cycle_name);
+            switch (_pool_state.cycle_type)
+            {
+                case CycleType::WORKER_CALLBACKS:
+                    if (_pool_state.measure_timing)
+                    {
+                        auto start_time = current_rt_time();
+                        _callback(_callback_data);
+                        auto duration = current_rt_time() - start_time;
+                        _load.add(duration);
+                        _timing.record(start_time - _pool_state.cycle_start, duration);
+                    }
+                    else
+                    {
+                        _callback(_callback_data);
+                    }
+                    break;
+
+                case CycleType::JOB_GRAPH:
+                    _pool_state.job_graph.template run_jobs<type>(_deadline.runtime.count() == 0);
+                    break;
+
+                case CycleType::TASKS:
+                    _pool_state.task_scheduler.run_tasks(_rank);
+                    break;
+
+                case CycleType::PARALLEL_RANGE:
+                    _pool_state.parallel_range.run(_rank);
+                    break;
+            }
+            TraceRecorder::trace(TraceEventType::CYCLE_END, cycle_name);
+            _scratch_arena.reset();
+            TraceRecorder::trace(TraceEventType::BARRIER_ARRIVE, nullptr, _index);
         }
     }
 
-    BarrierWithTrigger<type>&   _barrier;
+    void _wait_for_next_cycle()
+    {
+        auto spin_time = _pool_state.spin_time.load(std::memory_order_relaxed);
+        if (spin_time.count() == 0)
+        {
+            _barrier.wait(_index);
+            return;
+        }
+        // Only spin if the last cycle started within the spin window. This way workers
+        // park directly when the pool is not woken up periodically anymore, and resume
+        // spinning when it is again.
+        auto arrival_time = current_rt_time();
+        _barrier.wait(_index, _last_idle_time <= spin_time ? spin_time : std::chrono::nanoseconds(0));
+        _last_idle_time = current_rt_time() - arrival_time;
+    }
+
+    WorkerPoolState<type>&      _pool_state;
+    PoolBarrier<type>&          _barrier;
+    int                         _index;
+    int                         _rank;
     pthread_t                   _thread_handle{0};
     WorkerCallback              _callback;
     void*                       _callback_data;
-    const std::atomic_bool&     _running;
+    std::chrono::nanoseconds    _last_idle_time{0};
     bool                        _disable_denormals;
     int                         _priority {0};
+    int                         _cpu_id {0};
     bool                        _break_on_mode_sw;
+    bool                        _removed{false};
+    bool                        _pinned{false};
+    std::optional<int>          _cache_group;
+    LoadWindow                  _load;
+    TimingRecorder              _timing;
+    DeadlineParameters          _deadline;
+    WorkerStackSettings         _stack;
+    ScratchArena                _scratch_arena;
+    size_t                      _scratch_size{0};
+    bool                        _scratch_huge_pages{false};
+    int                         _start_status{0};
+
+    std::atomic<WorkerChange>   _requested_change{WorkerChange::NONE};
+    WorkerCallback              _new_callback{nullptr};
+    void*                       _new_callback_data{nullptr};
 };
 
 template <ThreadType type>
@@ -333,24 +795,46 @@ public:
                             bool disable_denormals,
                             bool break_on_mode_sw) : _no_cores(cores),
                                                      _cores_usage(cores, 0),
+                                                     _topology(CpuTopology::read(SYSFS_CPU_ROOT, cores)),
+                                                     _load_balancer(_topology, cores),
                                                      _disable_denormals(disable_denormals),
                                                      _break_on_mode_sw(break_on_mode_sw)
-    {}
+    {
+        // Never reallocated, so that it can be read while workers are removed
+        _workers.reserve(MAX_WORKERS_PER_POOL);
+#ifndef __APPLE__
+        _migration_cpus = CPU_ALLOC(cores);
+        _migration_cpus_size = CPU_ALLOC_SIZE(cores);
+#endif
+    }
 
     ~WorkerPoolImpl()
     {
-        _barrier.wait_for_all();
-        _running.store(false);
-        _barrier.release_all();
+        _state.barrier.wait_for_all();
+        _state.running.store(false);
+        _state.barrier.release_all();
+#ifndef __APPLE__
+        CPU_FREE(_migration_cpus);
+#endif
     }
 
     WorkerPoolStatus add_worker(WorkerCallback worker_cb, void* worker_data,
                                 int sched_priority=75,
-                                std::optional<int> cpu_id=std::nullopt) override
+                                std::optional<int> cpu_id=std::nullopt,
+                                std::optional<int> cache_group=std::nullopt) override
     {
+        if (_no_workers >= MAX_WORKERS_PER_POOL)
+        {
+            return WorkerPoolStatus::LIMIT_EXCEEDED;
+        }
         int core = 0;
         if (cpu_id.has_value())
         {
+            if (_deadline.runtime.count() > 0)
+            {
+                // Deadline workers must be allowed to run on all cpus
+                return WorkerPoolStatus::INVALID_ARGUMENTS;
+            }
             core = cpu_id.value();
             if ( (core < 0) || (core >= _no_cores) )
             {
@@ -359,7 +843,20 @@ public:
         }
         else
         {
-            // If no core is specified, pick the first core with least usage
+            std::vector<int> group_cpus;
+            for (WorkerMask workers = _active_workers; workers != 0 && cache_group.has_value(); workers &= workers - 1)
+            {
+                const auto& worker = _workers[__builtin_ctzll(workers)];
+                if (worker->cache_group() == cache_group && worker->cpu_id() >= 0)
+                {
+                    group_cpus.push_back(worker->cpu_id());
+                }
+            }
+            core = pick_worker_cpu(_topology, _cores_usage, group_cpus);
+        }
+        if (core < 0)
+        {
+            // If the topology is not known, pick the first core with least usage
             int min_idx = _no_cores - 1;
             int min_usage = _cores_usage[min_idx];
             for (int n = _no_cores-1; n >= 0; n--)
@@ -374,51 +871,585 @@ public:
             core = min_idx;
         }
 
-        auto worker = std::make_unique<WorkerThread<type>>(_barrier, worker_cb, worker_data, _running,
-                                                           _disable_denormals, _break_on_mode_sw);
-        _barrier.set_no_threads(_no_workers + 1);
+        // Reuse the id of a removed worker if there is one
+        int id = 0;
+        while (id < static_cast<int>(_workers.size()) && _workers[id] != nullptr)
+        {
+            id++;
+        }
+        WorkerMask worker_bit = WorkerMask(1) << id;
 
-        _cores_usage[core]++;
+        auto worker = std::make_unique<WorkerThread<type>>(_state, id, worker_cb, worker_data,
+                                                           _disable_denormals, _break_on_mode_sw);
+        worker->set_rank(_no_workers);
+        worker->set_pinned(cpu_id.has_value());
+        worker->set_cache_group(cache_group);
+        worker->set_deadline(_deadline);
+        worker->set_stack(_stack);
+        worker->set_scratch_arena(_scratch_size, _scratch_huge_pages);
+        worker->reset_timing(_timing_budget);
+        auto barrier_res = _state.barrier.set_threads(_active_workers | worker_bit);
+        if (barrier_res != 0)
+        {
+            return errno_to_worker_status(barrier_res);
+        }
+        _state.task_scheduler.set_no_workers(_no_workers + 1);
 
         auto res = errno_to_worker_status(worker->run(sched_priority, core));
         if (res == WorkerPoolStatus::OK)
         {
             // Wait until the thread is idle to avoid synchronisation issues
+            _state.barrier.wait_for_all();
+            res = errno_to_worker_status(worker->start_status());
+            if (res != WorkerPoolStatus::OK)
+            {
+                // The worker exits directly when released
+                _state.barrier.remove_thread(id);
+                worker->join();
+            }
+        }
+        if (res == WorkerPoolStatus::OK)
+        {
+            if (worker->cpu_id() >= 0)
+            {
+                _cores_usage[worker->cpu_id()]++;
+            }
             _no_workers++;
-            _workers.push_back(std::move(worker));
-            _barrier.wait_for_all();
+            _active_workers |= worker_bit;
+            if (id == static_cast<int>(_workers.size()))
+            {
+                _workers.push_back(std::move(worker));
+            }
+            else
+            {
+                _workers[id] = std::move(worker);
+            }
         }
         else
         {
-            _barrier.set_no_threads(_no_workers);
+            _state.barrier.set_threads(_active_workers);
+            _state.task_scheduler.set_no_workers(_no_workers);
         }
         return res;
     }
 
+    WorkerPoolStatus remove_worker(int worker_id) override
+    {
+        if (_valid_worker_id(worker_id) == false)
+        {
+            return WorkerPoolStatus::INVALID_ARGUMENTS;
+        }
+        auto res = _change_worker(worker_id, WorkerChange::REMOVE);
+        if (res != WorkerPoolStatus::OK)
+        {
+            return res;
+        }
+        // The worker was released for the last time when the change was applied
+        _workers[worker_id]->join();
+        _workers[worker_id].reset();
+        return WorkerPoolStatus::OK;
+    }
+
+    WorkerPoolStatus replace_callback(int worker_id, WorkerCallback worker_cb, void* worker_data) override
+    {
+        if (_valid_worker_id(worker_id) == false || worker_cb == nullptr)
+        {
+            return WorkerPoolStatus::INVALID_ARGUMENTS;
+        }
+        return _change_worker(worker_id, WorkerChange::REPLACE_CALLBACK, worker_cb, worker_data);
+    }
+
     void wait_for_workers_idle() override
     {
-        _barrier.wait_for_all();
+        _state.barrier.wait_for_all();
+    }
+
+    WorkerMask wait_for_workers_idle_until(std::chrono::nanoseconds deadline) override
+    {
+        if (_state.barrier.wait_for_all_until(deadline))
+        {
+            return 0;
+        }
+        return _state.barrier.running_threads();
     }
 
     void wakeup_workers() override
     {
-        _barrier.release_all();
+        wakeup_workers(ALL_WORKERS);
+    }
+
+    void wakeup_workers(WorkerMask workers) override
+    {
+        _prepare_cycle();
+        _state.barrier.release(workers);
+    }
+
+    WorkerPoolStatus try_wakeup(WorkerMask workers = ALL_WORKERS) override
+    {
+        if (_state.barrier.all_arrived() == false)
+        {
+            return WorkerPoolStatus::BUSY;
+        }
+        wakeup_workers(workers);
+        return WorkerPoolStatus::OK;
     }
 
     void wakeup_and_wait() override
     {
-        _barrier.release_and_wait();
+        wakeup_and_wait(ALL_WORKERS);
+    }
+
+    void wakeup_and_wait(WorkerMask workers) override
+    {
+        _prepare_cycle();
+        if (_caller_participates)
+        {
+            _state.barrier.release(workers);
+            if (_caller_callback)
+            {
+                _caller_callback(_caller_data);
+            }
+            _state.barrier.wait_for_all();
+        }
+        else
+        {
+            _state.barrier.release_and_wait(workers);
+        }
+    }
+
+    std::pair<WorkerPoolStatus, WorkerMask> wakeup_and_wait_until(std::chrono::nanoseconds deadline,
+                                                                 WorkerMask workers = ALL_WORKERS) override
+    {
+        if (_state.barrier.all_arrived() == false)
+        {
+            return {WorkerPoolStatus::BUSY, _state.barrier.running_threads()};
+        }
+        _prepare_cycle();
+        _state.barrier.release(workers);
+        if (_caller_participates && _caller_callback)
+        {
+            _caller_callback(_caller_data);
+        }
+        return {WorkerPoolStatus::OK, wait_for_workers_idle_until(deadline)};
+    }
+
+    std::pair<WorkerPoolStatus, int> add_graph_job(WorkerCallback job_cb, void* job_data,
+                                                   const std::vector<int>& dependencies = {}) override
+    {
+        return _state.job_graph.add_job(job_cb, job_data, dependencies);
+    }
+
+    void clear_graph() override
+    {
+        _state.job_graph.clear();
+    }
+
+    WorkerPoolStatus run_graph() override
+    {
+        _apply_pending_changes();
+        if (_state.job_graph.empty())
+        {
+            return WorkerPoolStatus::OK;
+        }
+        if (_no_participants() == 0)
+        {
+            return WorkerPoolStatus::ERROR;
+        }
+        _state.job_graph.prepare_run();
+        _run_cycle(CycleType::JOB_GRAPH);
+        return WorkerPoolStatus::OK;
+    }
+
+    WorkerPoolStatus submit_task(WorkerCallback task_cb, void* task_data) override
+    {
+        return _state.task_scheduler.submit(task_cb, task_data);
+    }
+
+    WorkerPoolStatus run_tasks() override
+    {
+        _apply_pending_changes();
+        if (_state.task_scheduler.no_tasks() == 0)
+        {
+            return WorkerPoolStatus::OK;
+        }
+        if (_state.task_scheduler.distribute() == false)
+        {
+            // All workers were removed after the tasks were submitted
+            _state.task_scheduler.clear();
+            return WorkerPoolStatus::ERROR;
+        }
+        _run_cycle(CycleType::TASKS);
+        _state.task_scheduler.clear();
+        return WorkerPoolStatus::OK;
+    }
+
+    WorkerPoolStatus run_parallel_for(int begin, int end, int grain, RangeCallback callback, void* data,
+                                      ChunkScheduling scheduling) override
+    {
+        if (begin > end || grain <= 0 || callback == nullptr)
+        {
+            return WorkerPoolStatus::INVALID_ARGUMENTS;
+        }
+        _apply_pending_changes();
+        if (_no_participants() == 0)
+        {
+            return WorkerPoolStatus::ERROR;
+        }
+        if (begin < end)
+        {
+            _state.parallel_range.set(begin, end, grain, callback, data, scheduling, _no_participants());
+            _run_cycle(CycleType::PARALLEL_RANGE);
+        }
+        return WorkerPoolStatus::OK;
+    }
+
+    WorkerPoolStatus set_spin_time(std::chrono::nanoseconds spin_time) override
+    {
+        if (spin_time.count() < 0)
+        {
+            return WorkerPoolStatus::INVALID_ARGUMENTS;
+        }
+        _state.spin_time.store(spin_time, std::memory_order_relaxed);
+        return WorkerPoolStatus::OK;
+    }
+
+    WorkerPoolStatus set_caller_participation(bool enabled, WorkerCallback caller_cb = nullptr,
+                                              void* caller_data = nullptr) override
+    {
+        _caller_participates = enabled;
+        _caller_callback = enabled ? caller_cb : nullptr;
+        _caller_data = caller_data;
+        _state.task_scheduler.set_caller_participation(enabled);
+        return WorkerPoolStatus::OK;
+    }
+
+    WorkerPoolStatus set_load_balancing(bool enabled) override
+    {
+#ifdef __APPLE__
+        return WorkerPoolStatus::ERROR;
+#else
+        // Changing the affinity of a xenomai thread would make it switch to secondary mode
+        if (type == ThreadType::XENOMAI)
+        {
+            return WorkerPoolStatus::ERROR;
+        }
+        _load_balancing = enabled;
+        _state.measure_timing = _load_balancing || _timing_stats;
+        _cycles_since_balancing = 0;
+        return WorkerPoolStatus::OK;
+#endif
+    }
+
+    WorkerPoolStatus set_worker_stack(size_t stack_size, size_t guard_size, bool lock_and_prefault) override
+    {
+        if (stack_size > 0 && stack_size < static_cast<size_t>(PTHREAD_STACK_MIN))
+        {
+            return WorkerPoolStatus::INVALID_ARGUMENTS;
+        }
+        _stack = {stack_size, guard_size, lock_and_prefault};
+        return WorkerPoolStatus::OK;
+    }
+
+    WorkerPoolStatus set_scratch_arena(size_t size, bool huge_pages = false) override
+    {
+        _scratch_size = size;
+        _scratch_huge_pages = huge_pages;
+        return WorkerPoolStatus::OK;
+    }
+
+    WorkerPoolStatus set_timing_stats(bool enabled, std::chrono::nanoseconds budget = std::chrono::nanoseconds(0)) override
+    {
+        if (budget.count() < 0)
+        {
+            return WorkerPoolStatus::INVALID_ARGUMENTS;
+        }
+        _timing_stats = enabled;
+        _timing_budget = budget;
+        _state.measure_timing = _load_balancing || _timing_stats;
+        if (enabled)
+        {
+            for (auto& worker : _workers)
+            {
+                if (worker)
+                {
+                    worker->reset_timing(budget);
+                }
+            }
+        }
+        return WorkerPoolStatus::OK;
+    }
+
+    WorkerPoolStatus get_timing_stats(int worker_id, WorkerTimingStats& stats) const override
+    {
+        if (worker_id < 0 || worker_id >= static_cast<int>(_workers.size()) || _workers[worker_id] == nullptr)
+        {
+            return WorkerPoolStatus::INVALID_ARGUMENTS;
+        }
+        _workers[worker_id]->timing().snapshot(stats);
+        return WorkerPoolStatus::OK;
+    }
+
+    WorkerPoolStatus set_deadline_scheduling(std::chrono::nanoseconds runtime,
+                                             std::chrono::nanoseconds deadline,
+                                             std::chrono::nanoseconds period) override
+    {
+        if (runtime.count() == 0)
+        {
+            _deadline = DeadlineParameters();
+            return WorkerPoolStatus::OK;
+        }
+        if (runtime.count() < 0 || deadline < runtime || period < deadline)
+        {
+            return WorkerPoolStatus::INVALID_ARGUMENTS;
+        }
+#ifdef TWINE_HAS_SCHED_DEADLINE
+        if (type == ThreadType::XENOMAI)
+        {
+            return WorkerPoolStatus::ERROR;
+        }
+        // Try the parameters on a temporary thread, so that workers are only created
+        // with parameters that the kernel accepts
+        DeadlineParameters parameters{runtime, deadline, period};
+        int res = 0;
+        std::thread probe([&]()
+        {
+            res = set_current_thread_deadline(parameters);
+        });
+        probe.join();
+        if (res == 0)
+        {
+            _deadline = parameters;
+        }
+        return errno_to_worker_status(res);
+#else
+        return WorkerPoolStatus::ERROR;
+#endif
     }
 
 private:
-    std::atomic_bool            _running{true};
+    /**
+     * @brief Run a cycle other than the regular worker callbacks and block until done.
+     *        Must be called after applying pending changes and setting up the work for
+     *        the current number of participants.
+     */
+    void _run_cycle(CycleType cycle_type)
+    {
+        _state.cycle_type = cycle_type;
+        TraceRecorder::trace(TraceEventType::BARRIER_RELEASE);
+        if (_caller_participates)
+        {
+            _state.barrier.release_all();
+            _run_caller_share(cycle_type);
+            _state.barrier.wait_for_all();
+        }
+        else
+        {
+            _state.barrier.release_and_wait();
+        }
+        _state.cycle_type = CycleType::WORKER_CALLBACKS;
+    }
+
+    /**
+     * @brief Let the calling thread do its part of the cycle, as if it was an extra worker
+     */
+    void _run_caller_share(CycleType cycle_type)
+    {
+        switch (cycle_type)
+        {
+            case CycleType::WORKER_CALLBACKS:
+                break;
+
+            case CycleType::JOB_GRAPH:
+                _state.job_graph.template run_jobs<type>(true);
+                break;
+
+            case CycleType::TASKS:
+                _state.task_scheduler.run_tasks(_no_workers);
+                break;
+
+            case CycleType::PARALLEL_RANGE:
+                _state.parallel_range.run(_no_workers);
+                break;
+        }
+    }
+
+    int _no_participants() const
+    {
+        return _no_workers + (_caller_participates ? 1 : 0);
+    }
+
+    bool _valid_worker_id(int worker_id) const
+    {
+        return worker_id >= 0 && worker_id < static_cast<int>(_workers.size()) &&
+               _workers[worker_id] != nullptr && _workers[worker_id]->change_pending() == false;
+    }
+
+    /**
+     * @brief Request a change to a worker and block until the thread controlling the
+     *        pool has taken it, which it does at the start of the next cycle, before
+     *        releasing the workers. The change is withdrawn if that doesn't happen
+     *        within CHANGE_TIMEOUT. Never locks, so the controlling thread is never
+     *        blocked by the requesting thread.
+     * @return WorkerPoolStatus::OK if the change was applied, BUSY if it was withdrawn
+     */
+    WorkerPoolStatus _change_worker(int worker_id, WorkerChange change,
+                                    WorkerCallback callback = nullptr, void* callback_data = nullptr)
+    {
+        WorkerMask worker_bit = WorkerMask(1) << worker_id;
+        auto worker = _workers[worker_id].get();
+        worker->request_change(change, callback, callback_data);
+        _pending_changes.fetch_or(worker_bit, std::memory_order_release);
+        auto timeout = std::chrono::steady_clock::now() + CHANGE_TIMEOUT;
+        while (_pending_changes.load(std::memory_order_acquire) & worker_bit)
+        {
+            // Whichever of this thread and the controlling thread clears the bit first
+            // decides if the change is withdrawn or applied
+            if (std::chrono::steady_clock::now() >= timeout &&
+                (_pending_changes.fetch_and(~worker_bit, std::memory_order_acq_rel) & worker_bit))
+            {
+                worker->request_change(WorkerChange::NONE);
+                return WorkerPoolStatus::BUSY;
+            }
+            std::this_thread::sleep_for(CHANGE_POLL_INTERVAL);
+        }
+        // Taken by the controlling thread, which applies it before releasing the workers.
+        // A removed worker stays pending until it has exited.
+        while (change == WorkerChange::REPLACE_CALLBACK && worker->change_pending())
+        {
+            std::this_thread::sleep_for(CHANGE_POLL_INTERVAL);
+        }
+        return WorkerPoolStatus::OK;
+    }
+
+    /**
+     * @brief Apply changes to workers requested from other threads. Called by the thread
+     *        controlling the pool before releasing the workers, when they are all waiting
+     *        on the barrier.
+     */
+    void _apply_pending_changes()
+    {
+        if (_pending_changes.load(std::memory_order_relaxed) == 0)
+        {
+            return;
+        }
+        WorkerMask changes = _pending_changes.exchange(0, std::memory_order_acquire);
+        bool workers_removed = false;
+        while (changes != 0)
+        {
+            int id = __builtin_ctzll(changes);
+            changes &= changes - 1;
+            if (_workers[id]->apply_change() == WorkerChange::REMOVE)
+            {
+                if (_workers[id]->cpu_id() >= 0)
+                {
+                    _cores_usage[_workers[id]->cpu_id()]--;
+                }
+                _active_workers &= ~(WorkerMask(1) << id);
+                _state.barrier.remove_thread(id);
+                workers_removed = true;
+            }
+        }
+        if (workers_removed)
+        {
+            // Keep the ranks of the remaining workers contiguous
+            int rank = 0;
+            for (WorkerMask workers = _active_workers; workers != 0; workers &= workers - 1)
+            {
+                _workers[__builtin_ctzll(workers)]->set_rank(rank++);
+            }
+            _no_workers = rank;
+            _state.task_scheduler.set_no_workers(_no_workers);
+        }
+    }
+
+    /**
+     * @brief Prepare the workers for a regular cycle, just before releasing them
+     */
+    void _prepare_cycle()
+    {
+        _apply_pending_changes();
+        _balance_load();
+        if (_state.measure_timing)
+        {
+            _state.cycle_start = current_rt_time();
+        }
+        TraceRecorder::trace(TraceEventType::BARRIER_RELEASE);
+    }
+
+    /**
+     * @brief Redistribute the workers over the cores according to their load, every
+     *        LOAD_WINDOW_CYCLES cycles if load balancing is enabled. Called by the thread
+     *        controlling the pool before releasing the workers, which moves the workers
+     *        while they are parked, so that they start the cycle on their new cpus.
+     */
+    void _balance_load()
+    {
+#ifndef __APPLE__
+        if (_load_balancing == false || ++_cycles_since_balancing < LOAD_WINDOW_CYCLES)
+        {
+            return;
+        }
+        _cycles_since_balancing = 0;
+        // Deadline workers have no cpu and are left out
+        int no_workers = 0;
+        for (WorkerMask workers = _active_workers; workers != 0; workers &= workers - 1)
+        {
+            const auto& worker = _workers[__builtin_ctzll(workers)];
+            if (worker->cpu_id() >= 0)
+            {
+                _balanced_workers[no_workers++] = {worker->load(), worker->cpu_id(), worker->pinned()};
+            }
+        }
+        if (_load_balancer.rebalance(_balanced_workers.data(), no_workers) == false)
+        {
+            return;
+        }
+        int i = 0;
+        for (WorkerMask workers = _active_workers; workers != 0; workers &= workers - 1)
+        {
+            auto& worker = _workers[__builtin_ctzll(workers)];
+            if (worker->cpu_id() < 0)
+            {
+                continue;
+            }
+            int old_cpu = worker->cpu_id();
+            int new_cpu = _balanced_workers[i++].cpu;
+            if (new_cpu != old_cpu && worker->migrate(new_cpu, _migration_cpus, _migration_cpus_size))
+            {
+                _cores_usage[old_cpu]--;
+                _cores_usage[new_cpu]++;
+            }
+        }
+#endif
+    }
+
+    WorkerPoolState<type>       _state;
     int                         _no_workers{0};
+    bool                        _caller_participates{false};
+    WorkerCallback              _caller_callback{nullptr};
+    void*                       _caller_data{nullptr};
     int                         _no_cores;
     std::vector<int>            _cores_usage;
+    CpuTopology                 _topology;
+    LoadBalancer                _load_balancer;
+    std::array<LoadBalancer::Worker, MAX_WORKERS_PER_POOL> _balanced_workers;
+#ifndef __APPLE__
+    cpu_set_t*                  _migration_cpus{nullptr};
+    size_t                      _migration_cpus_size{0};
+#endif
+    int                         _cycles_since_balancing{0};
+    bool                        _load_balancing{false};
+    bool                        _timing_stats{false};
+    std::chrono::nanoseconds    _timing_budget{0};
+    DeadlineParameters          _deadline;
+    WorkerStackSettings         _stack;
+    size_t                      _scratch_size{0};
+    bool                        _scratch_huge_pages{false};
     bool                        _disable_denormals;
     bool                        _break_on_mode_sw;
-    BarrierWithTrigger<type>    _barrier;
     std::vector<std::unique_ptr<WorkerThread<type>>> _workers;
+    WorkerMask                  _active_workers{0};
+    std::atomic<WorkerMask>     _pending_changes{0};
 };
 
 }// namespace twine
@@ -59,6 +59,27 @@ inline int __cobalt_pthread_cond_wait([[maybe_unused]]pthread_cond_t* condition_
     assert(false);
     return 0;
 }
+inline int __cobalt_pthread_cond_timedwait([[maybe_unused]]pthread_cond_t* condition_var, [[maybe_unused]]pthread_mutex_t* mutex,
+                                           [[maybe_unused]]const struct timespec* abstime)
+{
+    assert(false);
+    return 0;
+}
+inline int __cobalt_pthread_condattr_init([[maybe_unused]]pthread_condattr_t* attributes)
+{
+    assert(false);
+    return 0;
+}
+inline int __cobalt_pthread_condattr_setclock([[maybe_unused]]pthread_condattr_t* attributes, [[maybe_unused]]clockid_t clock_id)
+{
+    assert(false);
+    return 0;
+}
+inline int __cobalt_pthread_condattr_destroy([[maybe_unused]]pthread_condattr_t* attributes)
+{
+    assert(false);
+    return 0;
+}
 inline int __cobalt_pthread_cond_signal([[maybe_unused]]pthread_cond_t* condition_var)
 {
     assert(false);
@@ -81,6 +102,12 @@ inline int __cobalt_pthread_join([[maybe_unused]]pthread_t thread, [[maybe_unuse
     return 0;
 }
 
+inline int __cobalt_sched_yield()
+{
+    assert(false);
+    return 0;
+}
+
 inline int __cobalt_clock_gettime([[maybe_unused]] clockid_t clock_id, struct timespec *tp)
 {
     assert(false);
@@ -107,6 +134,12 @@ inline int __cobalt_sem_wait([[maybe_unused]] sem_t* sem)
     return 0;
 }
 
+inline int __cobalt_sem_trywait([[maybe_unused]] sem_t* sem)
+{
+    assert(false);
+    return 0;
+}
+
 inline int __cobalt_sem_post([[maybe_unused]] sem_t* sem)
 {
     assert(false);
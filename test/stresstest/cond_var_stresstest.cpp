@@ -7,7 +7,6 @@
 #include <atomic>
 
 #include <getopt.h>
-#include <sys/mman.h>
 
 #ifdef TWINE_BUILD_WITH_XENOMAI
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -18,14 +17,19 @@
 
 #include "twine/twine.h"
 #include "twine_internal.h"
+#include "condition_variable_implementation.h"
 
 /*
  * Tool for stress testing Condition Variable implementations.
  *
  * The test spawns 1 worker thread per condition variable and notifies
- * these at random intervals while counting the number of wake ups.
- * Ideally the number of wake ups should be equal or very close to
- * the number of notifications sent.
+ * these at random intervals while counting the notifications received
+ * by the worker threads, which should be equal to the number of
+ * notifications sent.
+ *
+ * With -l, it instead compares the latency of the condition variable
+ * implementations available on the system: the time spent in notify()
+ * and the time from calling notify() until the waiting thread wakes up.
  */
 
 constexpr int DEFAULT_INSTANCES = 4;
@@ -36,6 +40,9 @@ constexpr int NOTIFICATION_INTENSITY_MIN = 20;
 constexpr int NOTIFICATION_INTENSITY_MAX = 1;
 constexpr int PRINT_INTERVAL = 17;
 
+// Lets the waiting thread go back to sleep between notifications when measuring latency
+constexpr auto LATENCY_INTERVAL = std::chrono::microseconds(200);
+
 struct ProcessData
 {
     twine::RtConditionVariable* cond_var;
@@ -47,10 +54,7 @@ void worker_function(ProcessData data)
 {
     while(*data.run)
     {
-        if (data.cond_var->wait())
-        {
-            *data.counter += 1;
-        }
+        *data.counter += data.cond_var->wait_counted();
     }
 }
 
@@ -69,7 +73,6 @@ void xenomai_thread_init()
     xenomai_init(&argc, (char* const**) &argv);
     free(argv[0]);
     free(argv);
-    mlockall(MCL_CURRENT|MCL_FUTURE);
     twine::init_xenomai();
 }
 #endif
@@ -79,15 +82,16 @@ void xenomai_thread_init()
 #endif
 
 
-std::tuple<int, int, bool, bool> parse_opts(int argc, char** argv)
+std::tuple<int, int, bool, bool, bool> parse_opts(int argc, char** argv)
 {
     int instances = DEFAULT_INSTANCES;
     int iters = DEFAULT_ITERATIONS;
     bool xenomai = false;
     bool print_timings = false;
+    bool latency = false;
     signed char c;
 
-    while ((c = getopt(argc, argv, "c:i:xt")) != -1)
+    while ((c = getopt(argc, argv, "c:i:xtl")) != -1)
     {
         switch (c)
         {
@@ -100,6 +104,9 @@ std::tuple<int, int, bool, bool> parse_opts(int argc, char** argv)
             case 't':
                 print_timings = true;
                 break;
+            case 'l':
+                latency = true;
+                break;
             case 'x':
                 if (!xenomai)
                 {
@@ -108,13 +115,13 @@ std::tuple<int, int, bool, bool> parse_opts(int argc, char** argv)
                 }
                 break;
             case '?':
-                std::cout << "Options are: -c[n of condition variable instances], -i[n of iterations], -x - use xenomai threads, -t - print timings for each iteration" << std::endl;
+                std::cout << "Options are: -c[n of condition variable instances], -i[n of iterations], -x - use xenomai threads, -t - print timings for each iteration, -l - compare the latency of the implementations" << std::endl;
                 abort();
             default:
                 abort();
         }
     }
-    return std::make_tuple(instances, iters, xenomai, print_timings);
+    return std::make_tuple(instances, iters, xenomai, print_timings, latency);
 }
 
 void print_iterations(int64_t iter, bool xenomai)
@@ -208,16 +215,102 @@ void print_results(const std::vector<uint64_t>& rt_counts, const std::vector<uin
     std::cout << std::endl;
     for (int i = 0; i < static_cast<int>(rt_counts.size()); ++i)
     {
-        std::cout << "Condition variable: " << i << "\t notifications: "<< rt_counts[i] << " \t wake ups: "
-            << non_rt_counts[i] << " \t missed wakeups: "
+        std::cout << "Condition variable: " << i << "\t notifications: "<< rt_counts[i] << " \t received: "
+            << non_rt_counts[i] << " \t missed: "
             << static_cast<int64_t>(rt_counts[i]) -  static_cast<int64_t>(non_rt_counts[i]) << std::endl;
     }
 }
 
 
+struct LatencyStats
+{
+    std::chrono::nanoseconds min{std::chrono::nanoseconds::max()};
+    std::chrono::nanoseconds max{0};
+    std::chrono::nanoseconds total{0};
+    int64_t                  count{0};
+
+    void add(std::chrono::nanoseconds time)
+    {
+        min = std::min(min, time);
+        max = std::max(max, time);
+        total += time;
+        count++;
+    }
+};
+
+std::ostream& operator<<(std::ostream& stream, const LatencyStats& stats)
+{
+    if (stats.count == 0)
+    {
+        return stream << "no samples";
+    }
+    return stream << "min: " << stats.min.count() << " ns \t avg: " << stats.total.count() / stats.count
+                  << " ns \t max: " << stats.max.count() << " ns";
+}
+
+/**
+ * @brief Notify a condition variable iters times with the waiting thread asleep, and
+ *        measure the time of notify() and the time until the waiting thread wakes up
+ */
+void measure_latency(twine::RtConditionVariable& cond_var, const std::string& name, int iters)
+{
+    std::atomic<std::chrono::nanoseconds> notify_time{std::chrono::nanoseconds(0)};
+    std::atomic_bool run = true;
+    LatencyStats notify_stats;
+    LatencyStats wakeup_stats;
+
+    std::thread waiter([&]()
+    {
+        while (true)
+        {
+            cond_var.wait();
+            auto wake_time = twine::current_rt_time();
+            if (run == false)
+            {
+                break;
+            }
+            wakeup_stats.add(wake_time - notify_time.load());
+        }
+    });
+    for (int i = 0; i < iters; ++i)
+    {
+        std::this_thread::sleep_for(LATENCY_INTERVAL);
+        auto start_time = twine::current_rt_time();
+        notify_time.store(start_time);
+        cond_var.notify();
+        notify_stats.add(twine::current_rt_time() - start_time);
+    }
+    std::this_thread::sleep_for(LATENCY_INTERVAL);
+    run = false;
+    cond_var.notify();
+    waiter.join();
+
+    std::cout << name << " notify() \t " << notify_stats << std::endl;
+    std::cout << name << " wake up  \t " << wakeup_stats << std::endl;
+}
+
+void run_latency_comparison(int iters)
+{
+    twine::PosixConditionVariable mutex_cond_var;
+    measure_latency(mutex_cond_var, "mutex", iters);
+#ifdef TWINE_HAS_FUTEX
+    twine::FutexConditionVariable futex_cond_var;
+    measure_latency(futex_cond_var, "futex", iters);
+#endif
+}
+
 int main(int argc, char **argv)
 {
-    auto [instances, iters, xenomai, timings] = parse_opts(argc, argv);
+    auto [instances, iters, xenomai, timings, latency] = parse_opts(argc, argv);
+    if (twine::lock_and_prefault_memory() != twine::WorkerPoolStatus::OK)
+    {
+        std::cout << "Warning: could not lock memory, page faults may add to the timings" << std::endl;
+    }
+    if (latency)
+    {
+        run_latency_comparison(iters);
+        return 0;
+    }
 
     std::vector<std::thread> non_rt_threads;
     std::vector<uint64_t> rt_counts(instances, 0);
@@ -6,7 +6,6 @@
 #include <thread>
 
 #include <getopt.h>
-#include <sys/mman.h>
 
 #ifdef TWINE_BUILD_WITH_XENOMAI
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -25,8 +24,9 @@
 
 constexpr int DEFAULT_CORES = 4;
 constexpr int DEFAULT_WORKERS = 10;
-constexpr int MAX_LOAD = 300;
+constexpr int DEFAULT_LOAD = 300;
 constexpr int DEFAULT_ITERATIONS = 10000;
+constexpr int DEFAULT_POOLS = 1;
 
 /* iir parameters: */
 constexpr float CUTOFF = 0.2f;
@@ -78,6 +78,7 @@ void update_stats(TimeStats& data, TimeStamp new_time)
 struct ProcessData
 {
     AudioBuffer buffer;
+    int load{DEFAULT_LOAD};
     FilterRegister mem;
     TimeStamp start_time{0};
     TimeStamp end_time{0};
@@ -89,12 +90,24 @@ struct ProcessData
     int id{0};
 };
 
+/* A pool under test and the thread driving it */
+struct PoolTest
+{
+    std::unique_ptr<twine::WorkerPool> pool;
+    std::vector<ProcessData> process_data;
+    TimeStats cycle_stats;
+    int iterations{0};
+    bool xenomai{false};
+    bool print_timings{false};
+    bool print_progress{false};
+};
+
 void worker_function(void* data)
 {
     auto process_data = reinterpret_cast<ProcessData*>(data);
     auto start_time = twine::current_rt_time();
 
-    int iters = MAX_LOAD;
+    int iters = process_data->load;
     for (int i = 0; i < iters; ++i)
     {
         process_filter(process_data->buffer, process_data->mem);
@@ -136,7 +149,6 @@ void xenomai_thread_init()
     xenomai_init(&argc, (char* const**) &argv);
     free(argv[0]);
     free(argv);
-    mlockall(MCL_CURRENT|MCL_FUTURE);
     twine::init_xenomai();
 }
 #endif
@@ -148,19 +160,25 @@ void xenomai_thread_init()
 #endif
 
 
-std::tuple<int, int, int, bool, bool> parse_opts(int argc, char** argv)
+std::tuple<int, int, int, int, int, int, bool, bool> parse_opts(int argc, char** argv)
 {
+    int pools = DEFAULT_POOLS;
     int workers = DEFAULT_WORKERS;
     int cores = DEFAULT_CORES;
     int iters = DEFAULT_ITERATIONS;
+    int load = DEFAULT_LOAD;
+    int spin_time = 0;
     bool xenomai = false;
     bool print_timings = false;
     signed char c;
 
-    while ((c = getopt(argc, argv, "w:c:i:xt")) != -1)
+    while ((c = getopt(argc, argv, "p:w:c:i:l:s:xt")) != -1)
     {
         switch (c)
         {
+            case 'p':
+                pools = atoi(optarg);
+                break;
             case 'w':
                 workers = atoi(optarg);
                 break;
@@ -170,6 +188,12 @@ std::tuple<int, int, int, bool, bool> parse_opts(int argc, char** argv)
             case 'i':
                 iters = atoi(optarg);
                 break;
+            case 'l':
+                load = atoi(optarg);
+                break;
+            case 's':
+                spin_time = atoi(optarg);
+                break;
             case 't':
                 print_timings = true;
                 break;
@@ -181,28 +205,27 @@ std::tuple<int, int, int, bool, bool> parse_opts(int argc, char** argv)
                 }
                 break;
             case '?':
-                std::cout << "Options are: -w[n of worker threads], -c[n of cores], -i[n of iterations], -x - use xenomai threads, -t - print timings for each iteration" << std::endl;
+                std::cout << "Options are: -p[n of pools running concurrently], -w[n of worker threads per pool], -c[n of cores], -i[n of iterations], -l[n of filter passes per worker], -s[worker spin time in us], -x - use xenomai threads, -t - print timings for each iteration" << std::endl;
                 abort();
 
             default:
                 abort();
         }
     }
-    return std::make_tuple(workers, cores, iters, xenomai,
+    return std::make_tuple(pools, workers, cores, iters, load, spin_time, xenomai,
                            print_timings);
 }
 
-
-void update_timings(std::vector<ProcessData>* data, int iter, bool xenomai, bool print, TimeStamp start_time, TimeStamp end_time)
+void update_timings(PoolTest& test, int iter, TimeStamp start_time, TimeStamp end_time)
 {
-    static float min_time{10000000};
-    static float max_time{0};
-    static float mean_time{0};
-
+    auto& data = test.process_data;
+    bool xenomai = test.xenomai;
+    bool print = test.print_timings;
+    update_stats(test.cycle_stats, end_time - start_time);
     float current_total = (end_time - start_time).count() / 1000.0f;
-    max_time = std::max(max_time, current_total);
-    min_time = std::min(min_time, current_total);
-    mean_time = (4.0f * mean_time + current_total) / 5;
+    float mean_time = test.cycle_stats.mean_time.count() / 1000.0f;
+    float min_time = test.cycle_stats.min_time.count() / 1000.0f;
+    float max_time = test.cycle_stats.max_time.count() / 1000.0f;
 
     if (print)
     {
@@ -219,7 +242,7 @@ void update_timings(std::vector<ProcessData>* data, int iter, bool xenomai, bool
     }
 
     int id = 0;
-    for(auto& w : *data)
+    for(auto& w : data)
     {
         auto process_time = std::chrono::duration_cast<std::chrono::microseconds>(w.end_time - w.start_time);
         auto offset_time = std::chrono::duration_cast<std::chrono::microseconds>(w.start_time - start_time);
@@ -261,8 +284,13 @@ void print_iterations(int iter, bool xenomai)
     }
 }
 
-void print_final_stats(const std::vector<ProcessData>& data)
+void print_final_stats(const PoolTest& test)
 {
+    const auto& data = test.process_data;
+    const auto& cycle_stats = test.cycle_stats;
+    std::cout << "Cycle time: avg: " << cycle_stats.mean_time.count() / 1000.0 <<
+                 " us, min: " << cycle_stats.min_time.count() / 1000.0 <<
+                 " us, max: " << cycle_stats.max_time.count() / 1000.0 << " us" << std::endl;
     for(unsigned int i = 0; i < data.size(); ++i)
     {
         const auto& w = data[i];
@@ -278,18 +306,19 @@ void print_final_stats(const std::vector<ProcessData>& data)
 void* run_stress_test(void* data)
 {
     twine::set_flush_denormals_to_zero();
-    auto [pool, process_data, iters, xenomai, print_timings] = *(reinterpret_cast<std::tuple<twine::WorkerPool*, std::vector<ProcessData>*, int, bool, bool>*>(data));
-    for (int i = 0; i < iters; ++i)
+    auto& test = *reinterpret_cast<PoolTest*>(data);
+    bool xenomai = test.xenomai;
+    for (int i = 0; i < test.iterations; ++i)
     {
         auto start_time = twine::current_rt_time();
 
         // Run all workers
-        pool->wakeup_and_wait();
+        test.pool->wakeup_and_wait();
 
         auto end_time = twine::current_rt_time();
         if ((i + 1) % 10 == 0)
         {
-            if (!print_timings)
+            if (!test.print_timings && test.print_progress)
             {
                 print_iterations(i, xenomai);
             }
@@ -305,7 +334,7 @@ void* run_stress_test(void* data)
 #endif
             }
         }
-        update_timings(process_data, i, xenomai, print_timings, start_time, end_time);
+        update_timings(test, i, start_time, end_time);
     }
     return nullptr;
 }
@@ -334,50 +363,85 @@ void run_stress_test_in_xenomai_thread([[maybe_unused]] void* data)
 #endif
 }
 
-int main(int argc, char **argv)
+void run_pool_test(PoolTest& test)
 {
-    auto [workers, cores, iters, xenomai, timings] = parse_opts(argc, argv);
+    if (test.xenomai)
+    {
+        run_stress_test_in_xenomai_thread(&test);
+    }
+    else
+    {
+        run_stress_test(&test);
+    }
+}
 
-    std::vector<ProcessData> data;
-    data.reserve(workers);
-    auto worker_pool = twine::WorkerPool::create_worker_pool(cores);
+int main(int argc, char **argv)
+{
+    auto [pools, workers, cores, iters, load, spin_time, xenomai, timings] = parse_opts(argc, argv);
+    if (twine::lock_and_prefault_memory() != twine::WorkerPoolStatus::OK)
+    {
+        std::cout << "Warning: could not lock memory, page faults may add to the timings" << std::endl;
+    }
 
     std::random_device rd;
     std::mt19937 gen(rd());
     std::uniform_real_distribution<float> dist(-1, 1);
 
-    for (int i = 0; i < workers; ++i)
+    /* Every pool gets its own controlling thread, to measure how pools running
+     * side by side in the same process scale */
+    std::vector<PoolTest> tests(pools);
+    for (int p = 0; p < pools; ++p)
     {
-        ProcessData d;
-        d.mem = {0,0};
-        d.id = i;
-        for (auto& b : d.buffer)
+        auto& test = tests[p];
+        test.iterations = iters;
+        test.xenomai = xenomai;
+        test.print_timings = timings && pools == 1;
+        test.print_progress = p == 0;
+        test.process_data.reserve(workers);
+        test.pool = twine::WorkerPool::create_worker_pool(cores);
+        test.pool->set_spin_time(std::chrono::microseconds(spin_time));
+
+        for (int i = 0; i < workers; ++i)
         {
-            b = dist(gen);
-        }
+            ProcessData d;
+            d.mem = {0,0};
+            d.id = i;
+            d.load = load;
+            for (auto& b : d.buffer)
+            {
+                b = dist(gen);
+            }
 
-        data.push_back(d);
-        auto res = worker_pool->add_worker(worker_function, &data[i]);
-        if (res != twine::WorkerPoolStatus::OK)
-        {
-            std::cout << "Failed to start workers: " << to_error_string(res) << std::endl;
-            return -1;
+            test.process_data.push_back(d);
+            auto res = test.pool->add_worker(worker_function, &test.process_data[i]);
+            if (res != twine::WorkerPoolStatus::OK)
+            {
+                std::cout << "Failed to start workers: " << to_error_string(res) << std::endl;
+                return -1;
+            }
         }
     }
-    auto test_data = std::make_tuple(worker_pool.get(), &data, iters, xenomai, timings);
 
-    if (xenomai)
+    std::vector<std::thread> controllers;
+    for (int p = 1; p < pools; ++p)
     {
-        run_stress_test_in_xenomai_thread(&test_data);
-
+        controllers.emplace_back(run_pool_test, std::ref(tests[p]));
     }
-    else
+    run_pool_test(tests[0]);
+    for (auto& c : controllers)
     {
-        run_stress_test(&test_data);
+        c.join();
     }
 
     std::cout << "\n" << iters << " iterations" << std::endl;
-    print_final_stats(data);
+    for (int p = 0; p < pools; ++p)
+    {
+        if (pools > 1)
+        {
+            std::cout << "Pool " << p << ":" << std::endl;
+        }
+        print_final_stats(tests[p]);
+    }
 
     return 0;
 }
@@ -0,0 +1,192 @@
+#include <thread>
+#include <vector>
+#include <set>
+
+#include "gtest/gtest.h"
+
+#include "block_pool.h"
+#include "counting_condition_variable.h"
+
+using namespace twine;
+
+constexpr int TEST_BLOCKS = 100;
+
+class BlockPoolTest : public ::testing::Test
+{
+protected:
+    BlockPoolTest() {}
+
+    void SetUp()
+    {
+        _module_under_test = BlockPool::create_block_pool(24, TEST_BLOCKS, 10, &_notifier);
+        ASSERT_NE(nullptr, _module_under_test);
+    }
+
+    CountingConditionVariable  _notifier;
+    std::unique_ptr<BlockPool> _module_under_test;
+};
+
+TEST_F(BlockPoolTest, TestAllocateAndFree)
+{
+    ASSERT_EQ(24u, _module_under_test->block_size());
+    std::vector<void*> blocks;
+    for (int i = 0; i < TEST_BLOCKS; ++i)
+    {
+        auto block = _module_under_test->allocate();
+        ASSERT_NE(nullptr, block);
+        ASSERT_EQ(0u, reinterpret_cast<uintptr_t>(block) % alignof(std::max_align_t));
+        memset(block, 0xff, 24);
+        blocks.push_back(block);
+    }
+    ASSERT_EQ(TEST_BLOCKS, static_cast<int>(std::set<void*>(blocks.begin(), blocks.end()).size()));
+    ASSERT_EQ(nullptr, _module_under_test->allocate());
+
+    auto stats = _module_under_test->stats();
+    ASSERT_EQ(TEST_BLOCKS, stats.capacity);
+    ASSERT_EQ(0, stats.available);
+    ASSERT_EQ(0, stats.min_available);
+    ASSERT_EQ(1u, stats.failed_allocations);
+
+    for (auto block : blocks)
+    {
+        _module_under_test->deallocate(block);
+    }
+    _module_under_test->deallocate(nullptr);
+    /* Part of the blocks are still in this thread's cache */
+    stats = _module_under_test->stats();
+    ASSERT_GE(stats.available, TEST_BLOCKS - BLOCK_CACHE_SIZE);
+    ASSERT_NE(nullptr, _module_under_test->allocate());
+}
+
+TEST_F(BlockPoolTest, TestLowWatermarkAndRefill)
+{
+    std::vector<void*> blocks;
+    while (_module_under_test->stats().available > 10)
+    {
+        blocks.push_back(_module_under_test->allocate());
+    }
+    ASSERT_EQ(1, _notifier.notifications);
+    /* Only notified once until the pool is above the watermark again */
+    blocks.push_back(_module_under_test->allocate());
+    ASSERT_EQ(1, _notifier.notifications);
+
+    ASSERT_EQ(WorkerPoolStatus::INVALID_ARGUMENTS, _module_under_test->refill(0));
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test->refill(50));
+    auto stats = _module_under_test->stats();
+    ASSERT_EQ(TEST_BLOCKS + 50, stats.capacity);
+    ASSERT_EQ(stats.available, stats.min_available);
+
+    /* Blocks from both chunks can be allocated and freed */
+    while (auto block = _module_under_test->allocate())
+    {
+        blocks.push_back(block);
+    }
+    ASSERT_EQ(TEST_BLOCKS + 50, static_cast<int>(blocks.size()));
+    ASSERT_EQ(2, _notifier.notifications);
+    for (auto block : blocks)
+    {
+        _module_under_test->deallocate(block);
+    }
+}
+
+TEST_F(BlockPoolTest, TestThreadCacheReturnedOnExit)
+{
+    std::thread thread([&]()
+    {
+        void* block = _module_under_test->allocate();
+        ASSERT_NE(nullptr, block);
+        _module_under_test->deallocate(block);
+    });
+    thread.join();
+    ASSERT_EQ(TEST_BLOCKS, _module_under_test->stats().available);
+}
+
+TEST_F(BlockPoolTest, TestFreeOnlyThreadKeepsNoBlocks)
+{
+    std::vector<void*> blocks;
+    while (auto block = _module_under_test->allocate())
+    {
+        blocks.push_back(block);
+    }
+    /* A thread that only frees blocks returns them straight to the pool */
+    std::thread thread([&]()
+    {
+        for (auto block : blocks)
+        {
+            _module_under_test->deallocate(block);
+        }
+        ASSERT_EQ(TEST_BLOCKS, _module_under_test->stats().available);
+    });
+    thread.join();
+}
+
+TEST(BlockPoolCacheTest, TestCachesOfDestroyedPoolsAreReleased)
+{
+    std::thread thread([]()
+    {
+        /* More pools than a thread has cache entries for, but only one at a time */
+        for (int i = 0; i < 2 * MAX_CACHED_POOLS_PER_THREAD; ++i)
+        {
+            auto pool = BlockPool::create_block_pool(24, TEST_BLOCKS);
+            void* block = pool->allocate();
+            ASSERT_NE(nullptr, block);
+            /* The thread got a cache, which was filled from the pool */
+            ASSERT_EQ(TEST_BLOCKS - BLOCK_CACHE_SIZE / 2, pool->stats().available);
+            pool->deallocate(block);
+        }
+    });
+    thread.join();
+}
+
+TEST_F(BlockPoolTest, TestConcurrentUse)
+{
+    constexpr int THREADS = 4;
+    constexpr int ITERATIONS = 10000;
+    std::atomic_int errors{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            std::vector<unsigned char*> blocks;
+            for (int i = 0; i < ITERATIONS; ++i)
+            {
+                if (blocks.size() < 10 && (i % 3) != 2)
+                {
+                    auto block = static_cast<unsigned char*>(_module_under_test->allocate());
+                    if (block)
+                    {
+                        memset(block, t, 24);
+                        blocks.push_back(block);
+                    }
+                }
+                else if (blocks.empty() == false)
+                {
+                    auto block = blocks.back();
+                    blocks.pop_back();
+                    for (int b = 0; b < 24; ++b)
+                    {
+                        errors += block[b] != t;
+                    }
+                    _module_under_test->deallocate(block);
+                }
+            }
+            for (auto block : blocks)
+            {
+                _module_under_test->deallocate(block);
+            }
+        });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    ASSERT_EQ(0, errors);
+    ASSERT_EQ(TEST_BLOCKS, _module_under_test->stats().available);
+}
+
+TEST(BlockPoolCreationTest, TestInvalidArguments)
+{
+    EXPECT_THROW(BlockPool::create_block_pool(0, 10), std::runtime_error);
+    EXPECT_THROW(BlockPool::create_block_pool(16, 0), std::runtime_error);
+}
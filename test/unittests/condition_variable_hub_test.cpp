@@ -0,0 +1,202 @@
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "gtest/gtest.h"
+
+#include "condition_variable_hub.h"
+
+using namespace twine;
+
+constexpr int TEST_CHANNELS = 200;
+
+/* Stand-in for the single kernel object carrying all channels, i.e. the xddp
+ * socket of XenomaiConditionVariable, that counts the notifications reaching it */
+class EventFdConditionVariable : public RtConditionVariable
+{
+public:
+    EventFdConditionVariable(std::atomic_int& counter) : _counter(counter)
+    {
+        _fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    ~EventFdConditionVariable() override
+    {
+        close(_fd);
+    }
+
+    void notify() override
+    {
+        _counter++;
+        uint64_t data = 1;
+        [[maybe_unused]] auto unused = write(_fd, &data, sizeof(data));
+    }
+
+    bool wait() override
+    {
+        return wait_counted() > 0;
+    }
+
+    int wait_counted() override
+    {
+        return _wait(-1);
+    }
+
+    int wait_until(std::chrono::nanoseconds deadline) override
+    {
+        auto time_left = std::chrono::ceil<std::chrono::milliseconds>(deadline - current_rt_time());
+        return _wait(std::max<int>(0, static_cast<int>(time_left.count())));
+    }
+
+    int native_handle() override
+    {
+        return _fd;
+    }
+
+private:
+    int _wait(int timeout_ms)
+    {
+        pollfd target = {.fd = _fd, .events = POLLIN, .revents = 0};
+        if (poll(&target, 1, timeout_ms) <= 0)
+        {
+            return 0;
+        }
+        uint64_t count = 0;
+        [[maybe_unused]] auto unused = read(_fd, &count, sizeof(count));
+        return static_cast<int>(count);
+    }
+
+    std::atomic_int& _counter;
+    int              _fd;
+};
+
+class ConditionVariableHubTest : public ::testing::Test
+{
+protected:
+    ConditionVariableHubTest() {}
+
+    void SetUp()
+    {
+        _module_under_test = std::make_unique<ConditionVariableHubImpl>(TEST_CHANNELS,
+                                                                        std::make_unique<EventFdConditionVariable>(_kernel_notifications));
+    }
+
+    std::atomic_int                           _kernel_notifications{0};
+    std::unique_ptr<ConditionVariableHubImpl> _module_under_test;
+};
+
+TEST_F(ConditionVariableHubTest, TestChannels)
+{
+    for (int i = 0; i < TEST_CHANNELS; ++i)
+    {
+        ASSERT_EQ(i, _module_under_test->add_channel());
+    }
+    ASSERT_EQ(-1, _module_under_test->add_channel());
+    _module_under_test->remove_channel(17);
+    ASSERT_EQ(17, _module_under_test->add_channel());
+    EXPECT_THROW(ConditionVariableHubImpl(0, std::make_unique<EventFdConditionVariable>(_kernel_notifications)),
+                 std::runtime_error);
+}
+
+TEST_F(ConditionVariableHubTest, TestDispatch)
+{
+    using namespace std::chrono_literals;
+    for (int i = 0; i < TEST_CHANNELS; ++i)
+    {
+        _module_under_test->add_channel();
+    }
+    std::vector<int> received(TEST_CHANNELS, 0);
+    auto record = [&](int channel, int notifications)
+    {
+        received[channel] += notifications;
+    };
+    ASSERT_EQ(0, _module_under_test->dispatch(record, current_rt_time() + 1ms));
+
+    /* Only the first notification of a channel reaches the kernel object */
+    _module_under_test->notify(3);
+    _module_under_test->notify(3);
+    _module_under_test->notify(3);
+    _module_under_test->notify(150);
+    _module_under_test->notify(TEST_CHANNELS);
+    ASSERT_EQ(2, _kernel_notifications);
+
+    pollfd target = {.fd = _module_under_test->native_handle(), .events = POLLIN, .revents = 0};
+    ASSERT_EQ(1, poll(&target, 1, 0));
+    ASSERT_EQ(2, _module_under_test->dispatch(record, 0ns));
+    ASSERT_EQ(3, received[3]);
+    ASSERT_EQ(1, received[150]);
+    ASSERT_EQ(0, poll(&target, 1, 0));
+
+    /* A channel dispatched is queued again by its next notification */
+    _module_under_test->notify(3);
+    ASSERT_EQ(3, _kernel_notifications);
+    ASSERT_EQ(1, _module_under_test->dispatch(record));
+    ASSERT_EQ(4, received[3]);
+
+    /* Notifications of removed channels are not dispatched */
+    _module_under_test->notify(5);
+    _module_under_test->remove_channel(5);
+    ASSERT_EQ(0, _module_under_test->dispatch(record, 0ns));
+    ASSERT_EQ(0, received[5]);
+}
+
+TEST_F(ConditionVariableHubTest, TestConcurrentNotifications)
+{
+    constexpr int THREADS = 4;
+    constexpr int NOTIFICATIONS = 10000;
+    for (int i = 0; i < TEST_CHANNELS; ++i)
+    {
+        _module_under_test->add_channel();
+    }
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            for (int i = 0; i < NOTIFICATIONS; ++i)
+            {
+                _module_under_test->notify((t * NOTIFICATIONS + i) % TEST_CHANNELS);
+            }
+        });
+    }
+    /* No notification is lost, and every channel gets its share */
+    std::vector<int> received(TEST_CHANNELS, 0);
+    int total = 0;
+    while (total < THREADS * NOTIFICATIONS)
+    {
+        _module_under_test->dispatch([&](int channel, int notifications)
+        {
+            received[channel] += notifications;
+            total += notifications;
+        });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    ASSERT_EQ(THREADS * NOTIFICATIONS, total);
+    for (int i = 0; i < TEST_CHANNELS; ++i)
+    {
+        ASSERT_EQ(THREADS * NOTIFICATIONS / TEST_CHANNELS, received[i]);
+    }
+}
+
+TEST(ConditionVariableHubFactoryTest, TestCreate)
+{
+    auto hub = ConditionVariableHub::create_condition_variable_hub(TEST_CHANNELS);
+    ASSERT_NE(nullptr, hub);
+    int channel = hub->add_channel();
+    ASSERT_EQ(0, channel);
+    std::thread thread([&]()
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        hub->notify(channel);
+    });
+    int received = 0;
+    ASSERT_EQ(1, hub->dispatch([&](int /*channel*/, int notifications) {received += notifications;}));
+    ASSERT_EQ(1, received);
+    thread.join();
+}
@@ -1,8 +1,13 @@
 #include <thread>
 
+#include <poll.h>
+
 #include "gtest/gtest.h"
 
 #include "twine/twine.h"
+#define private public
+#include "condition_variable_implementation.h"
+#undef private
 
 using namespace twine;
 
@@ -48,6 +53,204 @@ TEST_F(RtConditionVariableTest, FunctionalityTest)
     thread.join();
 }
 
+TEST_F(RtConditionVariableTest, TestNotifyBeforeWait)
+{
+    /* A notification is kept until the next wait, and several are merged */
+    _module_under_test->notify();
+    _module_under_test->notify();
+    ASSERT_TRUE(_module_under_test->wait());
+
+    flag = false;
+    std::thread thread(test_function, _module_under_test.get());
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    ASSERT_FALSE(flag);
+    _module_under_test->notify();
+    thread.join();
+    ASSERT_TRUE(flag);
+}
+
+TEST_F(RtConditionVariableTest, TestCountedAndTimedWait)
+{
+    using namespace std::chrono_literals;
+    for (int i = 0; i < 3; ++i)
+    {
+        _module_under_test->notify();
+    }
+    ASSERT_EQ(3, _module_under_test->wait_counted());
+
+    auto start = current_rt_time();
+    ASSERT_EQ(0, _module_under_test->wait_for(2ms));
+    ASSERT_GE(current_rt_time() - start, 2ms);
+    ASSERT_EQ(0, _module_under_test->wait_until(current_rt_time() - 1ms));
+
+    std::thread thread([&]()
+    {
+        std::this_thread::sleep_for(1ms);
+        _module_under_test->notify();
+    });
+    ASSERT_EQ(1, _module_under_test->wait_for(10s));
+    thread.join();
+}
+
+template <typename ConditionVariableType>
+void test_counted_wait()
+{
+    using namespace std::chrono_literals;
+    ConditionVariableType module_under_test;
+    module_under_test.notify();
+    module_under_test.notify();
+    ASSERT_EQ(2, module_under_test.wait_counted());
+    ASSERT_EQ(0, module_under_test.wait_for(1ms));
+    module_under_test.notify();
+    ASSERT_EQ(1, module_under_test.wait_for(1ms));
+}
+
+template <typename ConditionVariableType>
+void test_native_handle()
+{
+    using namespace std::chrono_literals;
+    ConditionVariableType module_under_test;
+    /* A notification made before the handle was created is not lost */
+    module_under_test.notify();
+    pollfd target = {.fd = module_under_test.native_handle(), .events = POLLIN, .revents = 0};
+    ASSERT_GE(target.fd, 0);
+    ASSERT_EQ(target.fd, module_under_test.native_handle());
+    ASSERT_EQ(1, poll(&target, 1, 0));
+    ASSERT_EQ(1, module_under_test.wait_until(0ns));
+    ASSERT_EQ(0, poll(&target, 1, 0));
+
+    std::thread thread([&]()
+    {
+        std::this_thread::sleep_for(1ms);
+        module_under_test.notify();
+        module_under_test.notify();
+    });
+    ASSERT_EQ(1, poll(&target, 1, 10000));
+    thread.join();
+    ASSERT_EQ(2, module_under_test.wait_until(0ns));
+    ASSERT_EQ(0, poll(&target, 1, 0));
+}
+
+TEST(PosixConditionVariableTest, TestNativeHandle)
+{
+    test_native_handle<PosixConditionVariable>();
+}
+
+#ifdef TWINE_HAS_FUTEX
+TEST(FutexConditionVariableTest, TestNativeHandle)
+{
+    test_native_handle<FutexConditionVariable>();
+}
+#endif
+
+TEST(RtConditionVariableWaitAnyTest, TestWaitAny)
+{
+    using namespace std::chrono_literals;
+    std::array<std::unique_ptr<RtConditionVariable>, 3> cond_vars;
+    std::array<RtConditionVariable*, 3> cond_var_ptrs;
+    for (size_t i = 0; i < cond_vars.size(); ++i)
+    {
+        cond_vars[i] = RtConditionVariable::create_rt_condition_variable();
+        cond_var_ptrs[i] = cond_vars[i].get();
+    }
+    std::array<int, 3> notifications;
+    ASSERT_EQ(0u, RtConditionVariable::wait_any(cond_var_ptrs.data(), 3, current_rt_time() + 1ms));
+    ASSERT_EQ(0u, RtConditionVariable::wait_any(cond_var_ptrs.data(), 0));
+    ASSERT_EQ(0u, RtConditionVariable::wait_any(nullptr, 3));
+
+    cond_vars[0]->notify();
+    cond_vars[2]->notify();
+    cond_vars[2]->notify();
+    ASSERT_EQ(0b101u, RtConditionVariable::wait_any(cond_var_ptrs.data(), 3, std::nullopt, notifications.data()));
+    ASSERT_EQ(1, notifications[0]);
+    ASSERT_EQ(0, notifications[1]);
+    ASSERT_EQ(2, notifications[2]);
+
+    /* The notifications were taken */
+    ASSERT_EQ(0, cond_vars[0]->wait_until(0ns));
+    ASSERT_EQ(0, cond_vars[2]->wait_until(0ns));
+
+    std::thread thread([&]()
+    {
+        std::this_thread::sleep_for(1ms);
+        cond_vars[1]->notify();
+    });
+    ASSERT_EQ(0b010u, RtConditionVariable::wait_any(cond_var_ptrs.data(), 3, current_rt_time() + 10s));
+    thread.join();
+}
+
+TEST(PosixConditionVariableTest, TestCountedWait)
+{
+    test_counted_wait<PosixConditionVariable>();
+}
+
+#ifdef TWINE_HAS_FUTEX
+TEST(FutexConditionVariableTest, TestCountedWait)
+{
+    test_counted_wait<FutexConditionVariable>();
+}
+#endif
+
+TEST(PosixConditionVariableTest, TestNotifyBeforeWait)
+{
+    PosixConditionVariable module_under_test;
+    module_under_test.notify();
+    ASSERT_TRUE(module_under_test.wait());
+
+    flag = false;
+    std::thread thread(test_function, &module_under_test);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    ASSERT_FALSE(flag);
+    module_under_test.notify();
+    thread.join();
+    ASSERT_TRUE(flag);
+}
+
+#ifdef TWINE_HAS_FUTEX
+TEST(FutexConditionVariableTest, TestManyNotifications)
+{
+    constexpr int NOTIFICATIONS = 10000;
+    FutexConditionVariable module_under_test;
+    std::atomic_int sent{0};
+    std::atomic_bool done{false};
+    std::thread waiter([&]()
+    {
+        int received = 0;
+        /* No notification is lost and every wakeup sees all notifications sent before it */
+        while (received < NOTIFICATIONS)
+        {
+            received += module_under_test.wait_counted();
+            EXPECT_LE(received, sent.load());
+        }
+        done = received == NOTIFICATIONS;
+    });
+    for (int i = 0; i < NOTIFICATIONS; ++i)
+    {
+        sent.fetch_add(1);
+        module_under_test.notify();
+    }
+    waiter.join();
+    ASSERT_TRUE(done);
+}
+
+TEST(FutexConditionVariableTest, TestNotificationCountSaturates)
+{
+    FutexConditionVariable module_under_test;
+    ASSERT_GE(module_under_test.native_handle(), 0);
+    /* As if notified without a wait for a very long time */
+    module_under_test._state = (FutexConditionVariable::MAX_NOTIFICATIONS - 1) * FutexConditionVariable::NOTIFICATION |
+                               FutexConditionVariable::HAS_EVENT_FD;
+    module_under_test.notify();
+    module_under_test.notify();
+    ASSERT_GT(module_under_test._state, 0);
+    ASSERT_EQ(FutexConditionVariable::MAX_NOTIFICATIONS, module_under_test.wait_counted());
+
+    /* Counting starts over after the wait */
+    module_under_test.notify();
+    ASSERT_EQ(1, module_under_test.wait_until(current_rt_time()));
+}
+#endif
+
 #ifdef TWINE_BUILD_XENOMAI_TESTS
 TEST(IdGenerationTest, TestOrder)
 {
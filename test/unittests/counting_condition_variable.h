@@ -0,0 +1,41 @@
+#ifndef TWINE_COUNTING_CONDITION_VARIABLE_H
+#define TWINE_COUNTING_CONDITION_VARIABLE_H
+
+#include <atomic>
+#include <chrono>
+
+#include "twine/twine.h"
+
+/* Test stub that only counts its notifications, waiting returns immediately */
+class CountingConditionVariable : public twine::RtConditionVariable
+{
+public:
+    void notify() override
+    {
+        notifications++;
+    }
+
+    bool wait() override
+    {
+        return true;
+    }
+
+    int wait_counted() override
+    {
+        return 1;
+    }
+
+    int wait_until(std::chrono::nanoseconds /*deadline*/) override
+    {
+        return 1;
+    }
+
+    int native_handle() override
+    {
+        return -1;
+    }
+
+    std::atomic_int notifications{0};
+};
+
+#endif //TWINE_COUNTING_CONDITION_VARIABLE_H
@@ -0,0 +1,184 @@
+#include <fstream>
+#include <cstdlib>
+#include <sys/stat.h>
+
+#include "gtest/gtest.h"
+
+#include "cpu_topology.h"
+#include "load_balancer.h"
+
+using namespace twine;
+
+TEST(CpuListTest, TestParsing)
+{
+    ASSERT_EQ(std::vector<int>({0}), parse_cpu_list("0"));
+    ASSERT_EQ(std::vector<int>({0, 1, 2, 3, 8, 10, 11}), parse_cpu_list("0-3,8,10-11"));
+    ASSERT_EQ(std::vector<int>({127, 128}), parse_cpu_list("127-128"));
+    ASSERT_TRUE(parse_cpu_list("").empty());
+    ASSERT_TRUE(parse_cpu_list("(null)").empty());
+    ASSERT_TRUE(parse_cpu_list("3-1").empty());
+}
+
+/* Builds a fake sysfs cpu directory of a machine with 2 cache domains, each with
+ * 2 cores with 2 smt threads. Cpu 7 is offline and cpus 4 and 5 are isolated. */
+class CpuTopologyTest : public ::testing::Test
+{
+protected:
+    CpuTopologyTest() {}
+
+    void SetUp()
+    {
+        char root_template[] = "/tmp/twine_sysfs_XXXXXX";
+        ASSERT_NE(nullptr, mkdtemp(root_template));
+        _root = root_template;
+
+        _write("online", "0-6");
+        _write("isolated", "4-5");
+        _write("nohz_full", "(null)");
+        for (int cpu = 0; cpu < 7; ++cpu)
+        {
+            auto cpu_dir = "cpu" + std::to_string(cpu);
+            int core = cpu & ~1;
+            int domain = cpu & ~3;
+            _write(cpu_dir + "/topology/thread_siblings_list", std::to_string(core) + "-" + std::to_string(core + 1));
+            _write_cache(cpu_dir, 0, 1, "Data", std::to_string(core) + "-" + std::to_string(core + 1));
+            _write_cache(cpu_dir, 1, 1, "Instruction", std::to_string(core) + "-" + std::to_string(core + 1));
+            _write_cache(cpu_dir, 2, 3, "Unified", std::to_string(domain) + "-" + std::to_string(domain + 3));
+        }
+    }
+
+    void TearDown()
+    {
+        [[maybe_unused]] int res = std::system(("rm -rf " + _root).c_str());
+    }
+
+    void _write(const std::string& path, const std::string& contents)
+    {
+        size_t pos = 0;
+        while ((pos = path.find('/', pos)) != std::string::npos)
+        {
+            mkdir((_root + "/" + path.substr(0, pos)).c_str(), 0755);
+            pos++;
+        }
+        std::ofstream file(_root + "/" + path);
+        file << contents << "\n";
+    }
+
+    void _write_cache(const std::string& cpu_dir, int index, int level, const std::string& type, const std::string& cpus)
+    {
+        auto cache_dir = cpu_dir + "/cache/index" + std::to_string(index);
+        _write(cache_dir + "/level", std::to_string(level));
+        _write(cache_dir + "/type", type);
+        _write(cache_dir + "/shared_cpu_list", cpus);
+    }
+
+    std::string _root;
+};
+
+TEST_F(CpuTopologyTest, TestReadTopology)
+{
+    auto module_under_test = CpuTopology::read(_root, 2);
+    ASSERT_EQ(7, module_under_test.no_cpus());
+    ASSERT_TRUE(module_under_test.online(6));
+    ASSERT_FALSE(module_under_test.online(7));
+
+    ASSERT_EQ(2, module_under_test.core(3));
+    ASSERT_EQ(6, module_under_test.core(6));
+    ASSERT_EQ(-1, module_under_test.core(7));
+    ASSERT_EQ(0, module_under_test.cache_domain(3));
+    ASSERT_EQ(4, module_under_test.cache_domain(6));
+
+    ASSERT_FALSE(module_under_test.isolated(3));
+    ASSERT_TRUE(module_under_test.isolated(4));
+    ASSERT_TRUE(module_under_test.isolated(5));
+}
+
+TEST_F(CpuTopologyTest, TestMissingSysfs)
+{
+    auto module_under_test = CpuTopology::read(_root + "/not_there", 2);
+    ASSERT_EQ(2, module_under_test.no_cpus());
+    ASSERT_EQ(1, module_under_test.core(1));
+    ASSERT_EQ(1, module_under_test.cache_domain(1));
+    ASSERT_FALSE(module_under_test.isolated(0));
+}
+
+TEST_F(CpuTopologyTest, TestWorkerPlacement)
+{
+    auto topology = CpuTopology::read(_root, 2);
+    std::vector<int> usage(8, 0);
+    auto place = [&]()
+    {
+        int cpu = pick_worker_cpu(topology, usage);
+        usage[cpu]++;
+        return cpu;
+    };
+
+    /* Isolated cpus first */
+    ASSERT_EQ(4, place());
+    /* Then avoid the smt sibling of cpu 4, and spread unrelated workers over the
+     * cache domains */
+    ASSERT_EQ(0, place());
+    ASSERT_EQ(2, place());
+    ASSERT_EQ(6, place());
+    /* Only smt siblings left, isolated first, then cache domain with fewest workers */
+    ASSERT_EQ(5, place());
+    ASSERT_EQ(1, place());
+    ASSERT_EQ(3, place());
+    /* All cpus have a worker, cpu 6 is the only one without a busy sibling since
+     * cpu 7 is offline */
+    ASSERT_EQ(6, place());
+
+    /* Only cpus in range of the usage vector are considered */
+    std::vector<int> small_usage = {1, 0};
+    ASSERT_EQ(1, pick_worker_cpu(topology, small_usage));
+    ASSERT_EQ(-1, pick_worker_cpu(CpuTopology(0), small_usage));
+}
+
+TEST_F(CpuTopologyTest, TestCacheGroupPlacement)
+{
+    auto topology = CpuTopology::read(_root, 2);
+    std::vector<int> usage(8, 0);
+    std::vector<int> group_cpus;
+    usage[0] = 1;
+
+    /* Workers of a group are kept in the cache domain of the first one, on separate
+     * cores, rather than going to the lower numbered free cores of the other domain */
+    group_cpus.push_back(pick_worker_cpu(topology, usage, group_cpus));
+    ASSERT_EQ(4, group_cpus.back());
+    usage[4]++;
+    group_cpus.push_back(pick_worker_cpu(topology, usage, group_cpus));
+    ASSERT_EQ(6, group_cpus.back());
+    usage[6]++;
+
+    /* A worker outside the group goes to the domain with fewer workers */
+    ASSERT_EQ(2, pick_worker_cpu(topology, usage));
+
+    /* Only smt siblings left, where isolation still comes before the group */
+    usage[2]++;
+    ASSERT_EQ(5, pick_worker_cpu(topology, usage, group_cpus));
+}
+
+TEST_F(CpuTopologyTest, TestLoadBalancingWithTopology)
+{
+    using namespace std::chrono_literals;
+    LoadBalancer module_under_test(CpuTopology::read(_root, 2), 8);
+    std::array<LoadBalancer::Worker, 4> workers = {{{400ns, 0, false},
+                                                    {300ns, 0, false},
+                                                    {200ns, 1, false},
+                                                    {100ns, 1, false}}};
+    ASSERT_TRUE(module_under_test.rebalance(workers.data(), 4));
+    /* The heaviest worker goes to an isolated cpu, and no worker is put on the smt
+     * sibling of a busy cpu while there are idle cores */
+    ASSERT_EQ(4, workers[0].cpu);
+    ASSERT_EQ(0, workers[1].cpu);
+    ASSERT_EQ(2, workers[2].cpu);
+    ASSERT_EQ(6, workers[3].cpu);
+    ASSERT_FALSE(module_under_test.rebalance(workers.data(), 4));
+
+    /* Two workers on sibling cpus load their core as much as if on the same cpu */
+    std::array<LoadBalancer::Worker, 2> siblings = {{{100ns, 0, false},
+                                                     {100ns, 1, false}}};
+    ASSERT_TRUE(module_under_test.rebalance(siblings.data(), 2));
+    ASSERT_EQ(4, siblings[0].cpu);
+    ASSERT_EQ(1, siblings[1].cpu);
+}
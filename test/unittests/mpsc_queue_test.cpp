@@ -0,0 +1,126 @@
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "twine/twine.h"
+#include "counting_condition_variable.h"
+
+using namespace twine;
+
+constexpr int TEST_CAPACITY = 16;
+
+class MpscQueueTest : public ::testing::Test
+{
+protected:
+    MpscQueueTest() {}
+
+    CountingConditionVariable _notifier;
+    MpscQueue<int>            _module_under_test{TEST_CAPACITY - 1, &_notifier};
+};
+
+TEST_F(MpscQueueTest, TestPushAndPop)
+{
+    ASSERT_EQ(TEST_CAPACITY, _module_under_test.capacity());
+    ASSERT_TRUE(_module_under_test.empty());
+    int value = 0;
+    ASSERT_FALSE(_module_under_test.pop(value));
+
+    /* Go around the queue a few times */
+    for (int lap = 0; lap < 3; ++lap)
+    {
+        for (int i = 0; i < TEST_CAPACITY; ++i)
+        {
+            ASSERT_TRUE(_module_under_test.push(i));
+        }
+        ASSERT_FALSE(_module_under_test.push(TEST_CAPACITY));
+        ASSERT_EQ(TEST_CAPACITY, _module_under_test.size());
+
+        for (int i = 0; i < TEST_CAPACITY; ++i)
+        {
+            ASSERT_TRUE(_module_under_test.pop(value));
+            ASSERT_EQ(i, value);
+        }
+        ASSERT_FALSE(_module_under_test.pop(value));
+    }
+}
+
+TEST_F(MpscQueueTest, TestBatchedDrainAndNotification)
+{
+    _module_under_test.notify_consumer();
+    ASSERT_EQ(0, _notifier.notifications);
+
+    for (int i = 0; i < 5; ++i)
+    {
+        ASSERT_TRUE(_module_under_test.push(i));
+    }
+    _module_under_test.notify_consumer();
+    _module_under_test.notify_consumer();
+    ASSERT_EQ(1, _notifier.notifications);
+
+    std::array<int, 3> values;
+    ASSERT_EQ(3, _module_under_test.pop(values.data(), static_cast<int>(values.size())));
+    ASSERT_EQ(2, values[2]);
+    int sum = 0;
+    ASSERT_EQ(2, _module_under_test.drain([&](const int& value) { sum += value; }));
+    ASSERT_EQ(3 + 4, sum);
+
+    ASSERT_TRUE(_module_under_test.push(5));
+    _module_under_test.notify_consumer();
+    ASSERT_EQ(2, _notifier.notifications);
+}
+
+struct ProducerEvent
+{
+    int producer;
+    int index;
+};
+
+TEST(MpscQueueThreadTest, TestManyProducers)
+{
+    constexpr int PRODUCERS = 4;
+    constexpr int ELEMENTS = 20000;
+    MpscQueue<ProducerEvent> queue(128);
+    std::vector<std::thread> producers;
+    for (int p = 0; p < PRODUCERS; ++p)
+    {
+        producers.emplace_back([&, p]()
+        {
+            for (int i = 0; i < ELEMENTS; ++i)
+            {
+                while (queue.push({p, i}) == false)
+                {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    /* Elements from each producer must arrive in order */
+    std::array<int, PRODUCERS> expected{};
+    int received = 0;
+    int errors = 0;
+    while (received < PRODUCERS * ELEMENTS)
+    {
+        int popped = queue.drain([&](const ProducerEvent& element)
+        {
+            errors += element.index != expected[element.producer]++;
+        });
+        received += popped;
+        if (popped == 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+    for (auto& producer : producers)
+    {
+        producer.join();
+    }
+    ASSERT_EQ(0, errors);
+    ASSERT_TRUE(queue.empty());
+}
+
+TEST(MpscQueueCreationTest, TestInvalidCapacity)
+{
+    EXPECT_THROW(MpscQueue<int>(0), std::runtime_error);
+}
@@ -0,0 +1,76 @@
+#include <thread>
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "rt_logger.h"
+
+using namespace twine;
+
+std::string format_via_record(const char* format, ...)
+{
+    LogRecord record;
+    va_list args;
+    va_start(args, format);
+    store_arguments(record, format, args);
+    va_end(args);
+    std::array<char, MAX_LOG_LINE_LENGTH> buffer;
+    size_t length = format_record(record, buffer.data(), buffer.size());
+    return std::string(buffer.data(), length);
+}
+
+TEST(RtLoggerTest, TestFormatting)
+{
+    EXPECT_EQ("plain text", format_via_record("plain text"));
+    EXPECT_EQ("100% 5", format_via_record("100%% %d", 5));
+    EXPECT_EQ("-3 4294967295 ff 0X1F", format_via_record("%d %u %x %#X", -3, 4294967295u, 255, 31));
+    EXPECT_EQ("-9000000000 18000000000 7", format_via_record("%lld %lu %zu", -9000000000ll, 18000000000ul, size_t(7)));
+    EXPECT_EQ("  1.50|2.5e+00|3.25", format_via_record("%6.2f|%.1e|%Lg", 1.5, 2.5, 3.25l));
+    EXPECT_EQ("[   ab] c x", format_via_record("[%*s] %c %.*s", 5, "ab", 'c', 1, "xyz"));
+    EXPECT_EQ("(null)", format_via_record("%s", static_cast<const char*>(nullptr)));
+    EXPECT_EQ("bad %q", format_via_record("bad %q"));
+}
+
+TEST(RtLoggerTest, TestTruncation)
+{
+    std::string long_string(400, 'a');
+    std::string result = format_via_record("%s %d", long_string.c_str(), 5);
+    /* The string is cut to fit the record, and the int does not fit */
+    EXPECT_EQ(sizeof(LogRecord::payload) - 1, result.find(' '));
+    EXPECT_EQ(" [...]", result.substr(result.find(' ')));
+}
+
+TEST(RtLoggerTest, TestRtPrintf)
+{
+    testing::internal::CaptureStdout();
+    rt_printf("main %d\n", 1);
+    std::thread thread([]()
+    {
+        ThreadRtFlag rt_flag;
+        ASSERT_EQ(0, rt_printf("rt thread %s\n", "message"));
+    });
+    thread.join();
+    flush_rt_printf();
+    std::string output = testing::internal::GetCapturedStdout();
+    EXPECT_NE(std::string::npos, output.find("main 1\n"));
+    EXPECT_NE(std::string::npos, output.find("rt thread message\n"));
+}
+
+TEST(RtLoggerTest, TestDroppedMessages)
+{
+    testing::internal::CaptureStdout();
+    auto dropped = rt_printf_dropped_messages();
+    std::thread thread([]()
+    {
+        ThreadRtFlag rt_flag;
+        /* Logging faster than the background thread can write */
+        for (int i = 0; i < LOG_RECORDS_PER_THREAD * 4; ++i)
+        {
+            rt_printf("%d\n", i);
+        }
+    });
+    thread.join();
+    flush_rt_printf();
+    testing::internal::GetCapturedStdout();
+    EXPECT_GT(rt_printf_dropped_messages(), dropped);
+}
@@ -0,0 +1,163 @@
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "twine/twine.h"
+#include "counting_condition_variable.h"
+
+using namespace twine;
+
+constexpr int TEST_CAPACITY = 16;
+
+class SpscRingBufferTest : public ::testing::Test
+{
+protected:
+    SpscRingBufferTest() {}
+
+    CountingConditionVariable _notifier;
+    SpscRingBuffer<int>       _module_under_test{TEST_CAPACITY - 3, &_notifier};
+};
+
+TEST_F(SpscRingBufferTest, TestPushAndPop)
+{
+    ASSERT_EQ(TEST_CAPACITY, _module_under_test.capacity());
+    ASSERT_TRUE(_module_under_test.empty());
+    int value = 0;
+    ASSERT_FALSE(_module_under_test.pop(value));
+
+    for (int i = 0; i < TEST_CAPACITY; ++i)
+    {
+        ASSERT_TRUE(_module_under_test.push(i));
+    }
+    ASSERT_FALSE(_module_under_test.push(TEST_CAPACITY));
+    ASSERT_EQ(TEST_CAPACITY, _module_under_test.size());
+
+    for (int i = 0; i < TEST_CAPACITY; ++i)
+    {
+        ASSERT_TRUE(_module_under_test.pop(value));
+        ASSERT_EQ(i, value);
+    }
+    ASSERT_FALSE(_module_under_test.pop(value));
+}
+
+TEST_F(SpscRingBufferTest, TestBulkPushAndPopWrapAround)
+{
+    std::array<int, TEST_CAPACITY + 4> input;
+    std::array<int, TEST_CAPACITY + 4> output;
+    for (int i = 0; i < static_cast<int>(input.size()); ++i)
+    {
+        input[i] = i;
+    }
+    /* Move the indices to the middle of the ring so bulk operations wrap */
+    ASSERT_EQ(10, _module_under_test.push(input.data(), 10));
+    ASSERT_EQ(10, _module_under_test.pop(output.data(), 10));
+
+    ASSERT_EQ(TEST_CAPACITY, _module_under_test.push(input.data(), static_cast<int>(input.size())));
+    ASSERT_EQ(TEST_CAPACITY, _module_under_test.pop(output.data(), static_cast<int>(output.size())));
+    for (int i = 0; i < TEST_CAPACITY; ++i)
+    {
+        ASSERT_EQ(i, output[i]);
+    }
+    ASSERT_EQ(0, _module_under_test.pop(output.data(), static_cast<int>(output.size())));
+}
+
+TEST_F(SpscRingBufferTest, TestReserveAndCommit)
+{
+    ASSERT_EQ(12, _module_under_test.push(std::array<int, 12>().data(), 12));
+    ASSERT_EQ(12, _module_under_test.pop(std::array<int, 12>().data(), 12));
+
+    /* Only the contiguous space up to the end of the ring is returned */
+    auto [space, size] = _module_under_test.reserve(8);
+    ASSERT_EQ(4, size);
+    for (int i = 0; i < size; ++i)
+    {
+        space[i] = i;
+    }
+    _module_under_test.commit(size);
+    std::tie(space, size) = _module_under_test.reserve(8);
+    ASSERT_EQ(8, size);
+    space[0] = 4;
+    _module_under_test.commit(1);
+    ASSERT_EQ(5, _module_under_test.size());
+
+    auto [data, count] = _module_under_test.peek(10);
+    ASSERT_EQ(4, count);
+    ASSERT_EQ(0, data[0]);
+    ASSERT_EQ(3, data[3]);
+    _module_under_test.consume(count);
+    std::tie(data, count) = _module_under_test.peek(10);
+    ASSERT_EQ(1, count);
+    ASSERT_EQ(4, data[0]);
+    _module_under_test.consume(count);
+    ASSERT_TRUE(_module_under_test.empty());
+}
+
+TEST_F(SpscRingBufferTest, TestNotifyOnlyWhenEmpty)
+{
+    ASSERT_TRUE(_module_under_test.push(1));
+    ASSERT_EQ(1, _notifier.notifications);
+    ASSERT_TRUE(_module_under_test.push(2));
+    ASSERT_TRUE(_module_under_test.push(3));
+    ASSERT_EQ(1, _notifier.notifications);
+
+    int value;
+    while (_module_under_test.pop(value)) {}
+    ASSERT_TRUE(_module_under_test.push(4));
+    ASSERT_EQ(2, _notifier.notifications);
+
+    /* Not notified when the consumer has not emptied the ring */
+    ASSERT_TRUE(_module_under_test.push(5));
+    ASSERT_TRUE(_module_under_test.pop(value));
+    ASSERT_TRUE(_module_under_test.push(6));
+    ASSERT_EQ(2, _notifier.notifications);
+}
+
+TEST(SpscRingBufferThreadTest, TestProducerAndConsumerThreads)
+{
+    constexpr int ELEMENTS = 100000;
+    SpscRingBuffer<int> ring(64);
+    std::thread producer([&]()
+    {
+        std::array<int, 7> elements;
+        int next = 0;
+        while (next < ELEMENTS)
+        {
+            int count = std::min(static_cast<int>(elements.size()), ELEMENTS - next);
+            for (int i = 0; i < count; ++i)
+            {
+                elements[i] = next + i;
+            }
+            int pushed = ring.push(elements.data(), count);
+            if (pushed == 0)
+            {
+                std::this_thread::yield();
+            }
+            next += pushed;
+        }
+    });
+
+    int expected = 0;
+    int errors = 0;
+    while (expected < ELEMENTS)
+    {
+        auto [data, count] = ring.peek(ELEMENTS);
+        for (int i = 0; i < count; ++i)
+        {
+            errors += data[i] != expected++;
+        }
+        ring.consume(count);
+        if (count == 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+    ASSERT_EQ(0, errors);
+    ASSERT_TRUE(ring.empty());
+}
+
+TEST(SpscRingBufferCreationTest, TestInvalidCapacity)
+{
+    EXPECT_THROW(SpscRingBuffer<int>(0), std::runtime_error);
+    EXPECT_THROW(SpscRingBuffer<int>(-1), std::runtime_error);
+}
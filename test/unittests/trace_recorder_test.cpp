@@ -0,0 +1,112 @@
+#include <atomic>
+#include <thread>
+#include <string>
+#include <fstream>
+#include <sstream>
+
+#include "gtest/gtest.h"
+
+#include "trace_recorder.h"
+
+using namespace twine;
+
+std::string read_file(const char* file_name)
+{
+    std::ifstream file(file_name);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+TEST(TraceBufferTest, TestOverwriteOldest)
+{
+    TraceBuffer module_under_test(4);
+    for (int i = 0; i < 6; ++i)
+    {
+        module_under_test.record(TraceEventType::ZONE_BEGIN, "zone", i);
+    }
+    std::vector<TraceRecord> records;
+    module_under_test.snapshot(records, 0);
+    ASSERT_EQ(4u, records.size());
+    ASSERT_EQ(2, records.front().arg);
+    ASSERT_EQ(5, records.back().arg);
+    for (size_t i = 1; i < records.size(); ++i)
+    {
+        ASSERT_LE(records[i - 1].time, records[i].time);
+    }
+
+    /* Events before the start time are left out */
+    records.clear();
+    module_under_test.snapshot(records, current_rt_time().count() + 1);
+    ASSERT_TRUE(records.empty());
+}
+
+TEST(TraceBufferTest, TestSnapshotWhileRecording)
+{
+    const char* names[] = {"even", "odd"};
+    TraceBuffer module_under_test(4);
+    std::atomic_bool running{true};
+    std::thread writer([&]()
+    {
+        for (int i = 0; running; ++i)
+        {
+            module_under_test.record(TraceEventType::ZONE_BEGIN, names[i % 2], i);
+        }
+    });
+    /* Records that are being overwritten must never be returned half written */
+    std::vector<TraceRecord> records;
+    for (int n = 0; n < 10000; ++n)
+    {
+        records.clear();
+        module_under_test.snapshot(records, 0);
+        ASSERT_LE(records.size(), 4u);
+        for (size_t i = 0; i < records.size(); ++i)
+        {
+            ASSERT_EQ(names[records[i].arg % 2], records[i].name);
+            if (i > 0)
+            {
+                ASSERT_LT(records[i - 1].arg, records[i].arg);
+                ASSERT_LE(records[i - 1].time, records[i].time);
+            }
+        }
+    }
+    running = false;
+    writer.join();
+}
+
+TEST(TraceRecorderTest, TestZonesAndExport)
+{
+    const char* file_name = "twine_trace_test.json";
+    /* Not recorded when tracing is stopped */
+    {
+        TraceZone zone("not_recorded");
+    }
+    ASSERT_EQ(WorkerPoolStatus::INVALID_ARGUMENTS, start_tracing(0));
+    ASSERT_EQ(WorkerPoolStatus::OK, start_tracing(64));
+    {
+        TraceZone zone("outer \"zone\"");
+        TraceZone inner("inner_zone");
+    }
+    std::thread thread([]()
+    {
+        TraceZone zone("thread_zone");
+    });
+    thread.join();
+    stop_tracing();
+    {
+        TraceZone zone("after_stop");
+    }
+
+    ASSERT_EQ(WorkerPoolStatus::OK, write_trace(file_name));
+    std::string trace = read_file(file_name);
+    std::remove(file_name);
+    ASSERT_EQ(0u, trace.find("{\"displayTimeUnit\":\"ns\",\"traceEvents\":["));
+    EXPECT_NE(std::string::npos, trace.find("{\"name\":\"outer \\\"zone\\\"\",\"ph\":\"B\""));
+    EXPECT_NE(std::string::npos, trace.find("{\"name\":\"inner_zone\",\"ph\":\"E\""));
+    EXPECT_NE(std::string::npos, trace.find("{\"name\":\"thread_zone\",\"ph\":\"B\""));
+    EXPECT_EQ(std::string::npos, trace.find("not_recorded"));
+    EXPECT_EQ(std::string::npos, trace.find("after_stop"));
+    EXPECT_EQ(trace.size() - 4, trace.rfind("\n]}\n"));
+
+    ASSERT_NE(WorkerPoolStatus::OK, write_trace("/nonexistent_directory/trace.json"));
+}
@@ -7,6 +7,12 @@
 
 using namespace twine;
 
+#ifdef __GLIBC__
+/* The glibc defaults, see mallopt(3) */
+constexpr int DEFAULT_MALLOC_TRIM_THRESHOLD = 128 * 1024;
+constexpr int DEFAULT_MALLOC_MMAP_MAX = 65536;
+#endif
+
 TEST (TwineTest, TestThreadRtFlag)
 {
     ASSERT_FALSE(is_current_thread_realtime());
@@ -34,4 +40,22 @@ TEST (TwineTest, TestVersionAndBuildInfo)
     EXPECT_EQ(TWINE__VERSION_MIN, version.minor);
     EXPECT_EQ(TWINE__VERSION_REV, version.revision);
     EXPECT_GT(strlen(twine::build_info()), 100u);
-}
\ No newline at end of file
+}
+
+TEST (TwineTest, TestLockAndPrefaultMemory)
+{
+    auto res = lock_and_prefault_memory(1024 * 1024);
+    if (res == WorkerPoolStatus::PERMISSION_DENIED || res == WorkerPoolStatus::LIMIT_EXCEEDED)
+    {
+        /* Locking memory needs CAP_IPC_LOCK or a large enough RLIMIT_MEMLOCK */
+        GTEST_SKIP() << "Not allowed to lock memory";
+    }
+    /* Don't keep the rest of the tests locked in memory, or running with the malloc
+     * settings for locked memory */
+    munlockall();
+#ifdef __GLIBC__
+    mallopt(M_TRIM_THRESHOLD, DEFAULT_MALLOC_TRIM_THRESHOLD);
+    mallopt(M_MMAP_MAX, DEFAULT_MALLOC_MMAP_MAX);
+#endif
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+}
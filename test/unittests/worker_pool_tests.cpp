@@ -1,6 +1,8 @@
 #include <thread>
 #include <functional>
 #include <iostream>
+#include <fstream>
+#include <limits>
 
 #include "gtest/gtest.h"
 
@@ -11,11 +13,12 @@ using namespace twine;
 
 constexpr int N_TEST_WORKERS = 4;
 
-void test_function(std::atomic_bool& running, std::atomic_bool& flag, BarrierWithTrigger<ThreadType::PTHREAD>(& barrier))
+template <typename BarrierType>
+void test_function(std::atomic_bool& running, std::atomic_bool& flag, BarrierType& barrier, int index)
 {
     while (running)
     {
-        barrier.wait();
+        barrier.wait(index);
         flag = true;
     }
 }
@@ -28,8 +31,8 @@ TEST (BarrierTest, TestBarrierWithTrigger)
 
     BarrierWithTrigger<ThreadType::PTHREAD> module_under_test;
     module_under_test.set_no_threads(2);
-    std::thread t1(test_function, std::ref(running), std::ref(a), std::ref(module_under_test));
-    std::thread t2(test_function, std::ref(running), std::ref(b), std::ref(module_under_test));
+    std::thread t1(test_function<decltype(module_under_test)>, std::ref(running), std::ref(a), std::ref(module_under_test), 0);
+    std::thread t2(test_function<decltype(module_under_test)>, std::ref(running), std::ref(b), std::ref(module_under_test), 1);
     /* threads should start in wait mode */
     module_under_test.wait_for_all();
     ASSERT_FALSE(a);
@@ -57,6 +60,432 @@ TEST (BarrierTest, TestBarrierWithTrigger)
     t2.join();
 }
 
+template <typename BarrierType>
+void test_selective_release()
+{
+    std::atomic_bool a = false;
+    std::atomic_bool b = false;
+    std::atomic_bool running = true;
+
+    BarrierType module_under_test;
+    module_under_test.set_no_threads(2);
+    std::thread t1(test_function<BarrierType>, std::ref(running), std::ref(a), std::ref(module_under_test), 0);
+    std::thread t2(test_function<BarrierType>, std::ref(running), std::ref(b), std::ref(module_under_test), 1);
+    module_under_test.wait_for_all();
+
+    /* Only the selected thread should run */
+    module_under_test.release_and_wait(0b10);
+    ASSERT_FALSE(a);
+    ASSERT_TRUE(b);
+
+    b = false;
+    module_under_test.release(0b01);
+    module_under_test.wait_for_all();
+    ASSERT_TRUE(a);
+    ASSERT_FALSE(b);
+
+    /* Releasing no threads, or only threads that don't exist, is a no-op */
+    a = false;
+    module_under_test.release_and_wait(0b100);
+    ASSERT_FALSE(a);
+    ASSERT_FALSE(b);
+
+    running = false;
+    module_under_test.release_all();
+
+    t1.join();
+    t2.join();
+}
+
+template <typename BarrierType>
+void test_deadline_wait()
+{
+    using namespace std::chrono_literals;
+    std::atomic_bool a = false;
+    std::atomic_bool running = true;
+    std::atomic_bool stall = true;
+
+    BarrierType module_under_test;
+    module_under_test.set_no_threads(2);
+    std::thread t1(test_function<BarrierType>, std::ref(running), std::ref(a), std::ref(module_under_test), 0);
+    std::thread t2([&]()
+    {
+        while (running)
+        {
+            module_under_test.wait(1);
+            while (stall)
+            {
+                std::this_thread::yield();
+            }
+        }
+    });
+    ASSERT_TRUE(module_under_test.wait_for_all_until(current_rt_time() + 1s));
+    ASSERT_TRUE(module_under_test.all_arrived());
+
+    /* Thread 1 stalls and misses the deadline */
+    module_under_test.release_all();
+    ASSERT_FALSE(module_under_test.wait_for_all_until(current_rt_time() + 1ms));
+    ASSERT_FALSE(module_under_test.all_arrived());
+    ASSERT_EQ(0b10u, module_under_test.running_threads());
+    ASSERT_TRUE(a);
+
+    stall = false;
+    ASSERT_TRUE(module_under_test.wait_for_all_until(current_rt_time() + 1s));
+    ASSERT_EQ(0u, module_under_test.running_threads());
+
+    running = false;
+    module_under_test.release_all();
+
+    t1.join();
+    t2.join();
+}
+
+TEST (BarrierTest, TestIndependentBarriers)
+{
+    std::atomic_bool a = false;
+    std::atomic_bool b = false;
+    std::atomic_bool running = true;
+
+    /* Each barrier must have its own semaphores */
+    BarrierWithTrigger<ThreadType::PTHREAD> barrier_1;
+    BarrierWithTrigger<ThreadType::PTHREAD> barrier_2;
+    barrier_1.set_no_threads(1);
+    barrier_2.set_no_threads(1);
+    std::thread t1(test_function<decltype(barrier_1)>, std::ref(running), std::ref(a), std::ref(barrier_1), 0);
+    std::thread t2(test_function<decltype(barrier_2)>, std::ref(running), std::ref(b), std::ref(barrier_2), 0);
+    barrier_1.wait_for_all();
+    barrier_2.wait_for_all();
+
+    barrier_1.release_and_wait();
+    ASSERT_TRUE(a);
+    ASSERT_FALSE(b);
+
+    a = false;
+    barrier_2.release_and_wait();
+    ASSERT_FALSE(a);
+    ASSERT_TRUE(b);
+
+    running = false;
+    barrier_1.release_all();
+    barrier_2.release_all();
+
+    t1.join();
+    t2.join();
+}
+
+TEST (BarrierTest, TestBarrierWithTriggerSelectiveRelease)
+{
+    test_selective_release<BarrierWithTrigger<ThreadType::PTHREAD>>();
+}
+
+TEST (BarrierTest, TestBarrierWithTriggerDeadlineWait)
+{
+    test_deadline_wait<BarrierWithTrigger<ThreadType::PTHREAD>>();
+}
+
+#ifdef TWINE_HAS_FUTEX
+TEST (BarrierTest, TestFutexBarrierSelectiveRelease)
+{
+    test_selective_release<FutexBarrier>();
+}
+
+TEST (BarrierTest, TestFutexBarrierDeadlineWait)
+{
+    test_deadline_wait<FutexBarrier>();
+}
+
+TEST (BarrierTest, TestFutexBarrier)
+{
+    std::atomic_bool a = false;
+    std::atomic_bool b = false;
+    std::atomic_bool running = true;
+
+    FutexBarrier module_under_test;
+    module_under_test.set_no_threads(2);
+    std::thread t1(test_function<FutexBarrier>, std::ref(running), std::ref(a), std::ref(module_under_test), 0);
+    std::thread t2(test_function<FutexBarrier>, std::ref(running), std::ref(b), std::ref(module_under_test), 1);
+    /* threads should start in wait mode */
+    module_under_test.wait_for_all();
+    ASSERT_FALSE(a);
+    ASSERT_FALSE(b);
+
+    module_under_test.release_all();
+    module_under_test.wait_for_all();
+    ASSERT_TRUE(a);
+    ASSERT_TRUE(b);
+
+    a = false;
+    b = false;
+    module_under_test.release_and_wait();
+    ASSERT_TRUE(a);
+    ASSERT_TRUE(b);
+
+    running = false;
+    module_under_test.release_all();
+
+    t1.join();
+    t2.join();
+}
+
+TEST (BarrierTest, TestFutexBarrierRepeatedCycles)
+{
+    constexpr int CYCLES = 2000;
+    constexpr int THREADS = 3;
+    std::atomic_bool running = true;
+    std::array<int, THREADS> counters{};
+    std::atomic<std::chrono::nanoseconds> spin_time{std::chrono::nanoseconds(0)};
+
+    FutexBarrier module_under_test;
+    module_under_test.set_no_threads(THREADS);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < THREADS; ++i)
+    {
+        threads.emplace_back([&, i]()
+        {
+            while (true)
+            {
+                module_under_test.wait(i, spin_time.load());
+                if (running == false)
+                {
+                    break;
+                }
+                counters[i]++;
+            }
+        });
+    }
+    module_under_test.wait_for_all();
+    for (int i = 0; i < CYCLES; ++i)
+    {
+        module_under_test.release_and_wait();
+    }
+    for (auto c : counters)
+    {
+        ASSERT_EQ(CYCLES, c);
+    }
+
+    /* Spinning waits should not miss any releases either */
+    for (auto& c : counters)
+    {
+        c = 0;
+    }
+    spin_time = std::chrono::microseconds(20);
+    module_under_test.release_and_wait();
+    for (int i = 0; i < CYCLES; ++i)
+    {
+        module_under_test.release_and_wait();
+    }
+    for (auto c : counters)
+    {
+        ASSERT_EQ(CYCLES + 1, c);
+    }
+
+    running = false;
+    module_under_test.release_all();
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+}
+#endif
+
+TEST (WorkStealingQueueTest, TestPushPopSteal)
+{
+    WorkStealingQueue module_under_test(4);
+    ASSERT_EQ(NO_TASK, module_under_test.pop());
+    ASSERT_EQ(NO_TASK, module_under_test.steal());
+
+    ASSERT_TRUE(module_under_test.push(1));
+    ASSERT_TRUE(module_under_test.push(2));
+    ASSERT_TRUE(module_under_test.push(3));
+    ASSERT_TRUE(module_under_test.push(4));
+    ASSERT_FALSE(module_under_test.push(5));
+
+    /* Owner pops from the bottom, thieves steal from the top */
+    ASSERT_EQ(4, module_under_test.pop());
+    ASSERT_EQ(1, module_under_test.steal());
+    ASSERT_EQ(2, module_under_test.steal());
+    ASSERT_EQ(3, module_under_test.pop());
+    ASSERT_EQ(NO_TASK, module_under_test.pop());
+    ASSERT_EQ(NO_TASK, module_under_test.steal());
+
+    /* Indexes wrap around the buffer */
+    for (int i = 0; i < 10; ++i)
+    {
+        ASSERT_TRUE(module_under_test.push(i));
+        ASSERT_EQ(i, module_under_test.steal());
+    }
+}
+
+TEST (WorkStealingQueueTest, TestConcurrentStealing)
+{
+    constexpr int TASKS = 1024;
+    WorkStealingQueue module_under_test(TASKS);
+    std::vector<std::atomic_int> taken(TASKS);
+    for (int i = 0; i < TASKS; ++i)
+    {
+        module_under_test.push(i);
+    }
+    auto thief = [&]()
+    {
+        while (true)
+        {
+            int task = module_under_test.steal();
+            if (task == NO_TASK)
+            {
+                break;
+            }
+            if (task >= 0)
+            {
+                taken[task]++;
+            }
+        }
+    };
+    std::thread t1(thief);
+    std::thread t2(thief);
+    while (true)
+    {
+        int task = module_under_test.pop();
+        if (task == NO_TASK)
+        {
+            break;
+        }
+        taken[task]++;
+    }
+    t1.join();
+    t2.join();
+    for (auto& t : taken)
+    {
+        ASSERT_EQ(1, t);
+    }
+}
+
+void counting_task(void* data)
+{
+    reinterpret_cast<std::atomic_int*>(data)->fetch_add(1);
+}
+
+TEST (TaskSchedulerTest, TestTaskAffinity)
+{
+    std::atomic_int counter = 0;
+    TaskScheduler module_under_test;
+    module_under_test.set_no_workers(2);
+    for (int i = 0; i < 4; ++i)
+    {
+        ASSERT_EQ(WorkerPoolStatus::OK, module_under_test.submit(counting_task, &counter));
+    }
+    ASSERT_TRUE(module_under_test.distribute());
+    /* Let worker 1 run every task, including those queued to worker 0 */
+    module_under_test.run_tasks(1);
+    ASSERT_EQ(4, counter);
+    module_under_test.clear();
+
+    /* Next cycle the same tasks should be queued to worker 1 */
+    for (int i = 0; i < 4; ++i)
+    {
+        ASSERT_EQ(WorkerPoolStatus::OK, module_under_test.submit(counting_task, &counter));
+    }
+    ASSERT_TRUE(module_under_test.distribute());
+    ASSERT_EQ(NO_TASK, module_under_test._queues[0]->pop());
+    module_under_test.run_tasks(1);
+    ASSERT_EQ(8, counter);
+}
+
+TEST (LoadBalancerTest, TestRebalance)
+{
+    using namespace std::chrono_literals;
+    LoadBalancer module_under_test(CpuTopology(3), 3);
+    std::array<LoadBalancer::Worker, 4> workers = {{{300ns, 0, false},
+                                                    {200ns, 0, false},
+                                                    {100ns, 0, false},
+                                                    {100ns, 1, true}}};
+    ASSERT_TRUE(module_under_test.rebalance(workers.data(), 4));
+    /* The heaviest worker stays, the rest goes where the load is lowest */
+    ASSERT_EQ(0, workers[0].cpu);
+    ASSERT_EQ(2, workers[1].cpu);
+    ASSERT_EQ(1, workers[2].cpu);
+    ASSERT_EQ(1, workers[3].cpu);
+
+    /* Already balanced */
+    ASSERT_FALSE(module_under_test.rebalance(workers.data(), 4));
+    ASSERT_FALSE(module_under_test.rebalance(workers.data(), 0));
+
+    /* Moving would only lower the maximum load from 110 to 105, below the hysteresis */
+    LoadBalancer two_cpus(CpuTopology(2), 2);
+    std::array<LoadBalancer::Worker, 3> close_workers = {{{100ns, 0, false},
+                                                          {10ns, 0, false},
+                                                          {95ns, 1, false}}};
+    ASSERT_FALSE(two_cpus.rebalance(close_workers.data(), 3));
+    ASSERT_EQ(0, close_workers[1].cpu);
+}
+
+TEST (TimingRecorderTest, TestSnapshot)
+{
+    using namespace std::chrono_literals;
+    TimingRecorder module_under_test;
+    module_under_test.reset(90us);
+    WorkerTimingStats stats;
+    module_under_test.snapshot(stats);
+    ASSERT_EQ(0u, stats.cycles);
+
+    for (int i = 1; i <= 100; ++i)
+    {
+        module_under_test.record(i * 10ns, i * 1us);
+    }
+    module_under_test.snapshot(stats);
+    ASSERT_EQ(100u, stats.cycles);
+    ASSERT_EQ(10u, stats.overruns);
+    ASSERT_EQ(1us, stats.duration.min);
+    ASSERT_EQ(100us, stats.duration.max);
+    ASSERT_EQ(50500ns, stats.duration.mean);
+    ASSERT_EQ(50us, stats.duration.p50);
+    ASSERT_EQ(99us, stats.duration.p99);
+    ASSERT_EQ(10ns, stats.wake_offset.min);
+    ASSERT_EQ(1000ns, stats.wake_offset.max);
+    std::array<int, TIMING_HISTOGRAM_BINS> histogram = {0, 1, 2, 4, 8, 16, 32, 37};
+    ASSERT_EQ(histogram, stats.duration_histogram);
+
+    /* Only the last cycles are in the window */
+    for (int i = 0; i < TIMING_WINDOW_CYCLES; ++i)
+    {
+        module_under_test.record(0ns, 5us);
+    }
+    module_under_test.snapshot(stats);
+    ASSERT_EQ(100u + TIMING_WINDOW_CYCLES, stats.cycles);
+    ASSERT_EQ(10u, stats.overruns);
+    ASSERT_EQ(5us, stats.duration.min);
+    ASSERT_EQ(5us, stats.duration.max);
+    ASSERT_EQ(TIMING_WINDOW_CYCLES, stats.duration_histogram[3]);
+}
+
+TEST (ScratchArenaTest, TestAllocate)
+{
+    ScratchArena module_under_test;
+    ASSERT_EQ(nullptr, module_under_test.allocate(16, 8));
+    ASSERT_EQ(0, module_under_test.init(1000, false));
+    ASSERT_GE(module_under_test.capacity(), 1000u);
+    size_t capacity = module_under_test.capacity();
+
+    auto first = static_cast<char*>(module_under_test.allocate(3, 1));
+    ASSERT_NE(nullptr, first);
+    auto second = static_cast<char*>(module_under_test.allocate(64, 64));
+    ASSERT_NE(nullptr, second);
+    ASSERT_EQ(0u, reinterpret_cast<uintptr_t>(second) % 64);
+    ASSERT_EQ(64, second - first);
+    ASSERT_EQ(nullptr, module_under_test.allocate(8, 3));
+    ASSERT_EQ(nullptr, module_under_test.allocate(capacity, 1));
+
+    /* All memory is available again after a reset */
+    module_under_test.reset();
+    ASSERT_EQ(0u, module_under_test.used());
+    ASSERT_EQ(first, module_under_test.allocate(capacity, 1));
+    ASSERT_EQ(nullptr, module_under_test.allocate(1, 1));
+
+    /* Works with or without huge pages available */
+    ASSERT_EQ(0, module_under_test.init(1000, true));
+    ASSERT_EQ(HUGE_PAGE_SIZE, module_under_test.capacity());
+    ASSERT_NE(nullptr, module_under_test.allocate(HUGE_PAGE_SIZE, 64));
+}
+
 class PthreadWorkerPoolTest : public ::testing::Test
 {
 protected:
@@ -117,6 +546,642 @@ TEST_F(PthreadWorkerPoolTest, TestSetPriority)
 }
 #endif
 
+TEST_F(PthreadWorkerPoolTest, TestSpinTime)
+{
+    ASSERT_EQ(WorkerPoolStatus::INVALID_ARGUMENTS, _module_under_test.set_spin_time(std::chrono::microseconds(-1)));
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.set_spin_time(std::chrono::microseconds(50)));
+
+    auto res = _module_under_test.add_worker(worker_function, &a);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+    for (int i = 0; i < 10; ++i)
+    {
+        a = false;
+        _module_under_test.wakeup_and_wait();
+        ASSERT_TRUE(a);
+    }
+    /* Workers should have stopped spinning and parked after this */
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    a = false;
+    _module_under_test.wakeup_and_wait();
+    ASSERT_TRUE(a);
+}
+
+struct GraphTestJob
+{
+    std::atomic_int* counter;
+    int order{-1};
+};
+
+void graph_job_function(void* data)
+{
+    auto job = reinterpret_cast<GraphTestJob*>(data);
+    job->order = job->counter->fetch_add(1);
+}
+
+TEST_F(PthreadWorkerPoolTest, TestJobGraph)
+{
+    std::atomic_int counter = 0;
+    std::array<GraphTestJob, 6> jobs;
+    for (auto& j : jobs)
+    {
+        j.counter = &counter;
+    }
+    auto res = _module_under_test.add_worker(worker_function, &a);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+    res = _module_under_test.add_worker(worker_function, &b);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+
+    /* Tracks -> buses -> master style graph */
+    auto [status_0, track_0] = _module_under_test.add_graph_job(graph_job_function, &jobs[0]);
+    auto [status_1, track_1] = _module_under_test.add_graph_job(graph_job_function, &jobs[1]);
+    auto [status_2, track_2] = _module_under_test.add_graph_job(graph_job_function, &jobs[2]);
+    auto [status_3, bus_0] = _module_under_test.add_graph_job(graph_job_function, &jobs[3], {track_0, track_1});
+    auto [status_4, bus_1] = _module_under_test.add_graph_job(graph_job_function, &jobs[4], {track_2});
+    auto [status_5, master] = _module_under_test.add_graph_job(graph_job_function, &jobs[5], {bus_0, bus_1});
+    for (auto status : std::array{status_0, status_1, status_2, status_3, status_4, status_5})
+    {
+        ASSERT_EQ(WorkerPoolStatus::OK, status);
+    }
+    ASSERT_EQ(5, master);
+
+    for (int i = 0; i < 10; ++i)
+    {
+        counter = 0;
+        ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.run_graph());
+        ASSERT_EQ(6, counter);
+        EXPECT_GT(jobs[bus_0].order, jobs[track_0].order);
+        EXPECT_GT(jobs[bus_0].order, jobs[track_1].order);
+        EXPECT_GT(jobs[bus_1].order, jobs[track_2].order);
+        EXPECT_EQ(5, jobs[master].order);
+    }
+    /* Worker callbacks should not have been called by the graph */
+    ASSERT_FALSE(a);
+    ASSERT_FALSE(b);
+
+    /* But should be on regular cycles */
+    _module_under_test.wakeup_and_wait();
+    ASSERT_TRUE(a);
+    ASSERT_TRUE(b);
+
+    _module_under_test.clear_graph();
+    counter = 0;
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.run_graph());
+    ASSERT_EQ(0, counter);
+}
+
+TEST_F(PthreadWorkerPoolTest, TestJobGraphErrors)
+{
+    int dummy;
+    ASSERT_EQ(WorkerPoolStatus::INVALID_ARGUMENTS, _module_under_test.add_graph_job(worker_function, &dummy, {0}).first);
+    ASSERT_EQ(WorkerPoolStatus::INVALID_ARGUMENTS, _module_under_test.add_graph_job(nullptr, &dummy).first);
+    auto [status, id] = _module_under_test.add_graph_job(worker_function, &dummy);
+    ASSERT_EQ(WorkerPoolStatus::OK, status);
+    ASSERT_EQ(0, id);
+    ASSERT_EQ(WorkerPoolStatus::INVALID_ARGUMENTS, _module_under_test.add_graph_job(worker_function, &dummy, {1}).first);
+    /* No workers to run the graph */
+    ASSERT_EQ(WorkerPoolStatus::ERROR, _module_under_test.run_graph());
+}
+
+TEST_F(PthreadWorkerPoolTest, TestTasks)
+{
+    constexpr int TASKS = 100;
+    std::array<std::atomic_int, TASKS> counters{};
+    /* No workers to run tasks */
+    ASSERT_EQ(WorkerPoolStatus::ERROR, _module_under_test.submit_task(counting_task, &counters[0]));
+
+    auto res = _module_under_test.add_worker(worker_function, &a);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+    res = _module_under_test.add_worker(worker_function, &b);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+
+    for (int cycle = 1; cycle <= 10; ++cycle)
+    {
+        for (auto& c : counters)
+        {
+            ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.submit_task(counting_task, &c));
+        }
+        ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.run_tasks());
+        for (auto& c : counters)
+        {
+            ASSERT_EQ(cycle, c);
+        }
+    }
+    ASSERT_FALSE(a);
+    ASSERT_FALSE(b);
+
+    for (int i = 0; i < MAX_TASKS_PER_CYCLE; ++i)
+    {
+        ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.submit_task(counting_task, &counters[0]));
+    }
+    ASSERT_EQ(WorkerPoolStatus::LIMIT_EXCEEDED, _module_under_test.submit_task(counting_task, &counters[0]));
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.run_tasks());
+    ASSERT_EQ(10 + MAX_TASKS_PER_CYCLE, counters[0]);
+}
+
+TEST_F(PthreadWorkerPoolTest, TestTasksAfterRemovingWorker)
+{
+    constexpr int TASKS = 12;
+    std::array<std::atomic_int, TASKS> counters{};
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.add_worker(worker_function, &a));
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.add_worker(worker_function, &b));
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.add_worker(worker_function, &a));
+
+    /* Every task runs once, also when the worker with the last rank is removed after
+     * the tasks were submitted, and no task is left behind for the next cycle */
+    for (auto& c : counters)
+    {
+        ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.submit_task(counting_task, &c));
+    }
+    std::thread remover([&]()
+    {
+        ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.remove_worker(2));
+    });
+    while (_module_under_test._pending_changes != 0b100)
+    {
+        std::this_thread::yield();
+    }
+    /* The removal is applied at the start of this cycle */
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.run_tasks());
+    remover.join();
+    ASSERT_EQ(2, _module_under_test._no_workers);
+    for (auto& c : counters)
+    {
+        ASSERT_EQ(1, c);
+    }
+
+    /* Same when the calling thread stops participating */
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.set_caller_participation(true));
+    for (auto& c : counters)
+    {
+        ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.submit_task(counting_task, &c));
+    }
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.set_caller_participation(false));
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.run_tasks());
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.submit_task(counting_task, &counters[0]));
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.run_tasks());
+    ASSERT_EQ(3, counters[0]);
+    for (int i = 1; i < TASKS; ++i)
+    {
+        ASSERT_EQ(2, counters[i]);
+    }
+
+    /* No workers left to run the submitted tasks */
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.submit_task(counting_task, &counters[0]));
+    std::thread remover_0([&]()
+    {
+        ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.remove_worker(0));
+    });
+    std::thread remover_1([&]()
+    {
+        ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.remove_worker(1));
+    });
+    while (_module_under_test._pending_changes != 0b11)
+    {
+        std::this_thread::yield();
+    }
+    ASSERT_EQ(WorkerPoolStatus::ERROR, _module_under_test.run_tasks());
+    remover_0.join();
+    remover_1.join();
+    ASSERT_EQ(3, counters[0]);
+    ASSERT_EQ(0, _module_under_test._state.task_scheduler.no_tasks());
+}
+
+TEST_F(PthreadWorkerPoolTest, TestParallelFor)
+{
+    constexpr int RANGE = 1000;
+    std::array<int, RANGE> values{};
+    auto fill = [&](int begin, int end)
+    {
+        for (int i = begin; i < end; ++i)
+        {
+            values[i] += i;
+        }
+    };
+    /* No workers to run on */
+    ASSERT_EQ(WorkerPoolStatus::ERROR, _module_under_test.parallel_for(0, RANGE, 10, fill));
+
+    auto res = _module_under_test.add_worker(worker_function, &a);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+    res = _module_under_test.add_worker(worker_function, &b);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+
+    ASSERT_EQ(WorkerPoolStatus::INVALID_ARGUMENTS, _module_under_test.parallel_for(0, RANGE, 0, fill));
+    ASSERT_EQ(WorkerPoolStatus::INVALID_ARGUMENTS, _module_under_test.parallel_for(RANGE, 0, 10, fill));
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.parallel_for(10, 10, 10, fill));
+
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.parallel_for(0, RANGE, 7, fill, ChunkScheduling::DYNAMIC));
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.parallel_for(0, RANGE, 64, fill, ChunkScheduling::STATIC));
+    for (int i = 0; i < RANGE; ++i)
+    {
+        ASSERT_EQ(2 * i, values[i]);
+    }
+    ASSERT_FALSE(a);
+    ASSERT_FALSE(b);
+
+    /* Ranges and grains close to the limits of int, where the chunk arithmetic
+     * would overflow in int */
+    constexpr int MAX = std::numeric_limits<int>::max();
+    constexpr int MIN = std::numeric_limits<int>::min();
+    std::atomic<int64_t> covered{0};
+    auto count = [&](int begin, int end)
+    {
+        ASSERT_LT(begin, end);
+        covered += static_cast<int64_t>(end) - begin;
+    };
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.parallel_for(MAX - 100, MAX, 7, count));
+    ASSERT_EQ(100, covered);
+    covered = 0;
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.parallel_for(MIN, MAX, MAX, count, ChunkScheduling::STATIC));
+    ASSERT_EQ(static_cast<int64_t>(MAX) - MIN, covered);
+    covered = 0;
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.parallel_for(0, 10, MAX, count));
+    ASSERT_EQ(10, covered);
+}
+
+TEST_F(PthreadWorkerPoolTest, TestParallelInvoke)
+{
+    auto res = _module_under_test.add_worker(worker_function, &a);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+    res = _module_under_test.add_worker(worker_function, &b);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+
+    int x = 0;
+    float y = 0;
+    bool z = false;
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.parallel_invoke([&]() {x = 5;},
+                                                                       [&]() {y = 2.5f;},
+                                                                       [&]() {z = true;}));
+    ASSERT_EQ(5, x);
+    ASSERT_FLOAT_EQ(2.5f, y);
+    ASSERT_TRUE(z);
+}
+
+TEST_F(PthreadWorkerPoolTest, TestCallerParticipation)
+{
+    // Without workers, only a participating caller can run cycles
+    ASSERT_EQ(WorkerPoolStatus::ERROR, _module_under_test.parallel_for(0, 4, 1, [](int, int) {}));
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.set_caller_participation(true));
+
+    int sum = 0;
+    auto callback = [](void* data) {(*reinterpret_cast<int*>(data))++;};
+    for (int i = 0; i < 10; ++i)
+    {
+        ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.submit_task(callback, &sum));
+    }
+    _module_under_test.run_tasks();
+    ASSERT_EQ(10, sum);
+
+    auto [status, id] = _module_under_test.add_graph_job(callback, &sum);
+    ASSERT_EQ(WorkerPoolStatus::OK, status);
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.add_graph_job(callback, &sum, {id}).first);
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.run_graph());
+    ASSERT_EQ(12, sum);
+
+    // With static scheduling, every other chunk goes to the calling thread
+    auto res = _module_under_test.add_worker(worker_function, &a);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+    std::array<std::thread::id, 4> chunk_threads;
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.parallel_for(0, 4, 1, [&](int begin, int)
+    {
+        chunk_threads[begin] = std::this_thread::get_id();
+    }, ChunkScheduling::STATIC));
+    ASSERT_NE(std::this_thread::get_id(), chunk_threads[0]);
+    ASSERT_EQ(std::this_thread::get_id(), chunk_threads[1]);
+    ASSERT_EQ(chunk_threads[0], chunk_threads[2]);
+    ASSERT_EQ(std::this_thread::get_id(), chunk_threads[3]);
+
+    // Regular cycles run the caller callback on the calling thread
+    std::thread::id caller_id;
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.set_caller_participation(true, [](void* data)
+    {
+        *reinterpret_cast<std::thread::id*>(data) = std::this_thread::get_id();
+    }, &caller_id));
+    a = false;
+    _module_under_test.wakeup_and_wait();
+    ASSERT_TRUE(a);
+    ASSERT_EQ(std::this_thread::get_id(), caller_id);
+}
+
+TEST_F(PthreadWorkerPoolTest, TestSelectiveWakeup)
+{
+    auto res = _module_under_test.add_worker(worker_function, &a);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+    res = _module_under_test.add_worker(worker_function, &b);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+
+    _module_under_test.wakeup_and_wait(0b10);
+    ASSERT_FALSE(a);
+    ASSERT_TRUE(b);
+
+    b = false;
+    _module_under_test.wakeup_workers(0b01);
+    _module_under_test.wait_for_workers_idle();
+    ASSERT_TRUE(a);
+    ASSERT_FALSE(b);
+
+    a = false;
+    _module_under_test.wakeup_and_wait(ALL_WORKERS);
+    ASSERT_TRUE(a);
+    ASSERT_TRUE(b);
+}
+
+TEST_F(PthreadWorkerPoolTest, TestDeadlineWakeup)
+{
+    using namespace std::chrono_literals;
+    std::atomic_bool stall = true;
+    auto stalling_worker = [](void* data)
+    {
+        while (*reinterpret_cast<std::atomic_bool*>(data))
+        {
+            // Don't starve the test thread of cpu time, the worker runs with rt priority
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    };
+    auto res = _module_under_test.add_worker(worker_function, &a);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+    res = _module_under_test.add_worker(stalling_worker, &stall);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+
+    auto [status, late_workers] = _module_under_test.wakeup_and_wait_until(current_rt_time() + 1ms);
+    ASSERT_EQ(WorkerPoolStatus::OK, status);
+    ASSERT_EQ(0b10u, late_workers);
+    ASSERT_TRUE(a);
+
+    /* Nothing can be woken up until the late worker is done */
+    a = false;
+    ASSERT_EQ(WorkerPoolStatus::BUSY, _module_under_test.try_wakeup());
+    std::tie(status, late_workers) = _module_under_test.wakeup_and_wait_until(current_rt_time() + 1ms);
+    ASSERT_EQ(WorkerPoolStatus::BUSY, status);
+    ASSERT_EQ(0b10u, late_workers);
+    ASSERT_EQ(0b10u, _module_under_test.wait_for_workers_idle_until(current_rt_time() + 1ms));
+    ASSERT_FALSE(a);
+
+    stall = false;
+    ASSERT_EQ(0u, _module_under_test.wait_for_workers_idle_until(current_rt_time() + 1s));
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.try_wakeup(0b01));
+    _module_under_test.wait_for_workers_idle();
+    ASSERT_TRUE(a);
+    std::tie(status, late_workers) = _module_under_test.wakeup_and_wait_until(current_rt_time() + 1s);
+    ASSERT_EQ(WorkerPoolStatus::OK, status);
+    ASSERT_EQ(0u, late_workers);
+}
+
+TEST_F(PthreadWorkerPoolTest, TestRemoveAndReplaceWorkers)
+{
+    std::array<std::atomic_int, 3> counters{};
+    auto count = [](void* data) {reinterpret_cast<std::atomic_int*>(data)->fetch_add(1);};
+    auto res = _module_under_test.add_worker(count, &counters[0]);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+    res = _module_under_test.add_worker(count, &counters[1]);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+
+    ASSERT_EQ(WorkerPoolStatus::INVALID_ARGUMENTS, _module_under_test.remove_worker(2));
+    ASSERT_EQ(WorkerPoolStatus::INVALID_ARGUMENTS, _module_under_test.replace_callback(-1, count, &counters[2]));
+    ASSERT_EQ(WorkerPoolStatus::INVALID_ARGUMENTS, _module_under_test.replace_callback(1, nullptr, nullptr));
+
+    /* Changes are applied by the thread cycling the pool */
+    std::atomic_bool cycling = true;
+    std::thread controller([&]()
+    {
+        while (cycling)
+        {
+            _module_under_test.wakeup_and_wait();
+        }
+    });
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.remove_worker(0));
+    int removed_count = counters[0];
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.replace_callback(1, count, &counters[2]));
+    int replaced_count = counters[1];
+    while (counters[2] < 10)
+    {
+        std::this_thread::yield();
+    }
+    cycling = false;
+    controller.join();
+    ASSERT_EQ(removed_count, counters[0]);
+    ASSERT_EQ(replaced_count, counters[1]);
+    ASSERT_EQ(WorkerPoolStatus::INVALID_ARGUMENTS, _module_under_test.remove_worker(0));
+
+    /* The remaining worker should still take its share of a range */
+    std::array<int, 100> values{};
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.parallel_for(0, 100, 10, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; ++i)
+        {
+            values[i] = i;
+        }
+    }, ChunkScheduling::STATIC));
+    for (int i = 0; i < 100; ++i)
+    {
+        ASSERT_EQ(i, values[i]);
+    }
+
+    /* The id of the removed worker is reused */
+    res = _module_under_test.add_worker(count, &counters[0]);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+    ASSERT_EQ(2u, _module_under_test._workers.size());
+    _module_under_test.wakeup_and_wait(0b01);
+    ASSERT_EQ(removed_count + 1, counters[0]);
+}
+
+TEST_F(PthreadWorkerPoolTest, TestChangeWorkersWithoutCycles)
+{
+    std::array<std::atomic_int, 2> counters{};
+    auto count = [](void* data) {reinterpret_cast<std::atomic_int*>(data)->fetch_add(1);};
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.add_worker(count, &counters[0]));
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.add_worker(count, &counters[1]));
+
+    /* Changes are only applied by the thread cycling the pool, with no new cycle they
+     * are given up and the pool is left as it was */
+    ASSERT_EQ(WorkerPoolStatus::BUSY, _module_under_test.remove_worker(0));
+    ASSERT_NE(nullptr, _module_under_test._workers[0]);
+    ASSERT_EQ(2, _module_under_test._no_workers);
+    ASSERT_EQ(0u, _module_under_test._pending_changes);
+    ASSERT_FALSE(_module_under_test._workers[0]->change_pending());
+    _module_under_test.wakeup_and_wait();
+    ASSERT_EQ(1, counters[0]);
+    ASSERT_EQ(1, counters[1]);
+}
+
+TEST_F(PthreadWorkerPoolTest, TestLoadBalancing)
+{
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.set_load_balancing(true));
+    auto res = _module_under_test.add_worker(worker_function, &a);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+    res = _module_under_test.add_worker(worker_function, &b, DEFAULT_SCHED_PRIORITY, 0);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+    ASSERT_TRUE(_module_under_test._workers[1]->pinned());
+
+    for (int i = 0; i < 2 * LOAD_WINDOW_CYCLES; ++i)
+    {
+        a = false;
+        b = false;
+        _module_under_test.wakeup_and_wait();
+        ASSERT_TRUE(a);
+        ASSERT_TRUE(b);
+    }
+    ASSERT_GT(_module_under_test._workers[0]->load().count(), 0);
+    ASSERT_EQ(0, _module_under_test._workers[1]->cpu_id());
+}
+
+TEST_F(PthreadWorkerPoolTest, TestTimingStats)
+{
+    using namespace std::chrono_literals;
+    auto busy_wait = [](void*)
+    {
+        auto end = current_rt_time() + 20us;
+        while (current_rt_time() < end) {}
+    };
+    auto res = _module_under_test.add_worker(busy_wait, nullptr);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+    ASSERT_EQ(WorkerPoolStatus::INVALID_ARGUMENTS, _module_under_test.set_timing_stats(true, -1us));
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.set_timing_stats(true, 10us));
+
+    for (int i = 0; i < 10; ++i)
+    {
+        _module_under_test.wakeup_and_wait();
+    }
+    WorkerTimingStats stats;
+    ASSERT_EQ(WorkerPoolStatus::INVALID_ARGUMENTS, _module_under_test.get_timing_stats(1, stats));
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.get_timing_stats(0, stats));
+    ASSERT_EQ(10u, stats.cycles);
+    ASSERT_EQ(10u, stats.overruns);
+    ASSERT_GE(stats.duration.min, 20us);
+    ASSERT_GE(stats.wake_offset.min, 0ns);
+
+    /* Not recorded when disabled */
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.set_timing_stats(false));
+    _module_under_test.wakeup_and_wait();
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.get_timing_stats(0, stats));
+    ASSERT_EQ(10u, stats.cycles);
+}
+
+TEST_F(PthreadWorkerPoolTest, TestTracing)
+{
+    const char* file_name = "twine_pool_trace_test.json";
+    auto res = _module_under_test.add_worker(worker_function, &a);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+    ASSERT_EQ(WorkerPoolStatus::OK, start_tracing());
+    _module_under_test.wakeup_and_wait();
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.parallel_for(0, 10, 5, [](int, int) {}));
+    stop_tracing();
+    ASSERT_EQ(WorkerPoolStatus::OK, write_trace(file_name));
+
+    std::ifstream file(file_name);
+    std::string trace((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    std::remove(file_name);
+    EXPECT_NE(std::string::npos, trace.find("\"name\":\"twine worker 0\""));
+    for (auto event : {"release", "wake", "callback", "parallel_for", "arrive"})
+    {
+        EXPECT_NE(std::string::npos, trace.find("{\"name\":\"" + std::string(event) + "\"")) << event;
+    }
+}
+
+struct ScratchTestData
+{
+    std::array<void*, 2> allocations;
+    std::atomic_bool     exhausted{false};
+};
+
+void scratch_function(void* data)
+{
+    auto test_data = static_cast<ScratchTestData*>(data);
+    test_data->allocations[0] = scratch_allocate(1000);
+    test_data->allocations[1] = scratch_allocate(1000, 128);
+    test_data->exhausted = scratch_allocate(1024 * 1024) == nullptr;
+}
+
+TEST_F(PthreadWorkerPoolTest, TestScratchArena)
+{
+    /* Not available outside of workers */
+    ASSERT_EQ(nullptr, scratch_allocate(16));
+
+    ScratchTestData data;
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.set_scratch_arena(64 * 1024));
+    auto res = _module_under_test.add_worker(scratch_function, &data);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.set_scratch_arena(0));
+    res = _module_under_test.add_worker(worker_function, &a);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+    ASSERT_EQ(nullptr, _module_under_test._workers[1]->_scratch_arena.allocate(16, 8));
+
+    _module_under_test.wakeup_and_wait();
+    auto first_cycle = data.allocations;
+    ASSERT_NE(nullptr, first_cycle[0]);
+    ASSERT_NE(nullptr, first_cycle[1]);
+    ASSERT_EQ(0u, reinterpret_cast<uintptr_t>(first_cycle[1]) % 128);
+    ASSERT_TRUE(data.exhausted);
+
+    /* The arena is reset between cycles, so the same memory is handed out again */
+    _module_under_test.wakeup_and_wait();
+    ASSERT_EQ(first_cycle, data.allocations);
+    ASSERT_EQ(0u, _module_under_test._workers[0]->_scratch_arena.used());
+}
+
+#ifndef __APPLE__
+TEST_F(PthreadWorkerPoolTest, TestDeadlineScheduling)
+{
+    using namespace std::chrono_literals;
+    ASSERT_EQ(WorkerPoolStatus::INVALID_ARGUMENTS, _module_under_test.set_deadline_scheduling(2ms, 1ms, 1ms));
+    ASSERT_EQ(WorkerPoolStatus::INVALID_ARGUMENTS, _module_under_test.set_deadline_scheduling(100us, 2ms, 1ms));
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.set_deadline_scheduling(100us, 1ms, 1ms));
+
+    /* Deadline workers can not be pinned */
+    ASSERT_EQ(WorkerPoolStatus::INVALID_ARGUMENTS, _module_under_test.add_worker(worker_function, &a,
+                                                                                DEFAULT_SCHED_PRIORITY, 0));
+    /* Record the scheduling policy the workers run under */
+    std::array<int, 2> policies{-1, -1};
+    auto get_policy = [](void* data) {*reinterpret_cast<int*>(data) = sched_getscheduler(0);};
+    auto res = _module_under_test.add_worker(get_policy, &policies[0]);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+    ASSERT_EQ(-1, _module_under_test._workers[0]->cpu_id());
+
+    /* Back to SCHED_FIFO for new workers */
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.set_deadline_scheduling(0ns, 0ns, 0ns));
+    res = _module_under_test.add_worker(get_policy, &policies[1]);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+
+    _module_under_test.wakeup_and_wait();
+    ASSERT_EQ(static_cast<int>(SCHED_DEADLINE_POLICY), policies[0]);
+    ASSERT_EQ(SCHED_FIFO, policies[1]);
+}
+#endif
+
+#ifndef __APPLE__
+TEST_F(PthreadWorkerPoolTest, TestWorkerStack)
+{
+    constexpr size_t STACK_SIZE = 256 * 1024;
+    constexpr size_t GUARD_SIZE = 2 * 4096;
+    ASSERT_EQ(WorkerPoolStatus::INVALID_ARGUMENTS, _module_under_test.set_worker_stack(1024, GUARD_SIZE, true));
+    ASSERT_EQ(WorkerPoolStatus::OK, _module_under_test.set_worker_stack(STACK_SIZE, GUARD_SIZE, true));
+    auto res = _module_under_test.add_worker(worker_function, &a);
+    ASSERT_EQ(WorkerPoolStatus::OK, res);
+
+    pthread_attr_t task_attributes;
+    ASSERT_EQ(0, pthread_getattr_np(_module_under_test._workers[0]->_thread_handle, &task_attributes));
+    void* stack_address;
+    size_t stack_size;
+    size_t guard_size;
+    pthread_attr_getstack(&task_attributes, &stack_address, &stack_size);
+    pthread_attr_getguardsize(&task_attributes, &guard_size);
+    pthread_attr_destroy(&task_attributes);
+    ASSERT_GE(stack_size, STACK_SIZE);
+    ASSERT_EQ(GUARD_SIZE, guard_size);
+
+    /* The whole stack should be resident before the worker has run a cycle */
+    long page_size = sysconf(_SC_PAGESIZE);
+    auto stack_begin = static_cast<char*>(stack_address) + GUARD_SIZE;
+    std::vector<unsigned char> resident((stack_size - GUARD_SIZE + page_size - 1) / page_size);
+    ASSERT_EQ(0, mincore(stack_begin, stack_size - GUARD_SIZE, resident.data()));
+    for (auto page : resident)
+    {
+        ASSERT_TRUE(page & 1);
+    }
+    _module_under_test.wakeup_and_wait();
+    ASSERT_TRUE(a);
+}
+#endif
+
 TEST_F(PthreadWorkerPoolTest, TestWrongPriority)
 {
     auto res = _module_under_test.add_worker(worker_function, nullptr, -17);
@@ -128,6 +1193,8 @@ TEST_F(PthreadWorkerPoolTest, TestWrongPriority)
 #ifndef __APPLE__
 TEST_F(PthreadWorkerPoolTest, TestAutomaticAffinity)
 {
+    /* Placement depends on the topology, with a uniform one workers are spread in order */
+    _module_under_test._topology = CpuTopology(N_TEST_WORKERS);
     for (int i=0; i<N_TEST_WORKERS; i++)
     {
         auto res = _module_under_test.add_worker(worker_function, nullptr);